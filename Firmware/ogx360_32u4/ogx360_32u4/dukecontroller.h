@@ -105,10 +105,20 @@ const uint8_t PROGMEM DUKE_USB_DESCRIPTOR_CONFIGURATION[] = {
 	0x04 //bInterval, Interval for polling the interrupt endpoint. 4ms
 };
 
+#ifdef SUPPORTOVERCLOCK
+//Same as above but both endpoints advertise OVERCLOCK_INTERVAL ms polling.
+const uint8_t PROGMEM DUKE_USB_DESCRIPTOR_CONFIGURATION_FAST[] = {
+	0x09, 0x02, 0x20, 0x00, 0x01, 0x01, 0x00, 0x80, 0xFA,
+	0x09, 0x04, 0x00, 0x00, 0x02, 0x58, 0x42, 0x00, 0x00,
+	0x07, 0x05, 0x81, 0x03, 0x20, 0x00, OVERCLOCK_INTERVAL,
+	0x07, 0x05, 0x02, 0x03, 0x20, 0x00, OVERCLOCK_INTERVAL
+};
+#endif
+
 
 //Obtained from USB analyser dump of original controller when talking to console
 //This is a custom vendor request specific to the xbox controller and an OG xbox.
-const uint8_t DUKE_HID_DESCRIPTOR_XID[] = {
+const uint8_t PROGMEM DUKE_HID_DESCRIPTOR_XID[] = {
 	0x10,   //bLength - Length of report. 16 bytes
 	0x42,   //bDescriptorType - always 0x42
 	0x00, 0x01,  //bcdXid
@@ -123,7 +133,7 @@ const uint8_t DUKE_HID_DESCRIPTOR_XID[] = {
 //It will have bits set (1) where the bit is valid in the controller button report.
 //If the bit is auto-generated, it will be cleared (0). Refer http://xboxdevwiki.net/Xbox_Input_Devices
 //Obtained from a USB analyser dump when talking with console.
-const uint8_t DUKE_HID_CAPABILITIES_IN[]  = {
+const uint8_t PROGMEM DUKE_HID_CAPABILITIES_IN[] = {
 	0x00,   //Always 0x00
 	0x14,   //bLength - length of packet in bytes
 	0xFF,
@@ -139,7 +149,7 @@ const uint8_t DUKE_HID_CAPABILITIES_IN[]  = {
 
 //It will have bits set (1) where the bit is valid in the controller rumnble report.
 //Obtained from a USB analyser dump when talking with console.
-const uint8_t DUKE_HID_CAPABILITIES_OUT[] = {
+const uint8_t PROGMEM DUKE_HID_CAPABILITIES_OUT[] = {
 	0x00, //Always 0x00
 	0x06, //bLength - length of packet in bytes
 	0xFF, 0xFF,0xFF, 0xFF //bits corresponding to the rumble bits. all 0xFF as they are used.
@@ -94,16 +94,27 @@ typedef MAX3421e<P10, P9> MAX3421E; // Official Arduinos (UNO, Duemilanove, Mega
 #define USB_ERROR_FailGetDevDescr                       0xE1
 #define USB_ERROR_FailSetDevTblEntry                    0xE2
 #define USB_ERROR_FailGetConfDescr                      0xE3
+#define USB_ERROR_DEVICE_BACKOFF                        0xE4
 #define USB_ERROR_TRANSFER_TIMEOUT                      0xFF
 
-#define USB_XFER_TIMEOUT        5000    // (5000) USB transfer timeout in milliseconds, per section 9.2.6.1 of USB 2.0 spec
+#define USB_XFER_TIMEOUT        500     // control transfer timeout in milliseconds, per section 9.2.6.4 of USB 2.0 spec
+#define USB_INT_XFER_TIMEOUT    3000    // timeout in microseconds for endpoints polled with USB_NAK_NOWAIT, a few frames
 //#define USB_NAK_LIMIT         32000   // NAK limit for a transfer. 0 means NAKs are not counted
 #define USB_RETRY_LIMIT         3       // 3 retry limit for a transfer
-#define USB_SETTLE_DELAY        200     // settle delay in milliseconds
+#define USB_BACKOFF_THRESHOLD   3       // consecutive failed data transfers before a device is backed off
+#define USB_BACKOFF_MAX_POWER   6       // backoff doubles from 1ms up to 2^6 = 64ms
+#define USB_SETTLE_DELAY        100     // settle delay in milliseconds, attach debounce (TATTDB) per section 7.1.7.3 of USB 2.0 spec
 
 #define USB_NUMDEVICES          16      //number of USB devices
 //#define HUB_MAX_HUBS          7       // maximum number of hubs that can be attached to the host controller
 #define HUB_PORT_RESET_DELAY    20      // hub port reset delay 10 ms recomended, can be up to 20 ms
+#define USB_ENUM_RESET_DELAY    102     // wait after the reset left behind by a failed attempt, 100ms plus some for clock inaccuracy
+#define USB_ENUM_RETRY_DELAY    100     // wait before retrying a device that answered with hrJERR
+
+// Default enumeration timing, the USB 2.0 minimums. Devices that need longer have an entry in UsbTimingQuirks[] (Usb.cpp).
+#define USB_RESET_RECOVERY      10      // reset recovery (TRSTRCY) per section 7.1.7.5 of USB 2.0 spec
+#define USB_SETADDR_RECOVERY    2       // SET_ADDRESS recovery (TDSETADDR) per section 9.2.6.3 of USB 2.0 spec
+#define USB_SETCONF_DELAY       0       // extra wait before SET_CONFIGURATION
 
 /* USB state machine states */
 #define USB_STATE_MASK                                      0xf0
@@ -123,6 +134,48 @@ typedef MAX3421e<P10, P9> MAX3421E; // Official Arduinos (UNO, Duemilanove, Mega
 #define USB_STATE_RUNNING                                   0x90
 #define USB_STATE_ERROR                                     0xa0
 
+/* Stages of a device being configured, see USB::AttemptConfig() */
+#define USB_ENUM_IDLE                                       0x00
+#define USB_ENUM_CONFIGURE                                  0x01 // call ConfigureDevice()
+#define USB_ENUM_RESET                                      0x02 // driver asked for an additional reset
+#define USB_ENUM_RESET_RECOVERY                             0x03 // wait for the reset to finish
+#define USB_ENUM_INIT                                       0x04 // call Init() until it stops returning USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE
+
+// Driver classes, see UsbDriverTable[] (Usb.cpp)
+#define USB_DRIVER_NONE                                     0x00
+#define USB_DRIVER_HUB                                      0x01
+#define USB_DRIVER_XBOXRECV                                 0x02
+#define USB_DRIVER_XBOXUSB                                  0x03
+#define USB_DRIVER_XBOXONE                                  0x04
+#define USB_DRIVER_CLASSES                                  0x05
+
+typedef struct {
+        uint16_t vid;
+        uint16_t pid;
+        uint8_t driverClass;
+} USB_DRIVER_ENTRY;
+
+// Enumeration timing (ms) of the device being configured
+typedef struct {
+        uint16_t resetRecovery; // after a reset, before talking to the device
+        uint16_t setAddrRecovery; // after SET_ADDRESS, before using the new address
+        uint16_t setConfDelay; // before SET_CONFIGURATION
+} USB_ENUM_TIMING;
+
+typedef struct {
+        uint16_t vid;
+        uint16_t pid;
+        USB_ENUM_TIMING timing;
+} USB_TIMING_QUIRK;
+
+// Transfer error counters since power-on, they saturate at 0xFFFF
+typedef struct {
+        uint16_t timeouts; // transfer deadline passed, or the device didn't answer USB_RETRY_LIMIT times
+        uint16_t nakLimits; // nak_limit reached on an endpoint that waits for data (not USB_NAK_NOWAIT)
+        uint16_t toggleErrors;
+        uint16_t backoffs; // transfers skipped because the device was backed off
+} USB_XFER_STATS;
+
 class USBDeviceConfig {
 public:
 
@@ -146,6 +199,10 @@ public:
                 return 0;
         }
 
+        virtual uint8_t GetDriverClass() {
+                return USB_DRIVER_NONE;
+        }
+
         virtual void ResetHubPort(uint8_t port __attribute__((unused))) {
                 return;
         } // Note used for hubs only!
@@ -199,11 +256,37 @@ public:
         virtual void Parse(const uint16_t len, const uint8_t *pbuf, const uint16_t &offset) = 0;
 };
 
+// Receives the packets read by USB::pollInPipes(). index is the endpoint's position in the eps[] passed in.
+// Called while the next IN is on the bus, so it must not start a transfer of its own.
+
+class USBInPipeParser {
+public:
+        virtual void ParseIn(uint8_t index, uint8_t len, uint8_t *pbuf) = 0;
+};
+
 class USB : public MAX3421E {
         AddressPoolImpl<USB_NUMDEVICES> addrPool;
         USBDeviceConfig* devConfig[USB_NUMDEVICES];
         uint8_t bmHubPre;
 
+        // The one device that is part way through being configured. Only one device can sit on address 0
+        // at a time, so there is never more than one of these.
+        uint8_t enumStage;
+        uint8_t enumDriver;
+        uint8_t enumParent;
+        uint8_t enumPort;
+        bool enumLowspeed;
+        uint8_t enumRetries;
+        uint32_t enumDeadline; // next stage doesn't start before this
+        USB_ENUM_TIMING enumTiming;
+        uint32_t enumStart; // when Configuring() read the device descriptor
+        uint16_t configureTime[USB_DRIVER_CLASSES]; // ms the last device of each driver class took to configure
+        uint16_t ctrlReqCount; // control transfers issued, wraps
+
+        UsbDevice *xferDev; // device selected by the last SetAddress()
+        uint32_t xferTimeout; // us, how long the transfer on xferDev may take
+        USB_XFER_STATS xferStats;
+
 public:
         USB(void);
 
@@ -252,6 +335,7 @@ public:
         uint8_t ctrlStatus(uint8_t ep, bool direction, uint16_t nak_limit);
         uint8_t inTransfer(uint8_t addr, uint8_t ep, uint16_t *nbytesptr, uint8_t* data, uint8_t bInterval = 0);
         uint8_t outTransfer(uint8_t addr, uint8_t ep, uint16_t nbytes, uint8_t* data);
+        uint8_t pollInPipes(uint8_t addr, const uint8_t *eps, uint8_t count, uint8_t *data, uint8_t nbytes, USBInPipeParser *parser, uint8_t *nakMask = NULL);
         uint8_t dispatchPkt(uint8_t token, uint8_t ep, uint16_t nak_limit);
 
         void Task(void);
@@ -260,6 +344,26 @@ public:
         uint8_t Configuring(uint8_t parent, uint8_t port, bool lowspeed);
         uint8_t ReleaseDevice(uint8_t addr);
 
+        bool isConfiguring() {
+                return (enumStage != USB_ENUM_IDLE);
+        };
+
+        const USB_ENUM_TIMING& getEnumTiming() {
+                return enumTiming;
+        };
+
+        uint16_t getConfigureTime(uint8_t driverClass) {
+                return configureTime[driverClass];
+        };
+
+        uint16_t getCtrlReqCount() {
+                return ctrlReqCount;
+        };
+
+        const USB_XFER_STATS& getXferStats() {
+                return xferStats;
+        };
+
         uint8_t ctrlReq(uint8_t addr, uint8_t ep, uint8_t bmReqType, uint8_t bRequest, uint8_t wValLo, uint8_t wValHi,
                 uint16_t wInd, uint16_t total, uint16_t nbytes, uint8_t* dataptr, USBReadParser *p);
 
@@ -268,7 +372,18 @@ private:
         uint8_t SetAddress(uint8_t addr, uint8_t ep, EpInfo **ppep, uint16_t *nak_limit);
         uint8_t OutTransfer(EpInfo *pep, uint16_t nak_limit, uint16_t nbytes, uint8_t *data);
         uint8_t InTransfer(EpInfo *pep, uint16_t nak_limit, uint16_t *nbytesptr, uint8_t *data, uint8_t bInterval = 0);
+        uint8_t WaitTransferDone(uint32_t deadline);
+        bool InBackoff(UsbDevice *p);
+        void NoteTransferResult(UsbDevice *p, uint8_t rcode);
+        void CountError(uint16_t &counter) {
+                if(counter != 0xFFFF)
+                        counter++;
+        };
         uint8_t AttemptConfig(uint8_t driver, uint8_t parent, uint8_t port, bool lowspeed);
+        uint8_t ContinueConfiguring();
+        void ResetDevicePort(uint8_t parent, uint8_t port);
+        void LoadEnumTiming(uint16_t vid, uint16_t pid);
+        uint8_t FindDriverClass(uint16_t vid, uint16_t pid, uint8_t klass);
 };
 
 #if 0 //defined(USB_METHODS_INLINE)
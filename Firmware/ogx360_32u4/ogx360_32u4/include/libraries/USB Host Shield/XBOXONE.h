@@ -25,6 +25,7 @@
 
 #include "Usb.h"
 #include "xboxEnums.h"
+#include "timebase.h"
 
 /* Xbox One data taken from descriptors */
 #define XBOX_ONE_EP_MAXPKTSIZE                  32 // Max size for data via USB
@@ -100,6 +101,14 @@ public:
                 return bAddress;
         };
 
+        /**
+         * Used by the USB core to go straight to this driver for the devices in UsbDriverTable.
+         * @return The driver class.
+         */
+        virtual uint8_t GetDriverClass() {
+                return USB_DRIVER_XBOXONE;
+        };
+
         /**
          * Used to check if the controller has been initialized.
          * @return True if it's ready.
@@ -151,6 +160,12 @@ public:
          */
         int16_t getAnalogHat(AnalogHatEnum a);
 
+        /**
+         * Used to check if anything the mapping reads has changed: buttons, sticks or triggers.
+         * @return            True if the input has changed since the last call.
+         */
+        bool inputChanged();
+
         /**
          * Used to call your own function when the controller is successfully initialized.
          * @param funcOnInit Function to call.
@@ -184,6 +199,9 @@ protected:
         USB *pUsb;
         /** Device address. */
         uint8_t bAddress;
+        /** How far Init() got and when it can carry on. */
+        uint8_t bInitState;
+        uint32_t qNextInitTime;
         /** Endpoint info structure. */
         EpInfo epInfo[XBOX_ONE_MAX_ENDPOINTS];
 
@@ -192,7 +210,7 @@ protected:
         /** Total number of endpoints in the configuration. */
         uint8_t bNumEP;
         /** Next poll time based on poll interval taken from the USB descriptor. */
-        uint32_t qNextPollTime;
+        deadline_t qNextPollTime;
 
         /** @name UsbConfigXtracter implementation */
         /**
@@ -227,10 +245,11 @@ private:
         uint16_t ButtonState;
         uint16_t OldButtonState;
         uint16_t ButtonClickState;
+        bool inputStateChanged; // True if a button, stick or trigger has changed
         int16_t hatValue[4];
         uint16_t triggerValue[2];
         uint16_t triggerValueOld[2];
-				uint32_t enableInputTimer; //Timing for checkStatus() signals
+				uint16_t enableInputTimer; //Timing for checkStatus() signals, timebase_now
 
         bool L2Clicked; // These buttons are analog, so we use we use these bools to check if they where clicked or not
         bool R2Clicked;
@@ -238,9 +257,16 @@ private:
         uint8_t readBuf[XBOX_ONE_EP_MAXPKTSIZE]; // General purpose buffer for input data
         uint8_t cmdCounter;
 
+        /* Outbound commands, sent one per Poll() by sendQueuedCommand() */
+        uint8_t enableInputPending; // enableInput() commands still to send
+        uint8_t rumbleValue[4]; // Latest rumble asked for, only the newest value is sent
+        bool rumblePending;
+        uint16_t cmdTimer; // timebase_ticks() of the last OUT transfer
+
         void readReport(); // Used to read the incoming data
 
         /* Private commands */
         uint8_t XboxCommand(uint8_t* data, uint16_t nbytes);
+        void sendQueuedCommand();
 };
 #endif
\ No newline at end of file
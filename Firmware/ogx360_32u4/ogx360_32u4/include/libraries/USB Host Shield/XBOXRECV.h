@@ -22,6 +22,7 @@
 
 #include "Usb.h"
 #include "xboxEnums.h"
+#include "timebase.h"
 
 /* Data Xbox 360 taken from descriptors */
 #define EP_MAXPKTSIZE       32 // max size for data via USB
@@ -51,6 +52,11 @@
 
 #define XBOX_MAX_ENDPOINTS   17
 
+#define XBOXRECV_CMD_QUEUE_SIZE 4 // Outbound commands waiting per controller, rumble is kept separately
+
+#define XBOXRECV_IDLE_NAKS 8 // An empty slot that NAKs this many polls in a row is only polled every XBOXRECV_IDLE_POLL_INTERVAL
+#define XBOXRECV_IDLE_POLL_INTERVAL 8 // ms
+
 
 enum ChatPadButton {
 	//Offset byte 26 or 27. You can get 2 buttons are once on the chatpad,
@@ -109,6 +115,11 @@ enum ChatPadButton {
 	CHATPAD_MESSENGER=8,
 };
 
+//Chatpad state is kept as 8 byte (64 key) bitmaps, built once per chatpad report. Key codes are row<<4 | column,
+//rows 1-7 go in bytes 0-6 with the column as the bit, and the modifiers take the low bits of byte 7.
+#define CHATPAD_KEY_BYTES 8
+#define CHATPAD_KEY_INDEX(b) ((b) < 16 ? 56 + ((b) == 2) + ((b) == 4) * 2 + ((b) == 8) * 3 : (((b) >> 4) - 1) * 8 + ((b) & 7))
+
 #define CHATPAD_LED_CAPSLOCK_OFF 0x00
 #define CHATPAD_LED_GREEN_OFF 0x01
 #define CHATPAD_LED_ORANGE_OFF 0x02
@@ -124,7 +135,7 @@ enum ChatPadButton {
  *
  * Up to four controllers can connect to one receiver, if more is needed one can use a second receiver via the USBHub class.
  */
-class XBOXRECV : public USBDeviceConfig {
+class XBOXRECV : public USBDeviceConfig, public USBInPipeParser {
 public:
         /**
          * Constructor for the XBOXRECV class.
@@ -159,6 +170,22 @@ public:
          * @return 0 on success.
          */
         uint8_t Poll();
+        /**
+         * Called by USB::pollInPipes() with the report read from one of the input pipes.
+         * @param index Position of the pipe in the list given to pollInPipes(), see pollSlot[].
+         * @param len   Length of the report.
+         * @param pbuf  The report, this is readBuf.
+         */
+        void ParseIn(uint8_t index, uint8_t len, uint8_t *pbuf);
+
+        /**
+         * Number of polls in a row a controller's input pipe answered with NAK.
+         * @param  controller The controller to read from.
+         * @return            Saturates at 0xFF.
+         */
+        uint8_t getNakStreak(uint8_t controller) {
+                return nakStreak[controller];
+        };
 
         /**
          * Get the device address.
@@ -168,6 +195,14 @@ public:
                 return bAddress;
         };
 
+        /**
+         * Used by the USB core to go straight to this driver for the devices in UsbDriverTable.
+         * @return The driver class.
+         */
+        virtual uint8_t GetDriverClass() {
+                return USB_DRIVER_XBOXRECV;
+        };
+
         /**
          * Used to check if the controller has been initialized.
          * @return True if it's ready.
@@ -288,6 +323,12 @@ public:
          * @return            True if a button has changed.
          */
         bool buttonChanged(uint8_t controller = 0);
+        /**
+         * Used to check if anything the mapping reads has changed: buttons, sticks, triggers or chatpad keys.
+         * @param  controller The controller to read from. Default to 0.
+         * @return            True if the input has changed since the last call.
+         */
+        bool inputChanged(uint8_t controller = 0);
 
         /**
          * Used to call your own function when the controller is successfully initialized.
@@ -305,6 +346,8 @@ public:
 		void chatPadKeepAlive2(uint8_t controller); //Ryzee
 		uint8_t getChatPadPress(ChatPadButton b, uint8_t controller); //Ryzee
 		uint8_t getChatPadClick(ChatPadButton b, uint8_t controller); //Ryzee
+		void getChatPadKeys(uint8_t* keys, uint8_t controller); // Fills keys[CHATPAD_KEY_BYTES] with everything held down
+		void takeChatPadClicks(uint8_t* clicks, uint8_t controller); // Fills clicks[CHATPAD_KEY_BYTES] with every click since the last call and clears them
 		void chatPadQueueLed(uint8_t led, uint8_t controller); //Ryzee
 		uint8_t chatPadLedQueue[4][4]; //You can queue up 4 LED commands
 		uint8_t chatPadInitNeeded[4];
@@ -322,6 +365,9 @@ protected:
         USB *pUsb;
         /** Device address. */
         uint8_t bAddress;
+        /** How far Init() got and when it can carry on. */
+        uint8_t bInitState;
+        uint32_t qNextInitTime;
         /** Endpoint info structure. */
         EpInfo epInfo[XBOX_MAX_ENDPOINTS];
         uint8_t chatpadEnabled;
@@ -335,6 +381,13 @@ private:
          */
         void onInit(uint8_t controller);
         void (*pFuncOnInit)(void); // Pointer to function called in onInit()
+        void runInitScript(); // Queues the next due onboarding command for each controller
+        void runHousekeeping(); // Queues the next periodic status/LED/keepalive command
+        uint8_t housekeepingStep; // Step (high bits) and controller (low 2 bits) of the next housekeeping command
+
+        /* Controller onboarding, see XBOXRECV_INIT_SCRIPT */
+        uint8_t initStep[4]; // Next step to send, XBOXRECV_INIT_DONE when there is nothing to do
+        uint8_t initTimer[4]; // (uint8_t)timebase_now when the last step was sent
 
         bool bPollEnable;
 
@@ -343,13 +396,12 @@ private:
         uint32_t OldButtonState[4];
         uint16_t ButtonClickState[4];
         bool buttonStateChanged[4]; // True if a button has changed
+        bool inputStateChanged[4]; // True if a button, stick or chatpad key has changed
 
 
-		  /* Variables to store the chatpad buttons */
-		  uint32_t ChatPadState[4];
-		  uint32_t OldChatPadState[4];
-		  uint32_t ChatPadClickState[4];
-		  bool ChatPadStateChanged[4]; // True if a chatpad button has changed
+		  /* Variables to store the chatpad buttons, see CHATPAD_KEY_INDEX */
+		  uint8_t chatPadKeys[4][CHATPAD_KEY_BYTES]; // Held down as of the last report
+		  uint8_t chatPadClicks[4][CHATPAD_KEY_BYTES]; // Gone down since they were last read
 
         int16_t hatValue[4][4];
         uint16_t controllerStatus[4];
@@ -358,17 +410,37 @@ private:
         bool L2Clicked[4]; // These buttons are analog, so we use we use these bools to check if they where clicked or not
         bool R2Clicked[4];
 
-        uint32_t checkStatusTimer; //Timing for checkStatus() signals
-				uint32_t chatPadLedTimer; //Timing for chat pad led updates
+        uint16_t checkStatusTimer; //Timing for checkStatus() signals, timebase_now
+				uint16_t chatPadLedTimer; //Timing for chat pad led updates, timebase_now
 
         uint8_t readBuf[EP_MAXPKTSIZE]; // General purpose buffer for input data
         uint8_t writeBuf[12]; // General purpose buffer for output data
 
+        /* Outbound commands. Everything sent to a controller is queued and sent by sendQueuedCommand() */
+        struct XboxQueuedCommand {
+                uint8_t b0, b2, b3; // Command is b0 00 b2 b3, padded with zeros
+        };
+        XboxQueuedCommand cmdQueue[4][XBOXRECV_CMD_QUEUE_SIZE];
+        uint8_t cmdCount[4];
+        uint8_t rumbleValue[4][2]; // Latest rumble asked for, only the newest value is sent
+        uint8_t rumbleSent[4][2]; // Rumble the controller already has, used to drop duplicates
+        uint8_t rumblePending; // Bit per controller, rumbleValue needs sending
+        uint8_t cmdNextController; // Round robin between controllers with the same priority
+        uint16_t cmdTimer; // timebase_ticks() of the last OUT transfer
+
+        /* Input pipe polling, see Poll() */
+        uint8_t nakStreak[4]; // Polls in a row that came back NAK
+        uint8_t idlePollTimer[4]; // (uint8_t)timebase_now when an idle slot was last polled
+        uint8_t pollSlot[4]; // Controller for each endpoint handed to pollInPipes()
+
         void readReport(uint8_t controller); // read incoming data
         void printReport(uint8_t controller, uint8_t nBytes); // print incoming date - Uncomment for debugging
 
         /* Private commands */
-        void XboxCommand(uint8_t controller, uint8_t* data, uint16_t nbytes);
+        uint8_t XboxCommand(uint8_t controller, uint8_t* data, uint16_t nbytes);
+        void queueCommand(uint8_t controller, uint8_t b0, uint8_t b2, uint8_t b3);
+        bool sendQueuedCommand(); // Sends the most important queued command if the receiver is ready for one
+        void clearCommands(uint8_t controller);
 				void chatPadProcessLed(uint8_t controller);
        //void checkStatus(); moved to public function - Ryzee
 };
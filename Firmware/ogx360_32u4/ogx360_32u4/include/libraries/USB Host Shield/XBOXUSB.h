@@ -21,6 +21,7 @@
 #include "Usb.h"
 #include "usbhid.h"
 #include "xboxEnums.h"
+#include "timebase.h"
 
 /* Data Xbox 360 taken from descriptors */
 #define EP_MAXPKTSIZE       32 // max size for data via USB
@@ -48,6 +49,8 @@
 
 #define XBOX_REPORT_BUFFER_SIZE 14 // Size of the input report buffer
 
+#define XBOXUSB_CMD_QUEUE_SIZE 5 // Room for the four onboarding commands and the player LED
+
 //#define XBOX_MAX_ENDPOINTS   3
 
 /** This class implements support for a Xbox wired controller via USB. */
@@ -87,6 +90,14 @@ public:
                 return bAddress;
         };
 
+        /**
+         * Used by the USB core to go straight to this driver for the devices in UsbDriverTable.
+         * @return The driver class.
+         */
+        virtual uint8_t GetDriverClass() {
+                return USB_DRIVER_XBOXUSB;
+        };
+
         /**
          * Used to check if the controller has been initialized.
          * @return True if it's ready.
@@ -129,6 +140,12 @@ public:
          */
         int16_t getAnalogHat(AnalogHatEnum a);
 
+        /**
+         * Used to check if anything the mapping reads has changed: buttons, sticks or triggers.
+         * @return            True if the input has changed since the last call.
+         */
+        bool inputChanged();
+
         /** Turn rumble off and all the LEDs on the controller. */
         void setAllOff() {
                 setRumbleOn(0, 0);
@@ -190,6 +207,9 @@ protected:
         USB *pUsb;
         /** Device address. */
         uint8_t bAddress;
+        /** How far Init() got and when it can carry on. */
+        uint8_t bInitState;
+        uint32_t qNextInitTime;
         /** Endpoint info structure. */
         EpInfo epInfo[3];
 
@@ -208,6 +228,7 @@ private:
         uint32_t ButtonState;
         uint32_t OldButtonState;
         uint16_t ButtonClickState;
+        bool inputStateChanged; // True if a button, stick or trigger has changed
         int16_t hatValue[4];
         uint16_t controllerStatus;
 
@@ -217,10 +238,19 @@ private:
         uint8_t readBuf[EP_MAXPKTSIZE]; // General purpose buffer for input data
         uint8_t writeBuf[8]; // General purpose buffer for output data
 
+        /* Outbound commands, sent one per Poll() by sendQueuedCommand() */
+        uint8_t cmdQueue[XBOXUSB_CMD_QUEUE_SIZE][3]; // Three byte commands (LEDs, onboarding), oldest first
+        uint8_t cmdCount;
+        uint8_t rumbleValue[2]; // Latest rumble asked for, only the newest value is sent
+        bool rumblePending;
+        uint16_t cmdTimer; // timebase_ticks() of the last OUT transfer
+
         void readReport(); // read incoming data
         void printReport(); // print incoming date - Uncomment for debugging
 
         /* Private commands */
         void XboxCommand(uint8_t* data, uint16_t nbytes);
+        void queueCommand(uint8_t b0, uint8_t b1, uint8_t b2);
+        void sendQueuedCommand();
 };
 #endif
\ No newline at end of file
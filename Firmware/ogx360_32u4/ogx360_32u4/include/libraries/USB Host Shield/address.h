@@ -77,6 +77,8 @@ struct UsbDevice {
     UsbDeviceAddress address;
     uint8_t epcount; // number of endpoints
     bool lowspeed; // indicates if a device is the low speed one
+    uint8_t errorCount; // consecutive failed data transfers, see USB::NoteTransferResult()
+    uint8_t backoffUntil; // (uint8_t)timebase_now before which data transfers are skipped
     //   uint8_t devclass; // device class
 } __attribute__((packed));
 
@@ -107,6 +109,8 @@ class AddressPoolImpl : public AddressPool {
         thePool[index].address.devAddress = 0;
         thePool[index].epcount = 1;
         thePool[index].lowspeed = 0;
+        thePool[index].errorCount = 0;
+        thePool[index].backoffUntil = 0;
         thePool[index].epinfo = &dev0ep;
     };
 
@@ -18,9 +18,12 @@ e-mail   :  support@circuitsathome.com
 #define __USBHUB_H__
 
 #include "Usb.h"
+#include "timebase.h"
 
 #define USB_DESCRIPTOR_HUB                      0x09 // Hub descriptor type
 
+#define HUB_POLL_INTERVAL                       100  // Longest time between status change endpoint polls (ms)
+
 // Hub Requests
 #define bmREQ_CLEAR_HUB_FEATURE                 USB_SETUP_HOST_TO_DEVICE|USB_SETUP_TYPE_CLASS|USB_SETUP_RECIPIENT_DEVICE
 #define bmREQ_CLEAR_PORT_FEATURE                USB_SETUP_HOST_TO_DEVICE|USB_SETUP_TYPE_CLASS|USB_SETUP_RECIPIENT_OTHER
@@ -170,8 +173,14 @@ class USBHub : USBDeviceConfig {
 
         uint8_t bAddress; // address
         uint8_t bNbrPorts; // number of ports
-        //        uint8_t bInitState; // initialization state variable
-        uint32_t qNextPollTime; // next poll time
+        uint8_t bInitState; // initialization state variable
+        uint32_t qNextInitTime; // Init() doesn't carry on before this
+        uint8_t bPendingPort; // port that finished resetting and still has to be configured
+        bool bPendingLowspeed;
+        deadline_t qPendingTime; // when bPendingPort can be configured
+        uint8_t bDriverResetPort; // port reset through ResetHubPort()
+        deadline_t qNextPollTime; // next poll time
+        uint8_t bPollInterval; // status change endpoint bInterval (ms), capped at HUB_POLL_INTERVAL
         bool bPollEnable; // poll enable flag
 
         uint8_t CheckHubStatus();
@@ -200,6 +209,10 @@ public:
                 return bAddress;
         };
 
+        virtual uint8_t GetDriverClass() {
+                return USB_DRIVER_HUB;
+        };
+
         virtual bool DEVCLASSOK(uint8_t klass) {
                 return (klass == 0x09);
         }
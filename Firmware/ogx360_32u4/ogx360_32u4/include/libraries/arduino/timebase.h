@@ -0,0 +1,58 @@
+/*
+ timebase.h - Timer3 timebase, deadlines and timer wheel for the ogx360
+
+ millis() has to copy a 32 bit value with interrupts off and only resolves ~1ms, micros() also
+ multiplies. Timer3 runs free at F_CPU/8 instead, and the main loop takes one snapshot of the
+ millisecond count per frame (timebase_poll()) so checking a deadline is just a 16 bit compare.
+*/
+
+#ifndef timebase_h
+#define timebase_h
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <avr/io.h>
+
+#define TIMEBASE_PRESCALER 8
+#define TIMEBASE_TICKS_PER_US (F_CPU / TIMEBASE_PRESCALER / 1000000UL) //2 at 16MHz, the tick clock wraps every 32ms
+#define TIMEBASE_TICKS_PER_MS (TIMEBASE_TICKS_PER_US * 1000UL)
+
+#define TIMER_WHEEL_SLOTS 16 //1ms per slot, must be a power of 2
+#define TIMER_WHEEL_TIMERS 8 //Timers that can be pending at once
+#define TIMER_WHEEL_MAX_MS (TIMER_WHEEL_SLOTS * 256UL) //Longest delay timer_after() accepts
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef uint16_t deadline_t; //ms, good for deadlines up to 32767ms away
+typedef void (*timer_callback_t)(uint8_t arg);
+
+extern uint16_t timebase_now; //Millisecond count as of the last timebase_poll()
+
+void timebase_init(void);
+uint16_t timebase_ticks(void);
+void timebase_poll(void);
+bool timer_after(uint16_t ms, timer_callback_t callback, uint8_t arg);
+void timer_cancel(timer_callback_t callback, uint8_t arg);
+
+//These all work from timebase_now, so they're only as current as the last timebase_poll().
+//A deadline left unchecked for more than 32s looks like it's in the future again. Periodic timers
+//that may sit idle should keep a start time and use timebase_elapsed(), which at worst waits one extra period.
+static inline uint16_t timebase_elapsed(uint16_t since){
+	return timebase_now - since;
+}
+
+static inline deadline_t deadline_in(uint16_t ms){
+	return timebase_now + ms;
+}
+
+static inline bool deadline_passed(deadline_t deadline){
+	return (int16_t)(timebase_now - deadline) >= 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -25,7 +25,8 @@ In settings.h you can configure the following options:
 #include "settings.h"
 #include "xiddevice.h"
 #include "Wire.h"
-#include "EEPROM.h"
+#include "nvsettings.h"
+#include "timebase.h"
 
 
 #ifdef MASTER
@@ -37,19 +38,63 @@ In settings.h you can configure the following options:
 #ifdef SUPPORTWIREDXBOX360
 #include <XBOXUSB.h>
 #endif
+#include "sbmapping.h"
+#include "sbaim.h"
+#include "stickshape.h"
+#include "triggercal.h"
 #endif
 
 
 uint8_t playerID; //playerID is set in the main program based on the slot the Arduino is installed.
 USB_XboxGamepad_Data_t XboxOGDuke[4]; //Xbox gamepad data structure to store all button and actuator states for all four controllers.
-uint8_t ConnectedXID = DUKE_CONTROLLER; //Default XID device to emulate
-bool enumerationComplete=false; //Flag is set when the device has been successfully setup by the OG Xbox
-uint32_t disconnectTimer=0; //Timer used to time disconnection between SB and Duke controller swapover
+volatile uint8_t ConnectedXID = DUKE_CONTROLLER; //Default XID device to emulate
+volatile bool enumerationComplete=false; //Flag is set when the device has been successfully setup by the OG Xbox
+void queueRumble(uint8_t lValue, uint8_t rValue, uint8_t controller);
+bool takeRumbleUpdate(uint8_t* lValue, uint8_t* rValue, uint8_t controller);
+void sendControllerHIDReport();
+
+//The main loop is a cyclic executive. It runs once per 1ms frame, started by the console's SOF, and every frame
+//goes through the phases below in order. Each phase has a budget (us) and is timed against it, so the worst case
+//input to report path is bounded and overruns show up in XIDTelemetry.
+#define FRAME_PHASE_HOST 0 //USB host: enumeration and polling the controllers
+#define FRAME_PHASE_MAP 1 //Controller state to XboxOGDuke/XboxOGSteelBattalion, rumble and power off commands
+#define FRAME_PHASE_PUBLISH 2 //Player 1 attach/detach, console OUT endpoint, IN report
+#define FRAME_PHASE_FANOUT 3 //I2C: one slave's refresh and rumble read, then changed reports, as far as the budget goes
+#define FRAME_PHASE_HOUSEKEEPING 4 //Settings journal, telemetry
+#define FRAME_PHASE_NONE 0xFF
+//The budgets add up to the 1ms frame. Fan-out only starts an I2C transfer if it fits in what's left of its budget,
+//which is one report write and one rumble read.
+static const uint16_t FramePhaseBudget[XID_FRAME_PHASES] PROGMEM = {230, 100, 50, 580, 40};
+#define FANOUT_WRITE_US 480 //20 byte report plus the address at 400kHz
+#define FANOUT_DISABLE_US 50 //The 1 byte disablePacket
+#define FANOUT_READ_US 80 //2 byte rumble read
+#define FRAME_FALLBACK_US 1100 //No SOF while detached from the console, frames then start this long after the previous one
+void frameStart();
+void framePhase(uint8_t phase);
+bool framePhaseFits(uint16_t us);
+void frameEnd();
+static uint16_t frameStartTicks; //timebase_ticks()
+static uint8_t frameSOF;
+static uint8_t framePhaseCurrent=FRAME_PHASE_NONE;
+static uint16_t framePhaseStart;
+static uint16_t framePhaseMax[XID_FRAME_PHASES];
+static uint16_t framePhaseOverruns[XID_FRAME_PHASES];
+static uint16_t frameOverruns;
+static uint16_t frameTimeMax;
+void flashLed(uint16_t ms);
+void ledFlashEnd(uint8_t level);
+static volatile bool ledFlashing; //Set while flashLed() has the LED, nothing else drives it meanwhile
 
 
 #ifdef SUPPORTBATTALION
 USB_XboxSteelBattalion_Data_t XboxOGSteelBattalion;	//Steel Battalion controller data structure
 USB_XboxSteelBattalion_Feedback_t XboxOGSteelBattalionFeedback;	//Steel Battalion controller feedback from the console. These are normally used to light up the LEDs
+void sbMap(const uint8_t* inputs, const uint8_t* clicks, uint8_t when);
+void sbAction(uint8_t action, uint16_t value);
+static const uint8_t sbGearStates[7]={7,8,9,10,11,12,13}; //R,N,1,2,3,4,5
+static int8_t sbGear=1; //sbGearStates offset. 1=Neutral which is set here as the default.
+static bool sbFeedbackChanged; //The console has sent new LED feedback since the SB report was last mapped
+static bool sbTicking; //The SB report is changing with time alone (aim moving, L3 held), so it's mapped every frame
 #endif
 
 
@@ -57,11 +102,24 @@ USB_XboxSteelBattalion_Feedback_t XboxOGSteelBattalionFeedback;	//Steel Battalio
 USB UsbHost;
 USBHub Hub(&UsbHost);
 XBOXRECV Xbox360Wireless(&UsbHost);
+static uint8_t chatPadClicks[CHATPAD_KEY_BYTES]; //Player 1's chatpad clicks, taken from the receiver once per frame
+bool chatPadClicked(ChatPadButton b);
 uint8_t getButtonPress(ButtonEnum b, uint8_t controller);
 int16_t getAnalogHat(AnalogHatEnum a, uint8_t controller);
 void setRumbleOn(uint8_t lValue, uint8_t rValue, uint8_t controller);
 void setLedOn(LEDEnum led, uint8_t controller);
 bool controllerConnected(uint8_t controller);
+bool inputChanged(uint8_t controller);
+uint16_t fanOutCost(uint8_t i);
+void fanOutReport(uint8_t i);
+void fanOutSlave(uint8_t i);
+void xboxHoldExpired(uint8_t i);
+void stickSettingsCombo(uint8_t i);
+static uint8_t xboxHeld; //Bit per controller, set while the XBOX button is held and the power off timer is running
+static uint8_t reportDirty; //Bit per controller, set when XboxOGDuke[i] (or the SB report) has changed and not been sent on yet
+static uint16_t i2cRefreshTimer[4]; //timebase_now of the last report sent to each slave
+static uint16_t slaveReportCount[4]; //Reports each slave acknowledged since the last telemetry update
+static bool bootGraceOver; //Player 1's port stays attached for the first 7s after power-on even with no controller
 #ifdef SUPPORTWIREDXBOXONE
 XBOXONE XboxOneWired1(&UsbHost);
 XBOXONE XboxOneWired2(&UsbHost);
@@ -90,6 +148,9 @@ void sendRumble(){
 	Wire.write(&XboxOGDuke[0].right_actuator,1);
 }
 
+static volatile bool pingReceived; //Flashing the LED is left to the main loop
+static volatile bool inputReceived; //New controller state in inputBuffer for the main loop to pick up
+
 //This function executes whenever data is sent from the I2C Master.
 //The master sends either the controller state if a wireless controller
 //is synced or a disable packet {0xF0} if a controller is not synced.
@@ -100,19 +161,19 @@ void getControllerData(int len){
 	//0xF0 is a packet sent from the master if the respective wireless controller isn't synced.
 	if(inputBuffer[0]==0xF0){
 		USB_Detach();
+		if(!ledFlashing)
 		digitalWrite(ARDUINO_LED_PIN, HIGH);
 
 		//0xAA is a ping to see if the slave module is connected
 		//Flash the LED to confirm receipt.
 	} else if(inputBuffer[0]==0xAA){
-		digitalWrite(ARDUINO_LED_PIN, LOW);
-		delay(250);
-		digitalWrite(ARDUINO_LED_PIN, HIGH);
+		pingReceived=true;
 
 	} else {
 		USB_Attach();
-		if(enumerationComplete)
+		if(enumerationComplete && !ledFlashing)
 		digitalWrite(ARDUINO_LED_PIN, LOW);
+		inputReceived=true;
 	}
 }
 #endif
@@ -122,6 +183,7 @@ int main(void)
 {
 	//Init the Arduino Library
 	init();
+	timebase_init();
 
 	//Init IO
 	pinMode(USB_HOST_RESET_PIN, OUTPUT);
@@ -191,17 +253,11 @@ int main(void)
 	#endif
 
 
-	#ifdef SUPPORTBATTALION
-	//Setup EEPROM for variable sensitivity adjustment for SB controller.
-	static int32_t sensitivity=400;
-	if(EEPROM.read(0x20)!=0xAB){
-		EEPROM.write(0x20,0xAB);		//Address 0x20 should contain 0xAB if it is initialized properly. If not, write it then set a default value below:
-		EEPROM.put(0x00,sensitivity); //First time setup default EEPROM register. Address 0x00 contains the sensitivity value.
-	}
-	#endif
-
 	/* END MASTER DEVICE USB HOST CONTROLLER INIT */
 
+	//Persistent settings (SB sensitivity etc.) are read from EEPROM once here, then served from RAM
+	NV_Load();
+
 
 
 	/* SLAVE I2C SLAVE INIT */
@@ -215,16 +271,55 @@ int main(void)
 	#endif
 	/* END SLAVE I2C SLAVE INIT */
 
+	//From here on everything runs inside a 1ms frame and delay() would hold up all four players.
+	//Waits use the timebase deadlines or timer_after() instead.
+	#pragma GCC poison delay
+
 	while (1){
+		frameStart();
+
 		#ifdef MASTER
 		/*** MASTER TASKS ***/
+		framePhase(FRAME_PHASE_HOST);
 		UsbHost.busprobe();
+		UsbHost.Task();
+
+		framePhase(FRAME_PHASE_MAP);
+		Xbox360Wireless.takeChatPadClicks(chatPadClicks, 0);
+
+		#ifdef SUPPORTBATTALION
+		/* Read Steel Battalion OUT endpoint for LED feedback from HOST to Device, this is not a standard HID Set Report, so is read here manually */
+		if(ConnectedXID==STEELBATTALION){
+			uint8_t ep = Endpoint_GetCurrentEndpoint();
+			Endpoint_SelectEndpoint(0x01); //0x01 is the out endpoint address for the SB Controller
+			if (Endpoint_IsOUTReceived()){
+				Endpoint_Read_Stream_LE(&XboxOGSteelBattalionFeedback, 22, NULL);
+				Endpoint_ClearOUT();
+				XID_OUTRead();
+				sbFeedbackChanged=true;
+			}
+			Endpoint_SelectEndpoint(ep); //set back to the old endpoint.
+		}
+		#endif
 
+		//A report is only mapped again when the controller's input has changed, or it hasn't been mapped
+		//since the controller connected or the XID device changed. Anything that changes with time alone
+		//(the SB aim, hold timers) asks for its own updates.
+		static uint8_t slotMapped; //Bit per controller
+		static uint8_t mappedXID=DUKE_CONTROLLER;
+		if(mappedXID!=ConnectedXID){
+			mappedXID=ConnectedXID;
+			slotMapped&=~0x01;
+		}
 		for (uint8_t i = 0; i < 4; i++) {
-			UsbHost.Task();
 			if (controllerConnected(i)) {
+				if(!(slotMapped&(1<<i))) TriggerCal_Reset(i);
+				bool changed=inputChanged(i) || !(slotMapped&(1<<i));
+				slotMapped|=(1<<i);
 				//Button Mapping for Duke Controller
-				if(ConnectedXID==DUKE_CONTROLLER || i!=0){
+				if((ConnectedXID==DUKE_CONTROLLER || i!=0) && changed){
+					if(i==0) XID_MarkSample(); //Player 1 input is sampled from here, used to measure report age
+					reportDirty|=(1<<i);
 
 					//Read Digital Buttons
 					XboxOGDuke[i].dButtons=0x0000;
@@ -232,6 +327,8 @@ int main(void)
 					if (getButtonPress(DOWN, i))		XboxOGDuke[i].dButtons |= DDOWN;
 					if (getButtonPress(LEFT, i))		XboxOGDuke[i].dButtons |= DLEFT;
 					if (getButtonPress(RIGHT, i))		XboxOGDuke[i].dButtons |= DRIGHT;;
+					//With XBOX held the D-pad belongs to stickSettingsCombo(), the console doesn't see it
+					if (getButtonPress(XBOX, i))		XboxOGDuke[i].dButtons &= ~(DUP | DDOWN | DLEFT | DRIGHT);
 					if (getButtonPress(START, i))		XboxOGDuke[i].dButtons |= START_BTN;
 					if (getButtonPress(BACK, i))		XboxOGDuke[i].dButtons |= BACK_BTN;
 					if (getButtonPress(L3, i))			XboxOGDuke[i].dButtons |= LS_BTN;
@@ -245,294 +342,154 @@ int main(void)
 					getButtonPress(L1, i)	? XboxOGDuke[i].WHITE = 0xFF		: XboxOGDuke[i].WHITE = 0x00;
 					getButtonPress(R1, i)	? XboxOGDuke[i].BLACK = 0xFF		: XboxOGDuke[i].BLACK = 0x00;
 
-					//Read Analog triggers
-					XboxOGDuke[i].L = getButtonPress(L2, i); //0x00 to 0xFF
-					XboxOGDuke[i].R = getButtonPress(R2, i); //0x00 to 0xFF
-
-					//Read Control Sticks (16bit signed short)
-					XboxOGDuke[i].leftStickX = getAnalogHat(LeftHatX, i);
-					XboxOGDuke[i].leftStickY = getAnalogHat(LeftHatY, i);
-					XboxOGDuke[i].rightStickX = getAnalogHat(RightHatX, i);
-					XboxOGDuke[i].rightStickY = getAnalogHat(RightHatY, i);
+					//Read Analog triggers, calibrated to the travel each trigger actually has
+					XboxOGDuke[i].L = TriggerCal_Apply(getButtonPress(L2, i), i, TRIGGER_LEFT); //0x00 to 0xFF
+					XboxOGDuke[i].R = TriggerCal_Apply(getButtonPress(R2, i), i, TRIGGER_RIGHT); //0x00 to 0xFF
+
+					//Read Control Sticks (16bit signed short), with the player's deadzone and curve applied
+					stickSettingsCombo(i);
+					int16_t stickX = getAnalogHat(LeftHatX, i);
+					int16_t stickY = getAnalogHat(LeftHatY, i);
+					Stick_Shape(&stickX, &stickY, i);
+					XboxOGDuke[i].leftStickX = stickX;
+					XboxOGDuke[i].leftStickY = stickY;
+					stickX = getAnalogHat(RightHatX, i);
+					stickY = getAnalogHat(RightHatY, i);
+					Stick_Shape(&stickX, &stickY, i);
+					XboxOGDuke[i].rightStickX = stickX;
+					XboxOGDuke[i].rightStickY = stickY;
 				}
 				#ifdef SUPPORTBATTALION
 				//Button Mapping for Steel Battalion Controller - only applicable for player 1 and Xbox 360 Wireless Controllers
-				else if (ConnectedXID==STEELBATTALION && Xbox360Wireless.Xbox360Connected[i] && i==0){
-					static const uint8_t gearStates[7]={7,8,9,10,11,12,13}; //R,N,1,2,3,4,5
-					static int8_t currentGear=1; //gearStates array offset. 1=Neutral which is set here as the default.
-					static int32_t virtualMouseX=32768,virtualMouseY=32768; //Right stick position
+				else if (ConnectedXID==STEELBATTALION && Xbox360Wireless.Xbox360Connected[i] && i==0 &&
+				         (changed || sbFeedbackChanged || sbTicking)){
+					static SBAim_t virtualMouse={SB_AIM_CENTRE,SB_AIM_CENTRE,SB_AIM_ACCEL_NONE}; //Right stick position
+					static uint16_t aimTime; //timebase_now of the last aim update
+					static uint16_t aimSensitivity=0, sensitivityGain; //Only recalculated when the sensitivity changes
+					bool aimMoving=false;
+					XID_MarkSample();
+					reportDirty|=0x01;
+					sbFeedbackChanged=false;
 
 					XboxOGSteelBattalion.dButtons[0] =0x0000;
 					XboxOGSteelBattalion.dButtons[1] =0x0000;
 					XboxOGSteelBattalion.dButtons[2]&=0xFFFC; //Need to only clear the two LSBs. The other bits are the toggle switches
 
-					//L1/R1 = L and R bumpers
-					//L2/R2 = L and R Triggers
-					//L3/R3 - L and R Stick Press
-					//Note the W0,W1 or W2 in the SBC_GAMEPAD button defines the offset in dButtons[X].
-					//i.e. SBC_GAMEPAD_W1_COMM3 should use dButtons[1].
-					if(Xbox360Wireless.getButtonPress(START, i))
-						XboxOGSteelBattalion.dButtons[0] |=SBC_GAMEPAD_W0_START;
-					if(Xbox360Wireless.getButtonPress(L1, i))
-						XboxOGSteelBattalion.dButtons[0] |=SBC_GAMEPAD_W0_RIGHTJOYFIRE;
-					static uint32_t L3HoldTimer=0; //Timer for holding the Left stick in
-					if(Xbox360Wireless.getButtonPress(L3, i)) {
-						XboxOGSteelBattalion.dButtons[2] |=SBC_GAMEPAD_W2_LEFTJOYSIGHTCHANGE;
-						if(L3HoldTimer==0 && (virtualMouseY!=32768 || virtualMouseX!=32768)) {
-							L3HoldTimer=millis();
-
-						} else if ((millis()-L3HoldTimer)>500){
-							virtualMouseX=32768;
-							virtualMouseY=32768;
-							L3HoldTimer=0;
+					//Everything held down this frame, chatpad keys then controller buttons. See sbmapping.h
+					static uint8_t lastPad[SB_INPUT_BYTES-CHATPAD_KEY_BYTES];
+					uint8_t inputs[SB_INPUT_BYTES], clicks[SB_INPUT_BYTES];
+					Xbox360Wireless.getChatPadKeys(inputs, i);
+					memcpy(clicks, chatPadClicks, CHATPAD_KEY_BYTES);
+					inputs[8]=inputs[9]=inputs[10]=0;
+					for(uint8_t b=UP; b<=XBOX; b++){
+						if(Xbox360Wireless.getButtonPress((ButtonEnum)b, i))
+							inputs[8+(b>>3)] |= 1<<(b&7);
+					}
+					for(uint8_t n=CHATPAD_KEY_BYTES; n<SB_INPUT_BYTES; n++){
+						clicks[n]=inputs[n]&~lastPad[n-CHATPAD_KEY_BYTES];
+						lastPad[n-CHATPAD_KEY_BYTES]=inputs[n];
+					}
+					#define SB_HELD(source) (inputs[(source)>>3] & (1<<((source)&7)))
+					uint8_t when=0;
+					if(SB_HELD(SB_KEY(CHATPAD_MESSENGER)) || SB_HELD(SB_PAD(BACK))) when|=SB_IF_COMMS;
+					else if(SB_HELD(SB_KEY(CHATPAD_ORANGE))) when|=SB_IF_NOCOMMS;
+					else when|=SB_IF_NOCOMMS|SB_IF_NORMAL;
+					if(SB_HELD(SB_KEY(CHATPAD_ORANGE))) when|=SB_IF_ORANGE;
+					if(!SB_HELD(SB_PAD(LEFT)) && !SB_HELD(SB_PAD(RIGHT))) when|=SB_IF_STILL;
+
+					XboxOGSteelBattalion.middlePedal = 0x0000; //Brake Pedal
+					if(when&SB_IF_NOCOMMS) XboxOGSteelBattalion.rotationLever = 0;
+					sbMap(inputs, clicks, when);
+					XboxOGSteelBattalion.gearLever = sbGearStates[sbGear];
+
+					//Holding the left stick in recenters the aim
+					static bool L3Held=false;
+					static deadline_t L3HoldTimer; //Timer for holding the Left stick in
+					if(SB_HELD(SB_PAD(L3))) {
+						if(!L3Held && (virtualMouse.y!=SB_AIM_CENTRE || virtualMouse.x!=SB_AIM_CENTRE)) {
+							L3HoldTimer=deadline_in(500);
+							L3Held=true;
+
+						} else if (!L3Held || deadline_passed(L3HoldTimer)){
+							virtualMouse.x=SB_AIM_CENTRE;
+							virtualMouse.y=SB_AIM_CENTRE;
+							L3Held=false;
 						}
 					} else {
-						L3HoldTimer=0;
+						L3Held=false;
 					}
 
-					if(Xbox360Wireless.getButtonPress(R3, i) || Xbox360Wireless.getButtonPress(B, i))
-						XboxOGSteelBattalion.dButtons[0] |=SBC_GAMEPAD_W0_RIGHTJOYLOCKON;
-
-					if(Xbox360Wireless.getButtonPress(R1, i) || Xbox360Wireless.getButtonPress(A, i))
-						XboxOGSteelBattalion.dButtons[0] |=SBC_GAMEPAD_W0_RIGHTJOYMAINWEAPON;
-
-					if(Xbox360Wireless.getButtonPress(XBOX, i) || Xbox360Wireless.getChatPadPress(CHATPAD_0,i))
-						XboxOGSteelBattalion.dButtons[0] |=SBC_GAMEPAD_W0_EJECT;
-
 					//What the X button does depends on what is needed by your VT.
 					//It will Extinguish, Reload (if empty), or Wash if required. It will rumble for Chaff but you need to press Y to chaff.
 					//This is determined by reading back the LED feedback from the console. The game normally
 					//makes these LEDs flash when action is required. I use this data to rumble the controller and determine what X should do.
 					if((XboxOGSteelBattalionFeedback.Chaff_Extinguisher&0xF0)!=0){
-						XboxOGDuke[i].right_actuator=(XboxOGSteelBattalionFeedback.Chaff_Extinguisher<<0)&0xF0; //Only use right motor for chaff
-						XboxOGDuke[i].rumbleUpdate=1;
+						queueRumble(XboxOGDuke[i].left_actuator, (XboxOGSteelBattalionFeedback.Chaff_Extinguisher<<0)&0xF0, i); //Only use right motor for chaff
 					}
 					if((XboxOGSteelBattalionFeedback.Chaff_Extinguisher&0x0F)!=0){
-						XboxOGDuke[i].left_actuator=(XboxOGSteelBattalionFeedback.Chaff_Extinguisher<<4)&0xF0;
-						XboxOGDuke[i].right_actuator=XboxOGDuke[i].left_actuator;
-						XboxOGDuke[i].rumbleUpdate=1;
-						if(Xbox360Wireless.getButtonPress(X, i)) XboxOGSteelBattalion.dButtons[1] |=SBC_GAMEPAD_W1_EXTINGUISHER;
+						queueRumble((XboxOGSteelBattalionFeedback.Chaff_Extinguisher<<4)&0xF0, (XboxOGSteelBattalionFeedback.Chaff_Extinguisher<<4)&0xF0, i);
+						if(SB_HELD(SB_PAD(X))) XboxOGSteelBattalion.dButtons[1] |=SBC_GAMEPAD_W1_EXTINGUISHER;
 					}
 					if((XboxOGSteelBattalionFeedback.Comm1_MagazineChange&0x0F)!=0){
-						XboxOGDuke[i].left_actuator=(XboxOGSteelBattalionFeedback.Comm1_MagazineChange<<4)&0xF0;
-						XboxOGDuke[i].right_actuator=XboxOGDuke[i].left_actuator;
-						XboxOGDuke[i].rumbleUpdate=1;
-						if(Xbox360Wireless.getButtonPress(X, i)) XboxOGSteelBattalion.dButtons[1] |=SBC_GAMEPAD_W1_WEAPONCONMAGAZINE;
+						queueRumble((XboxOGSteelBattalionFeedback.Comm1_MagazineChange<<4)&0xF0, (XboxOGSteelBattalionFeedback.Comm1_MagazineChange<<4)&0xF0, i);
+						if(SB_HELD(SB_PAD(X))) XboxOGSteelBattalion.dButtons[1] |=SBC_GAMEPAD_W1_WEAPONCONMAGAZINE;
 					}
 					if((XboxOGSteelBattalionFeedback.Washing_LineColorChange&0xF0)!=0){
-						if(Xbox360Wireless.getButtonPress(X, i)) XboxOGSteelBattalion.dButtons[1] |=SBC_GAMEPAD_W1_WASHING;
+						if(SB_HELD(SB_PAD(X))) XboxOGSteelBattalion.dButtons[1] |=SBC_GAMEPAD_W1_WASHING;
 					}
 					if((XboxOGSteelBattalionFeedback.CockpitHatch_EmergencyEject&0x0F)!=0){
-						XboxOGDuke[i].left_actuator=(XboxOGSteelBattalionFeedback.CockpitHatch_EmergencyEject<<4)&0xF0;
-						XboxOGDuke[i].right_actuator=XboxOGDuke[i].left_actuator;
-						XboxOGDuke[i].rumbleUpdate=1;
+						queueRumble((XboxOGSteelBattalionFeedback.CockpitHatch_EmergencyEject<<4)&0xF0, (XboxOGSteelBattalionFeedback.CockpitHatch_EmergencyEject<<4)&0xF0, i);
 					}
 
 
-
-					//Hold the messenger button for COMMS and Adjust TunerDial
-					if(Xbox360Wireless.getChatPadPress(CHATPAD_MESSENGER,i) || Xbox360Wireless.getButtonPress(BACK, i)){
-						if(Xbox360Wireless.getChatPadPress(CHATPAD_1,i)) XboxOGSteelBattalion.dButtons[1] |=SBC_GAMEPAD_W1_COMM1;
-						if(Xbox360Wireless.getChatPadPress(CHATPAD_2,i)) XboxOGSteelBattalion.dButtons[1] |=SBC_GAMEPAD_W1_COMM2;
-						if(Xbox360Wireless.getChatPadPress(CHATPAD_3,i)) XboxOGSteelBattalion.dButtons[1] |=SBC_GAMEPAD_W1_COMM3;
-						if(Xbox360Wireless.getChatPadPress(CHATPAD_4,i)) XboxOGSteelBattalion.dButtons[1] |=SBC_GAMEPAD_W1_COMM4;
-						if(Xbox360Wireless.getChatPadPress(CHATPAD_5,i)) XboxOGSteelBattalion.dButtons[2] |=SBC_GAMEPAD_W2_COMM5;
-
-						//Change tuner dial position by Holding the messenger then pressing D-pad directions.
-						//Tuner dial = 0-15, corresponding to the 9o'clock position going clockwise.
-						if(Xbox360Wireless.getButtonClick(UP, i) || Xbox360Wireless.getButtonClick(RIGHT, i))
-						XboxOGSteelBattalion.tunerDial+=2;
-
-						if(Xbox360Wireless.getButtonClick(DOWN, i) || Xbox360Wireless.getButtonClick(LEFT, i))
-						XboxOGSteelBattalion.tunerDial-=2;
-
-						if(XboxOGSteelBattalion.tunerDial>15) XboxOGSteelBattalion.tunerDial=15;
-						if(XboxOGSteelBattalion.tunerDial<0) XboxOGSteelBattalion.tunerDial=0;
-
-
-						//The default configuration
-						} else if (!Xbox360Wireless.getChatPadPress(CHATPAD_ORANGE,i)) {
-						if(Xbox360Wireless.getChatPadPress(CHATPAD_1,i)) XboxOGSteelBattalion.dButtons[1] |=SBC_GAMEPAD_W1_FUNCTIONF1;
-						if(Xbox360Wireless.getChatPadPress(CHATPAD_2,i)) XboxOGSteelBattalion.dButtons[1] |=SBC_GAMEPAD_W1_FUNCTIONTANKDETACH;
-						if(Xbox360Wireless.getChatPadPress(CHATPAD_3,i)) XboxOGSteelBattalion.dButtons[0] |=SBC_GAMEPAD_W0_FUNCTIONFSS;
-						if(Xbox360Wireless.getChatPadPress(CHATPAD_4,i)) XboxOGSteelBattalion.dButtons[1] |=SBC_GAMEPAD_W1_FUNCTIONF2;
-						if(Xbox360Wireless.getChatPadPress(CHATPAD_5,i)) XboxOGSteelBattalion.dButtons[1] |=SBC_GAMEPAD_W1_FUNCTIONOVERRIDE;
-						if(Xbox360Wireless.getChatPadPress(CHATPAD_6,i)) XboxOGSteelBattalion.dButtons[0] |=SBC_GAMEPAD_W0_FUNCTIONMANIPULATOR;
-						if(Xbox360Wireless.getChatPadPress(CHATPAD_7,i)) XboxOGSteelBattalion.dButtons[1] |=SBC_GAMEPAD_W1_FUNCTIONF3;
-						if(Xbox360Wireless.getChatPadPress(CHATPAD_8,i)) XboxOGSteelBattalion.dButtons[1] |=SBC_GAMEPAD_W1_FUNCTIONNIGHTSCOPE;
-						if(Xbox360Wireless.getChatPadPress(CHATPAD_9,i)) XboxOGSteelBattalion.dButtons[0] |=SBC_GAMEPAD_W0_FUNCTIONLINECOLORCHANGE;
-
-						//Change gears by Pressing DUP or DDOWN. Limits are 0-6. //R,N,1,2,3,4,5
-						//To prevent accidentally changing gears whilst rotating, I check to make sure you aren't pressing LEFT or RIGHT.
-						if(Xbox360Wireless.getButtonClick(UP, i) && !(Xbox360Wireless.getButtonPress(LEFT, i) || Xbox360Wireless.getButtonPress(RIGHT, i))){
-							currentGear++;
-							} else if(Xbox360Wireless.getButtonClick(DOWN, i) && !(Xbox360Wireless.getButtonPress(LEFT, i) || Xbox360Wireless.getButtonPress(RIGHT, i))){
-							currentGear--;
-						}
-						if(currentGear>6) currentGear=6;
-						if(currentGear<0) currentGear=0;
-						XboxOGSteelBattalion.gearLever = gearStates[currentGear];
-					}
-
-					if(Xbox360Wireless.getChatPadClick(CHATPAD_Q,i)) XboxOGSteelBattalion.dButtons[2] ^=SBC_GAMEPAD_W2_TOGGLEOXYGENSUPPLY;		//Toggle Switch
-					if(Xbox360Wireless.getChatPadClick(CHATPAD_A,i)) XboxOGSteelBattalion.dButtons[2] ^=SBC_GAMEPAD_W2_TOGGLEFILTERCONTROL;		//Toggle Switch
-					if(Xbox360Wireless.getChatPadClick(CHATPAD_W,i)) XboxOGSteelBattalion.dButtons[2] ^=SBC_GAMEPAD_W2_TOGGLEVTLOCATION;			//Toggle Switch
-					if(Xbox360Wireless.getChatPadClick(CHATPAD_S,i)) XboxOGSteelBattalion.dButtons[2] ^=SBC_GAMEPAD_W2_TOGGLEBUFFREMATERIAL;	//Toggle Switch
-					if(Xbox360Wireless.getChatPadClick(CHATPAD_Z,i)) XboxOGSteelBattalion.dButtons[2] ^=SBC_GAMEPAD_W2_TOGGLEFUELFLOWRATE;		//Toggle Switch
-					if(Xbox360Wireless.getChatPadPress(CHATPAD_D,i)) XboxOGSteelBattalion.dButtons[1] |=SBC_GAMEPAD_W1_WASHING;
-					if(Xbox360Wireless.getChatPadPress(CHATPAD_F,i)) XboxOGSteelBattalion.dButtons[1] |=SBC_GAMEPAD_W1_EXTINGUISHER;
-					if(Xbox360Wireless.getChatPadClick(CHATPAD_SHIFT,i)){
-						if(XboxOGSteelBattalion.dButtons[2]&=0xFFFC){ //If any of the toggle switches are on SHIFT will turn everything off.
-							XboxOGSteelBattalion.dButtons[2]&=~0xFFFC;
-							} else {
-							XboxOGSteelBattalion.dButtons[2]|=0xFFFC; //If all toggle switches are OFF, this will quickly turn them all on
-						}
-					}
-
-					if(Xbox360Wireless.getChatPadPress(CHATPAD_G,i) || Xbox360Wireless.getButtonPress(Y, i))
-					XboxOGSteelBattalion.dButtons[1] |=SBC_GAMEPAD_W1_CHAFF;
-
-					if(Xbox360Wireless.getChatPadPress(CHATPAD_X,i) || Xbox360Wireless.getChatPadPress(CHATPAD_RIGHT,i))
-					XboxOGSteelBattalion.dButtons[1] |=SBC_GAMEPAD_W1_WEAPONCONMAIN;
-
-					if(Xbox360Wireless.getChatPadPress(CHATPAD_C,i) || Xbox360Wireless.getChatPadPress(CHATPAD_LEFT,i))
-					XboxOGSteelBattalion.dButtons[1] |=SBC_GAMEPAD_W1_WEAPONCONSUB;
-
-					if(Xbox360Wireless.getChatPadPress(CHATPAD_V,i) || Xbox360Wireless.getChatPadPress(CHATPAD_SPACE,i))
-					XboxOGSteelBattalion.dButtons[1] |=SBC_GAMEPAD_W1_WEAPONCONMAGAZINE;
-
-					if(Xbox360Wireless.getChatPadPress(CHATPAD_U,i)) XboxOGSteelBattalion.dButtons[0] |=SBC_GAMEPAD_W0_MULTIMONOPENCLOSE;
-					if(Xbox360Wireless.getChatPadPress(CHATPAD_J,i)) XboxOGSteelBattalion.dButtons[0] |=SBC_GAMEPAD_W0_MULTIMONMODESELECT;
-					if(Xbox360Wireless.getChatPadPress(CHATPAD_N,i)) XboxOGSteelBattalion.dButtons[0] |=SBC_GAMEPAD_W0_MAINMONZOOMIN;
-					if(Xbox360Wireless.getChatPadPress(CHATPAD_I,i)) XboxOGSteelBattalion.dButtons[0] |=SBC_GAMEPAD_W0_MULTIMONMAPZOOMINOUT;
-					if(Xbox360Wireless.getChatPadPress(CHATPAD_K,i)) XboxOGSteelBattalion.dButtons[0] |=SBC_GAMEPAD_W0_MULTIMONSUBMONITOR;
-					if(Xbox360Wireless.getChatPadPress(CHATPAD_M,i)) XboxOGSteelBattalion.dButtons[0] |=SBC_GAMEPAD_W0_MAINMONZOOMOUT;
-					if(Xbox360Wireless.getChatPadPress(CHATPAD_ENTER,i)) XboxOGSteelBattalion.dButtons[0] |=SBC_GAMEPAD_W0_START;
-
-					if(Xbox360Wireless.getChatPadPress(CHATPAD_P,i)) {
-						XboxOGSteelBattalion.dButtons[0] |=SBC_GAMEPAD_W0_COCKPITHATCH;
-						XboxOGSteelBattalion.dButtons[0] &=~SBC_GAMEPAD_W0_IGNITION; //Cannot have these two buttons pressed at the same time, some bioses will trigger an IGR
-					}
-
-					if(Xbox360Wireless.getChatPadPress(CHATPAD_COMMA,i)) {
-						XboxOGSteelBattalion.dButtons[0] |=SBC_GAMEPAD_W0_IGNITION;
-						XboxOGSteelBattalion.dButtons[0] &=~SBC_GAMEPAD_W0_COCKPITHATCH; //Cannot have these two buttons pressed at the same time, some bioses will trigger an IGR
-					}
-
-
-
-					/* Read Steel Battalion OUT endpoint for LED feedback from HOST to Device, this is not a standard HID Set Report, so is read here manually */
-					uint8_t ep = Endpoint_GetCurrentEndpoint();
-					Endpoint_SelectEndpoint(0x01); //0x01 is the out endpoint address for the SB Controller
-					if (Endpoint_IsOUTReceived()){
-						Endpoint_Read_Stream_LE(&XboxOGSteelBattalionFeedback, 22, NULL);
-						Endpoint_ClearOUT();
-					}
-					Endpoint_SelectEndpoint(ep); //set back to the old endpoint.
-
-
 					//Apply Pedals
-					XboxOGSteelBattalion.leftPedal = (uint16_t)(Xbox360Wireless.getButtonPress(L2, i)<<8); //0x00 to 0xFF00 SIDESTEP PEDAL
-					XboxOGSteelBattalion.rightPedal = (uint16_t)(Xbox360Wireless.getButtonPress(R2, i)<<8); //0x00 to 0xFF00 ACCEL PEDAL
-					if(Xbox360Wireless.getChatPadPress(CHATPAD_BACK, i)) {
-						XboxOGSteelBattalion.middlePedal = 0xFF00; //Brake Pedal
-						} else {
-						XboxOGSteelBattalion.middlePedal = 0x0000; //Brake Pedal
-					}
-
-					if(!Xbox360Wireless.getChatPadPress(CHATPAD_MESSENGER,i) && !Xbox360Wireless.getButtonPress(BACK, i)){
-						if(Xbox360Wireless.getButtonPress(LEFT, i)) {
-							XboxOGSteelBattalion.rotationLever = -32767;
-							} else if(Xbox360Wireless.getButtonPress(RIGHT, i)) {
-							XboxOGSteelBattalion.rotationLever = +32767;
-							} else {
-							XboxOGSteelBattalion.rotationLever = 0;
-						}
-					}
+					XboxOGSteelBattalion.leftPedal = (uint16_t)(TriggerCal_Apply(Xbox360Wireless.getButtonPress(L2, i), i, TRIGGER_LEFT)<<8); //0x00 to 0xFF00 SIDESTEP PEDAL
+					XboxOGSteelBattalion.rightPedal = (uint16_t)(TriggerCal_Apply(Xbox360Wireless.getButtonPress(R2, i), i, TRIGGER_RIGHT)<<8); //0x00 to 0xFF00 ACCEL PEDAL
 
 
 					//Apply analog sticks
-					static int32_t sensitivity=400;
-					EEPROM.get(0x00,sensitivity);
-
-					if(Xbox360Wireless.getChatPadPress(CHATPAD_ORANGE,i)){
-						if(Xbox360Wireless.getChatPadPress(CHATPAD_9,i)) sensitivity=200;
-						if(Xbox360Wireless.getChatPadPress(CHATPAD_8,i)) sensitivity=250;
-						if(Xbox360Wireless.getChatPadPress(CHATPAD_7,i)) sensitivity=300;
-						if(Xbox360Wireless.getChatPadPress(CHATPAD_6,i)) sensitivity=350;
-						if(Xbox360Wireless.getChatPadPress(CHATPAD_5,i)) sensitivity=400;
-						if(Xbox360Wireless.getChatPadPress(CHATPAD_4,i)) sensitivity=650;
-						if(Xbox360Wireless.getChatPadPress(CHATPAD_3,i)) sensitivity=800;
-						if(Xbox360Wireless.getChatPadPress(CHATPAD_2,i)) sensitivity=1000;
-						if(Xbox360Wireless.getChatPadPress(CHATPAD_1,i)) sensitivity=1200;
-						int32_t temp=0;
-						EEPROM.get(0x00,temp);
-						if(temp != sensitivity){
-							EEPROM.put(0x00,sensitivity);
-							digitalWrite(ARDUINO_LED_PIN, !digitalRead(ARDUINO_LED_PIN));
-							delay(100);
-						}
-
-					}
+					uint16_t sensitivity=NVSettings.sbSensitivity; //Picked with ORANGE + 1-9
 
 					XboxOGSteelBattalion.sightChangeX = Xbox360Wireless.getAnalogHat(LeftHatX, i);
 					XboxOGSteelBattalion.sightChangeY = -Xbox360Wireless.getAnalogHat(LeftHatY, i)-1;
 
-					if(!Xbox360Wireless.getChatPadPress(CHATPAD_MESSENGER,i) && !Xbox360Wireless.getButtonPress(BACK, i)){
-						//Moving aiming stick like a mouse cursor
-
-						int32_t axisVal = Xbox360Wireless.getAnalogHat(RightHatX, i);
-						if(axisVal>7500 || axisVal<-7500){
-							virtualMouseX +=axisVal/sensitivity;
-						}
-
-						axisVal = Xbox360Wireless.getAnalogHat(RightHatY, i);
-						if(axisVal>7500 || axisVal<-7500){
-							virtualMouseY -=axisVal/sensitivity;
+					if(when&SB_IF_NOCOMMS){
+						//Moving aiming stick like a mouse cursor. It's integrated over the ms since the last update,
+						//so the aim moves at the same speed however often the loop gets here.
+						if(aimSensitivity!=sensitivity){
+							aimSensitivity=sensitivity;
+							sensitivityGain=aimGain(sensitivity);
 						}
+						if(!sbTicking) aimTime=timebase_now; //Not mapped every frame until now, the first step starts here
+						uint16_t dt=timebase_elapsed(aimTime);
+						aimTime=timebase_now;
 
+						aimMoving=aimStep(&virtualMouse, Xbox360Wireless.getAnalogHat(RightHatX, i),
+						                  Xbox360Wireless.getAnalogHat(RightHatY, i), sensitivityGain, dt);
 
-						if(virtualMouseX<0) virtualMouseX=0;
-						if(virtualMouseX>65535) virtualMouseX=65535;
-						if(virtualMouseY>65535) virtualMouseY=65535;
-						if(virtualMouseY<0) virtualMouseY=0;
-
-						XboxOGSteelBattalion.aimingX = (uint16_t)virtualMouseX;
-						XboxOGSteelBattalion.aimingY = (uint16_t)virtualMouseY;
+						XboxOGSteelBattalion.aimingX = (uint16_t)(virtualMouse.x>>8);
+						XboxOGSteelBattalion.aimingY = (uint16_t)(virtualMouse.y>>8);
+					} else {
+						aimTime=timebase_now; //Don't count the time the aim was held against the next update
 					}
 
 
 					XboxOGSteelBattalion.sightChangeX	= Xbox360Wireless.getAnalogHat(LeftHatX, i);
 					XboxOGSteelBattalion.sightChangeY	= -Xbox360Wireless.getAnalogHat(LeftHatY, i)-1;
 
+					sbTicking=aimMoving || L3Held;
 				}
 
 
 
 
 				//Press the GREEN & ORANGE button on the chatpad to toggle between Duke and the Steel Battalion.
-				if(Xbox360Wireless.getChatPadPress(CHATPAD_GREEN,0) && Xbox360Wireless.getChatPadClick(CHATPAD_ORANGE,0)){
-					USB_Detach();
-					disconnectTimer=millis();
-					if(ConnectedXID!=STEELBATTALION){
-						Xbox360Wireless.chatPadQueueLed(CHATPAD_LED_GREEN_OFF,i);
-						Xbox360Wireless.chatPadQueueLed(CHATPAD_LED_ORANGE_ON,i);
-						Xbox360Wireless.chatPadQueueLed(CHATPAD_LED_GREEN_OFF,i);
-						Xbox360Wireless.chatPadQueueLed(CHATPAD_LED_ORANGE_ON,i);
-					} else {
-						Xbox360Wireless.chatPadQueueLed(CHATPAD_LED_GREEN_ON,i);
-						Xbox360Wireless.chatPadQueueLed(CHATPAD_LED_ORANGE_OFF,i);
-						Xbox360Wireless.chatPadQueueLed(CHATPAD_LED_GREEN_ON,i);
-						Xbox360Wireless.chatPadQueueLed(CHATPAD_LED_ORANGE_OFF,i);
-					}
-
-				}
-				if(disconnectTimer!=0 && millis()-disconnectTimer>500){
+				//The detach/re-attach is done by XID_SwitchTask() further down.
+				if(Xbox360Wireless.getChatPadPress(CHATPAD_GREEN,0) && chatPadClicked(CHATPAD_ORANGE) && !XID_SwitchInProgress()){
 					if(ConnectedXID!=STEELBATTALION){
-						ConnectedXID=STEELBATTALION;
-						XboxOGDuke[0].left_actuator=0;
-						XboxOGDuke[0].right_actuator=0;
-						XboxOGDuke[0].rumbleUpdate=1;
+						XID_BeginSwitch(STEELBATTALION);
+						queueRumble(0, 0, 0);
+						reportDirty|=0x01;
 						XboxOGSteelBattalion.dButtons[0]=0x0000;
 						XboxOGSteelBattalion.dButtons[1]=0x0000;
 						XboxOGSteelBattalion.dButtons[2]=0x0000;
@@ -542,167 +499,284 @@ int main(void)
 						Xbox360Wireless.chatPadQueueLed(CHATPAD_LED_ORANGE_ON,i);
 
 					} else {
-						ConnectedXID=DUKE_CONTROLLER;
-						XboxOGDuke[0].left_actuator=0;
-						XboxOGDuke[0].right_actuator=0;
-						XboxOGDuke[0].rumbleUpdate=1;
+						XID_BeginSwitch(DUKE_CONTROLLER);
+						queueRumble(0, 0, 0);
 						XboxOGDuke[0].dButtons=0x0000;
+						reportDirty|=0x01;
 						Xbox360Wireless.chatPadQueueLed(CHATPAD_LED_GREEN_ON,i);
 						Xbox360Wireless.chatPadQueueLed(CHATPAD_LED_ORANGE_OFF,i);
 						Xbox360Wireless.chatPadQueueLed(CHATPAD_LED_GREEN_ON,i);
 						Xbox360Wireless.chatPadQueueLed(CHATPAD_LED_ORANGE_OFF,i);
 					}
-					disconnectTimer=0;
+				}
+				#endif
+
+				#ifdef SUPPORTOVERCLOCK
+				//Press the GREEN & SHIFT button on the chatpad to toggle the faster polling interval.
+				if(Xbox360Wireless.getChatPadPress(CHATPAD_GREEN,0) && chatPadClicked(CHATPAD_SHIFT) && !XID_SwitchInProgress()){
+					XID_SetOverclock(!XIDOverclock);
 				}
 				#endif
 
 				//Anything that sends a command to the Xbox 360 controllers happens here. (i.e rumble, LED changes, controller off command)
-				static uint32_t commandTimer[4] ={0,0,0,0};
-				static uint32_t xboxHoldTimer[4] ={0,0,0,0};
-				if(millis()-commandTimer[i]>16){
+				static uint16_t commandTimer[4] ={0,0,0,0};
+				if(timebase_elapsed(commandTimer[i])>16){
 					//If you hold the XBOX button for more than ~1second, turn off controller
 					if (getButtonPress(XBOX, i)) {
-						if(xboxHoldTimer[i]==0){
-							xboxHoldTimer[i]=millis();
-						}
-						if((millis()-xboxHoldTimer[i])>1000 && (millis()-xboxHoldTimer[i])<1100){
-							XboxOGDuke[i].dButtons = 0x00;
-							setRumbleOn(0, 0, i);
-							delay(10);
-							Xbox360Wireless.disconnect(i);
-							xboxHoldTimer[i]=0;
+						if(!(xboxHeld&(1<<i))){
+							xboxHeld|=(1<<i);
+							timer_after(1000, xboxHoldExpired, i);
 						}
 					//START+BACK TRIGGERS is a standard soft reset command. We turn off the rumble motors here to prevent them getting locked on
 					//if you happen to press this reset combo mid rumble.
 					} else if (getButtonPress(START, i) && getButtonPress(BACK, i) && getButtonPress(L2, i)>0x00 && getButtonPress(R2, i)>0x00) {
 						//Turn off rumble on all controllers
 						for(uint8_t j=0; j<4; j++){
-							XboxOGDuke[j].left_actuator=0;
-							XboxOGDuke[j].right_actuator=0;
-							XboxOGDuke[j].rumbleUpdate=1;
+							queueRumble(0, 0, j);
 						}
 					//If Xbox button isnt held down, send the rumble commands
 					} else {
-						xboxHoldTimer[i]=0; //Reset the XBOX button hold time counter.
-						if (XboxOGDuke[i].rumbleUpdate==1){
-							setRumbleOn(XboxOGDuke[i].left_actuator, XboxOGDuke[i].right_actuator, i);
-							XboxOGDuke[i].rumbleUpdate=0;
+						//Reset the XBOX button hold time counter.
+						if(xboxHeld&(1<<i)){
+							xboxHeld&=~(1<<i);
+							timer_cancel(xboxHoldExpired, i);
 						}
-					}
-					commandTimer[i]=millis();
-				}
-
-
-				//Send controller state to slave devices, and retrieve actuator/rumble values from slave devices.
-				//Applicable to player 2, 3 and 4 only. i.e when i>0.
-				static uint32_t rumblei2cTimer[4] = {0,0,0,0}; //Timer to monitor how often rumbles are requested.
-				if(i>0){
-					Wire.beginTransmission(i);
-					Wire.write((char*)&XboxOGDuke[i],20);
-					Wire.endTransmission(true);
-					if(millis()-rumblei2cTimer[i]>8){
-						if(Wire.requestFrom(i, (uint8_t)2)==2){
-							int temp = Wire.read(); //read first 8 bytes - this is left actuator, returns -1 on error.
-							if(temp!=-1 && XboxOGDuke[i].left_actuator!=(uint8_t)temp){
-								XboxOGDuke[i].left_actuator=(uint8_t)temp;
-								XboxOGDuke[i].rumbleUpdate=1;
-							}
-
-							temp = Wire.read(); //read second 8 bytes - this is right actuator, returns -1 on error.
-							if(temp!=-1 && XboxOGDuke[i].right_actuator!=(uint8_t)temp){
-								XboxOGDuke[i].right_actuator=(uint8_t)temp;
-								XboxOGDuke[i].rumbleUpdate=1;
-							}
-						} else {
-							//just clear the buffer, must've been an error.
-							Wire.flush();
+						uint8_t lValue, rValue;
+						if (takeRumbleUpdate(&lValue, &rValue, i)){
+							setRumbleOn(lValue, rValue, i);
 						}
-						rumblei2cTimer[i]=millis();
 					}
+					commandTimer[i]=timebase_now;
 				}
-
-				/*Check/send the Player 1 HID report every loop to minimise lag even more on the master*/
-				sendControllerHIDReport();
-
-			} else {
-				//If the respective controller isn't synced, we instead send a disablePacket over the i2c bus
-				//so that the slave device knows to disable its USB. I've arbitrarily made this 0xF0.
-				if(i>0){
-					static uint8_t disablePacket[1] = {0xF0};
-					Wire.beginTransmission(i);
-					Wire.write((char*)disablePacket,1);
-					Wire.endTransmission(true);
-				}
+			} else if(slotMapped&(1<<i)){
+				//Just disconnected. Slaves are sent the disable packet straight away.
+				slotMapped&=~(1<<i);
+				reportDirty|=(1<<i);
 			}
 		} //End master for loop
 
 
-		//Handle Player 1 controller connect/disconnect events.
-		if (controllerConnected(0) && disconnectTimer==0){
+		framePhase(FRAME_PHASE_PUBLISH);
+		//Handle Player 1 controller connect/disconnect events. While switching between Duke and Steel Battalion
+		//the switch task owns attach/detach until the console has enumerated the new device.
+		XID_SwitchTask();
+		if(!bootGraceOver && timebase_now>=7000)
+			bootGraceOver=true; //Latched, timebase_now wraps after 65s
+		if (XID_SwitchInProgress()){
+			//XID_SwitchTask() owns attach/detach
+		} else if (controllerConnected(0)){
 			USB_Attach();
-			if(enumerationComplete){
+			if(enumerationComplete && !ledFlashing){
 				digitalWrite(ARDUINO_LED_PIN, LOW);
 			}
-		} else if(millis()>7000){
-			digitalWrite(ARDUINO_LED_PIN, HIGH);
+		} else if(bootGraceOver){
+			if(!ledFlashing)
+				digitalWrite(ARDUINO_LED_PIN, HIGH);
 			USB_Detach(); //Disconnect from the OG Xbox port.
 			Xbox360Wireless.chatPadInitNeeded[0]=1;
 		} else {
 			USB_Attach();
-			sendControllerHIDReport();
+		}
+		if(reportDirty&0x01){
+			reportDirty&=~0x01;
+			XID_ReportChanged();
 		}
 
 
 		/***END MASTER TASKS ***/
+		#else
+		framePhase(FRAME_PHASE_PUBLISH);
 		#endif
 
 
 		//THPS 2X is the only game I know that sends rumble commands to the USB OUT pipe
 		//instead of the control pipe. So unfortunately need to manually read the out pipe
 		//and update rumble values as needed!
+		//The control endpoint interrupt saves and restores the selected endpoint, so this is safe to do from the main loop.
 		uint8_t ep = Endpoint_GetCurrentEndpoint();
 		static uint8_t report[6];
 		Endpoint_SelectEndpoint(0x02); //0x02 is the out endpoint address for the Duke Controller
 		if (Endpoint_IsOUTReceived()){
 			Endpoint_Read_Stream_LE(report, 6, NULL);
 			Endpoint_ClearOUT();
+			XID_OUTRead();
 			if(report[1]==0x06){
-				XboxOGDuke[0].left_actuator =  report[3];
-				XboxOGDuke[0].right_actuator = report[5];
-				XboxOGDuke[0].rumbleUpdate = 1;
+				queueRumble(report[3], report[5], 0);
 			}
 			report[1]=0x00;
 		}
 		Endpoint_SelectEndpoint(ep); //set back to the old endpoint.
 
 		#ifndef MASTER
-		if(inputBuffer[0]!=0xF0){
-			memcpy(&XboxOGDuke[0],inputBuffer,20); //Copy input buffer into XboxOG struct. HID Report is 20 bytes long
+		if(pingReceived){
+			pingReceived=false;
+			flashLed(250);
+		}
+		//The master only sends a report when it has changed (or every 8ms as a refresh)
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+			if(inputReceived){
+				inputReceived=false;
+				memcpy(&XboxOGDuke[0],inputBuffer,20); //Copy input buffer into XboxOG struct. HID Report is 20 bytes long
+				XID_MarkSample();
+				XID_ReportChanged();
+			}
 		}
+		#endif
 
 		sendControllerHIDReport();
 
+		#ifdef MASTER
+		//Refreshes and rumble reads take turns, one slave per frame, and go first so busy slaves can't hold them off.
+		//Changed reports then go out while they fit in what's left of the phase's budget, starting from a different
+		//slave each frame so none is left waiting.
+		framePhase(FRAME_PHASE_FANOUT);
+		static uint8_t fanOutNext=1;
+		fanOutSlave(fanOutNext);
+		uint8_t slave=fanOutNext;
+		for(uint8_t n=0; n<3; n++){
+			if((reportDirty&(1<<slave)) && framePhaseFits(fanOutCost(slave)))
+				fanOutReport(slave);
+			slave=(slave==3) ? 1 : slave+1;
+		}
+		fanOutNext=(fanOutNext==3) ? 1 : fanOutNext+1;
 		#endif
+
+		framePhase(FRAME_PHASE_HOUSEKEEPING);
+		NV_Task();
+
+		//Main loop rate and frame timing, reported through XIDTelemetry.
+		static uint16_t loopCount=0;
+		static uint16_t loopRateTimer=0;
+		loopCount++;
+		if(timebase_elapsed(loopRateTimer)>=1000){
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+				XIDTelemetry.loopRate=loopCount;
+				XIDTelemetry.loopTimeMax=frameTimeMax;
+				XIDTelemetry.frameOverruns=frameOverruns;
+				for(uint8_t p=0; p<XID_FRAME_PHASES; p++){
+					XIDTelemetry.phaseTimeMax[p]=framePhaseMax[p];
+					XIDTelemetry.phaseOverruns[p]=framePhaseOverruns[p];
+				}
+				#ifdef MASTER
+				static uint16_t lastCtrlReqCount=0;
+				for(uint8_t i=0; i<4; i++)
+					XIDTelemetry.configureTime[i]=UsbHost.getConfigureTime(USB_DRIVER_HUB+i);
+				XIDTelemetry.controlRate=UsbHost.getCtrlReqCount()-lastCtrlReqCount;
+				lastCtrlReqCount=UsbHost.getCtrlReqCount();
+				const USB_XFER_STATS &xferStats=UsbHost.getXferStats();
+				XIDTelemetry.xferTimeouts=xferStats.timeouts;
+				XIDTelemetry.xferNakLimits=xferStats.nakLimits;
+				XIDTelemetry.xferToggleErrors=xferStats.toggleErrors;
+				XIDTelemetry.xferBackoffs=xferStats.backoffs;
+				for(uint8_t i=1; i<4; i++){
+					XIDTelemetry.slaveReportRate[i-1]=slaveReportCount[i];
+					slaveReportCount[i]=0;
+				}
+				#endif
+			}
+			loopCount=0;
+			frameTimeMax=0;
+			memset(framePhaseMax,0x00,sizeof(framePhaseMax));
+			loopRateTimer=timebase_now;
+		}
+
+		frameEnd();
+	}
+}
+
+//Waits for the next frame. That's the next SOF, or FRAME_FALLBACK_US after the last frame started if the console
+//isn't sending any. If the last frame ran past one or more SOFs, this one starts straight away and it's counted.
+void frameStart(){
+	uint8_t missed=0;
+	while(1){
+		uint8_t sof=XID_FrameCount();
+		if(sof!=frameSOF){
+			missed=(uint8_t)(sof-frameSOF)-1;
+			frameSOF=sof;
+			break;
+		}
+		if((uint16_t)(timebase_ticks()-frameStartTicks)>=FRAME_FALLBACK_US*TIMEBASE_TICKS_PER_US)
+			break;
+	}
+	if(missed && frameOverruns!=0xFFFF)
+		frameOverruns++;
+	frameStartTicks=timebase_ticks();
+	timebase_poll(); //Deadline snapshot for this frame, and any timers that are due
+}
+
+//Ends the phase that was running and starts the next one.
+//Times are kept in us. The tick clock wraps every 32ms so a longer phase reads short, the frame overrun count still catches it.
+void framePhase(uint8_t phase){
+	uint16_t now=timebase_ticks();
+	if(framePhaseCurrent!=FRAME_PHASE_NONE){
+		uint16_t t=(uint16_t)(now-framePhaseStart)/TIMEBASE_TICKS_PER_US;
+		if(t>framePhaseMax[framePhaseCurrent])
+			framePhaseMax[framePhaseCurrent]=t;
+		if(t>pgm_read_word(&FramePhaseBudget[framePhaseCurrent]) && framePhaseOverruns[framePhaseCurrent]!=0xFFFF)
+			framePhaseOverruns[framePhaseCurrent]++;
 	}
+	framePhaseCurrent=phase;
+	framePhaseStart=now;
+}
+
+//True if another us of work still fits in the running phase's FramePhaseBudget.
+bool framePhaseFits(uint16_t us){
+	uint16_t t=(uint16_t)(timebase_ticks()-framePhaseStart)/TIMEBASE_TICKS_PER_US;
+	return t+us<=pgm_read_word(&FramePhaseBudget[framePhaseCurrent]);
+}
+
+void frameEnd(){
+	framePhase(FRAME_PHASE_NONE);
+	uint16_t t=(uint16_t)(timebase_ticks()-frameStartTicks)/TIMEBASE_TICKS_PER_US;
+	if(t>frameTimeMax)
+		frameTimeMax=t;
+}
+
+//Inverts the LED for ms without holding up the loop.
+void flashLed(uint16_t ms){
+	if(ledFlashing)
+		return;
+	uint8_t level=digitalRead(ARDUINO_LED_PIN);
+	digitalWrite(ARDUINO_LED_PIN, !level);
+	ledFlashing=true;
+	if(!timer_after(ms, ledFlashEnd, level))
+		ledFlashEnd(level);
+}
+
+void ledFlashEnd(uint8_t level){
+	digitalWrite(ARDUINO_LED_PIN, level);
+	ledFlashing=false;
 }
 
 /* Send the HID report to the OG Xbox */
 void sendControllerHIDReport(){
-	USB_USBTask();
-	switch (ConnectedXID){
-		case DUKE_CONTROLLER:
-		if(USB_Device_GetFrameNumber()-DukeController_HID_Interface.State.PrevFrameNum>=4){
-			HID_Device_USBTask(&DukeController_HID_Interface); //Send OG Xbox HID Report
-		}
-		break;
-		#ifdef SUPPORTBATTALION
-		case STEELBATTALION:
-		if(USB_Device_GetFrameNumber()-SteelBattalion_HID_Interface.State.PrevFrameNum>=4){
-			HID_Device_USBTask(&SteelBattalion_HID_Interface); //Send OG Xbox HID Report
+	//Control requests are serviced from the USB interrupt (INTERRUPT_CONTROL_ENDPOINT) so USB_USBTask() isn't needed here.
+	XID_USBTask(); //Send OG Xbox HID Report
+}
+
+
+//Player 1 actuator values are also written by the USB control interrupt when the console sends a rumble SET_REPORT.
+//Everything in the main loop goes through these two so the actuator pair and the update flag are always changed together.
+void queueRumble(uint8_t lValue, uint8_t rValue, uint8_t controller){
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		XboxOGDuke[controller].left_actuator=lValue;
+		XboxOGDuke[controller].right_actuator=rValue;
+		XboxOGDuke[controller].rumbleUpdate=1;
+	}
+}
+
+//Returns true and the latest actuator values if there is a rumble update pending, clearing the flag.
+bool takeRumbleUpdate(uint8_t* lValue, uint8_t* rValue, uint8_t controller){
+	bool pending=false;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		if(XboxOGDuke[controller].rumbleUpdate==1){
+			*lValue=XboxOGDuke[controller].left_actuator;
+			*rValue=XboxOGDuke[controller].right_actuator;
+			XboxOGDuke[controller].rumbleUpdate=0;
+			pending=true;
 		}
-		break;
-		#endif
 	}
+	return pending;
 }
 
 
@@ -756,6 +830,24 @@ int16_t getAnalogHat(AnalogHatEnum a, uint8_t controller){
 	return 0;
 }
 
+//True if the controller's buttons, sticks or triggers have changed since the last call.
+bool inputChanged(uint8_t controller){
+	if(Xbox360Wireless.Xbox360Connected[controller])
+	return Xbox360Wireless.inputChanged(controller);
+
+	#ifdef SUPPORTWIREDXBOX360
+	if (Xbox360Wired[controller]->Xbox360Connected)
+	return Xbox360Wired[controller]->inputChanged();
+	#endif
+
+	#ifdef SUPPORTWIREDXBOXONE
+	if (XboxOneWired[controller]->XboxOneConnected)
+	return XboxOneWired[controller]->inputChanged();
+	#endif
+
+	return 0;
+}
+
 //Parse rumble activation requests for each type of controller.
 void setRumbleOn(uint8_t lValue, uint8_t rValue, uint8_t controller){
 	if(Xbox360Wireless.Xbox360Connected[controller])
@@ -806,4 +898,183 @@ bool controllerConnected(uint8_t controller){
 	#endif
 	return 0;
 }
+
+//True if player 1 clicked b on the chatpad this frame. Clears it, so the check runs once however often it's asked.
+bool chatPadClicked(ChatPadButton b){
+	uint8_t index=CHATPAD_KEY_INDEX(b);
+	uint8_t mask=1<<(index&7);
+	if(!(chatPadClicks[index>>3]&mask))
+		return false;
+	chatPadClicks[index>>3]&=~mask;
+	return true;
+}
+
+//The XBOX button has been held for a second, turn the controller off. The receiver's command queue
+//sends the rumble off ahead of the disconnect.
+void xboxHoldExpired(uint8_t i){
+	xboxHeld&=~(1<<i);
+	if(!controllerConnected(i))
+		return;
+	XboxOGDuke[i].dButtons = 0x00;
+	reportDirty|=(1<<i);
+	setRumbleOn(0, 0, i);
+	Xbox360Wireless.disconnect(i);
+}
+
+//Hold XBOX and press UP/DOWN to step through the stick curves, LEFT/RIGHT through the deadzones (see stickshape.h).
+//Using it stops the held XBOX button turning the controller off.
+void stickSettingsCombo(uint8_t i){
+	static uint8_t lastDpad[4];
+	uint8_t dpad=0;
+	if(getButtonPress(XBOX, i)){
+		if(getButtonPress(UP, i)) dpad|=DUP;
+		if(getButtonPress(DOWN, i)) dpad|=DDOWN;
+		if(getButtonPress(LEFT, i)) dpad|=DLEFT;
+		if(getButtonPress(RIGHT, i)) dpad|=DRIGHT;
+	}
+	uint8_t pressed=dpad&~lastDpad[i];
+	lastDpad[i]=dpad;
+	if(!pressed)
+		return;
+
+	NV_PlayerSettings_t *player=&NVSettings.player[i];
+	if(pressed&DUP) player->stickCurve=(player->stickCurve+1<STICK_CURVES) ? player->stickCurve+1 : 0;
+	if(pressed&DDOWN) player->stickCurve=(player->stickCurve>0 && player->stickCurve<STICK_CURVES) ? player->stickCurve-1 : STICK_CURVES-1;
+	if(pressed&DRIGHT) player->stickDeadzone=(player->stickDeadzone+1<STICK_DEADZONES) ? player->stickDeadzone+1 : 0;
+	if(pressed&DLEFT) player->stickDeadzone=(player->stickDeadzone>0 && player->stickDeadzone<STICK_DEADZONES) ? player->stickDeadzone-1 : STICK_DEADZONES-1;
+	NV_Changed();
+	flashLed(100);
+
+	//Marked as held with no timer, so it's not armed again until XBOX is let go
+	xboxHeld|=(1<<i);
+	timer_cancel(xboxHoldExpired, i);
+}
+
+//us of I2C time fanOutReport(i) takes, to check it against the fan-out budget.
+uint16_t fanOutCost(uint8_t i){
+	return controllerConnected(i) ? FANOUT_WRITE_US : FANOUT_DISABLE_US;
+}
+
+//Send controller state to a slave device. Applicable to player 2, 3 and 4 only.
+//If the respective controller isn't synced, we instead send a disablePacket so that the slave device knows to
+//disable its USB. I've arbitrarily made this 0xF0.
+void fanOutReport(uint8_t i){
+	reportDirty&=~(1<<i);
+	i2cRefreshTimer[i]=timebase_now;
+	Wire.beginTransmission(i);
+	if (controllerConnected(i)){
+		Wire.write((char*)&XboxOGDuke[i],20);
+		if(Wire.endTransmission(true)==0)
+			slaveReportCount[i]++;
+	} else {
+		static uint8_t disablePacket[1] = {0xF0};
+		Wire.write((char*)disablePacket,1);
+		Wire.endTransmission(true);
+	}
+}
+
+//Refresh a slave's report and retrieve actuator/rumble values from it.
+void fanOutSlave(uint8_t i){
+	static uint16_t rumblei2cTimer[4] = {0,0,0,0}; //Timer to monitor how often rumbles are requested.
+	//Changed reports are sent as they come in, this is a refresh every 8ms in case a slave has reset.
+	//Both only go if they fit in the fan-out budget, otherwise they wait for this slave's next turn.
+	if(timebase_elapsed(i2cRefreshTimer[i])>8 && framePhaseFits(fanOutCost(i)))
+		fanOutReport(i);
+
+	if (!controllerConnected(i))
+		return;
+	if(timebase_elapsed(rumblei2cTimer[i])>8 && framePhaseFits(FANOUT_READ_US)){
+		if(Wire.requestFrom(i, (uint8_t)2)==2){
+			int temp = Wire.read(); //read first 8 bytes - this is left actuator, returns -1 on error.
+			if(temp!=-1 && XboxOGDuke[i].left_actuator!=(uint8_t)temp){
+				XboxOGDuke[i].left_actuator=(uint8_t)temp;
+				XboxOGDuke[i].rumbleUpdate=1;
+			}
+
+			temp = Wire.read(); //read second 8 bytes - this is right actuator, returns -1 on error.
+			if(temp!=-1 && XboxOGDuke[i].right_actuator!=(uint8_t)temp){
+				XboxOGDuke[i].right_actuator=(uint8_t)temp;
+				XboxOGDuke[i].rumbleUpdate=1;
+			}
+		} else {
+			//just clear the buffer, must've been an error.
+			Wire.flush();
+		}
+		rumblei2cTimer[i]=timebase_now;
+	}
+}
+#endif
+
+#ifdef SUPPORTBATTALION
+//Runs the SBMap entries for each input held down. SBMap is sorted by source, so finding an input's entries
+//is a binary search and the work goes with the number of inputs held rather than the size of the map.
+void sbMap(const uint8_t* inputs, const uint8_t* clicks, uint8_t when){
+	for(uint8_t n=0; n<SB_INPUT_BYTES; n++){
+		uint8_t bits=inputs[n];
+		for(uint8_t b=0; bits; b++, bits>>=1){
+			if(!(bits&1))
+				continue;
+			uint8_t source=(n<<3)+b;
+			uint8_t lo=0, hi=SB_MAP_ENTRIES;
+			while(lo<hi){
+				uint8_t mid=(lo+hi)>>1;
+				if(pgm_read_byte(&SBMap[mid].source)<source) lo=mid+1;
+				else hi=mid;
+			}
+			for(; lo<SB_MAP_ENTRIES && pgm_read_byte(&SBMap[lo].source)==source; lo++){
+				uint8_t cond=pgm_read_byte(&SBMap[lo].when);
+				if((cond&when&SB_IF_MASK)!=(cond&SB_IF_MASK))
+					continue;
+				if((cond&SB_ON_CLICK) && !(clicks[n]&(1<<b)))
+					continue;
+				sbAction(pgm_read_byte(&SBMap[lo].action), pgm_read_word(&SBMap[lo].value));
+			}
+		}
+	}
+}
+
+void sbAction(uint8_t action, uint16_t value){
+	uint8_t w=action&0x03; //dButtons word for SB_SET, SB_CLEAR and SB_TOGGLE
+	switch(action&~0x03){
+	case SB_SET(0):
+		XboxOGSteelBattalion.dButtons[w]|=value;
+		break;
+	case SB_CLEAR(0):
+		XboxOGSteelBattalion.dButtons[w]&=~value;
+		break;
+	case SB_TOGGLE(0):
+		XboxOGSteelBattalion.dButtons[w]^=value;
+		break;
+	case SB_ROTATION:
+		XboxOGSteelBattalion.rotationLever=(int16_t)value;
+		break;
+	case SB_BRAKE:
+		XboxOGSteelBattalion.middlePedal=value;
+		break;
+	case SB_GEAR:
+		sbGear+=(int16_t)value;
+		if(sbGear>6) sbGear=6;
+		if(sbGear<0) sbGear=0;
+		break;
+	case SB_TUNER:
+		XboxOGSteelBattalion.tunerDial+=(int16_t)value;
+		if(XboxOGSteelBattalion.tunerDial>15) XboxOGSteelBattalion.tunerDial=15;
+		if(XboxOGSteelBattalion.tunerDial<0) XboxOGSteelBattalion.tunerDial=0;
+		break;
+	case SB_SENSITIVITY:
+		if(NVSettings.sbSensitivity!=value){
+			NVSettings.sbSensitivity=value;
+			NV_Changed(); //Saved in the background once it stops changing
+			flashLed(100);
+		}
+		break;
+	case SB_TOGGLE_ALL:
+		//If any of the toggle switches are on this turns everything off, if they're all off it turns them all on
+		if(XboxOGSteelBattalion.dButtons[2]&0xFFFC)
+			XboxOGSteelBattalion.dButtons[2]&=~0xFFFC;
+		else
+			XboxOGSteelBattalion.dButtons[2]|=0xFFFC;
+		break;
+	}
+}
 #endif
@@ -0,0 +1,160 @@
+/*
+ * nvsettings.c
+ *
+ * The EEPROM above NV_JOURNAL_START is a ring of fixed size records. Every save goes to the slot after the
+ * newest one with the next sequence number, so writes are spread over the whole ring. At boot the newest
+ * record with a good CRC wins. A record only half written when the power went has a bad CRC, and the one
+ * before it is still there.
+ *
+ * Saves are written by the EE_READY interrupt a byte at a time (~3.4ms each), skipping bytes that already
+ * hold the right value, so the main loop never waits on the EEPROM.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+#include <stddef.h>
+#include <string.h>
+#include "nvsettings.h"
+#include "timebase.h"
+
+#define NV_JOURNAL_START 0x40
+#define NV_RECORD_SIZE 32
+#define NV_RECORD_SLOTS ((E2END + 1 - NV_JOURNAL_START) / NV_RECORD_SIZE)
+#define NV_RECORD_MAGIC 0x5A
+
+typedef struct
+{
+	uint8_t magic;
+	uint16_t seq;
+	NV_Settings_t settings;
+	uint8_t unused[NV_RECORD_SIZE - 5 - sizeof(NV_Settings_t)];
+	uint16_t crc; //CRC-CCITT of everything before it
+} NV_Record_t;
+
+typedef char NV_RecordSizeCheck[(sizeof(NV_Record_t) == NV_RECORD_SIZE) ? 1 : -1];
+
+NV_Settings_t NVSettings;
+
+static bool nvDirty;
+static uint16_t nvChangedTime; //timebase_now of the last NV_Changed()
+static uint8_t nvSlot; //Slot of the newest record
+static uint16_t nvSeq;
+
+//Record being written by the interrupt
+static NV_Record_t nvWriteRecord;
+static uint16_t nvWriteAddr;
+static volatile uint8_t nvWriteIndex;
+static volatile bool nvWriting;
+
+static uint16_t NV_RecordCRC(const NV_Record_t* record)
+{
+	const uint8_t* p = (const uint8_t*)record;
+	uint16_t crc = 0xFFFF;
+	for (uint8_t i = 0; i < offsetof(NV_Record_t, crc); i++)
+		crc = _crc_ccitt_update(crc, p[i]);
+	return crc;
+}
+
+static uint16_t NV_SlotAddress(uint8_t slot)
+{
+	return NV_JOURNAL_START + (uint16_t)slot * NV_RECORD_SIZE;
+}
+
+static void NV_Defaults(void)
+{
+	memset(&NVSettings, 0x00, sizeof(NVSettings));
+	NVSettings.sbSensitivity = NV_SB_SENSITIVITY_DEFAULT;
+
+	//Pick up the sensitivity from the layout older firmware used
+	if (eeprom_read_byte((const uint8_t*)NV_LEGACY_MAGIC_ADDR) == NV_LEGACY_MAGIC)
+	{
+		int32_t sensitivity = (int32_t)eeprom_read_dword((const uint32_t*)NV_LEGACY_SENSITIVITY_ADDR);
+		if (sensitivity > 0 && sensitivity <= 0xFFFF)
+			NVSettings.sbSensitivity = (uint16_t)sensitivity;
+	}
+}
+
+//Reads the newest good record into NVSettings. Blocks on the EEPROM, so only for use at boot.
+void NV_Load(void)
+{
+	NV_Record_t record;
+	bool found = false;
+
+	for (uint8_t slot = 0; slot < NV_RECORD_SLOTS; slot++)
+	{
+		eeprom_read_block(&record, (const void*)NV_SlotAddress(slot), sizeof(record));
+		if (record.magic != NV_RECORD_MAGIC || record.crc != NV_RecordCRC(&record))
+			continue;
+		if (found && (int16_t)(record.seq - nvSeq) <= 0)
+			continue;
+		found = true;
+		nvSlot = slot;
+		nvSeq = record.seq;
+		memcpy(&NVSettings, &record.settings, sizeof(NVSettings));
+	}
+
+	if (!found)
+	{
+		//Fresh or pre-journal EEPROM. The first save goes to slot 0.
+		NV_Defaults();
+		nvSlot = NV_RECORD_SLOTS - 1;
+		nvSeq = 0;
+		nvDirty = true;
+		nvChangedTime = timebase_now;
+	}
+}
+
+//Call after changing NVSettings. The change is saved once nothing else has changed for NV_WRITE_DELAY.
+void NV_Changed(void)
+{
+	nvDirty = true;
+	nvChangedTime = timebase_now;
+}
+
+//Starts a save when one is due. Called from the main loop.
+void NV_Task(void)
+{
+	if (!nvDirty || nvWriting || timebase_elapsed(nvChangedTime) < NV_WRITE_DELAY)
+		return;
+
+	nvDirty = false;
+	nvSlot = (nvSlot + 1 < NV_RECORD_SLOTS) ? nvSlot + 1 : 0;
+	nvSeq++;
+
+	memset(&nvWriteRecord, 0x00, sizeof(nvWriteRecord));
+	nvWriteRecord.magic = NV_RECORD_MAGIC;
+	nvWriteRecord.seq = nvSeq;
+	memcpy(&nvWriteRecord.settings, &NVSettings, sizeof(NVSettings));
+	nvWriteRecord.crc = NV_RecordCRC(&nvWriteRecord);
+
+	nvWriteAddr = NV_SlotAddress(nvSlot);
+	nvWriteIndex = 0;
+	nvWriting = true;
+	EECR |= _BV(EERIE); //Fires as soon as the EEPROM is idle
+}
+
+ISR(EE_READY_vect)
+{
+	const uint8_t* p = (const uint8_t*)&nvWriteRecord;
+	while (nvWriteIndex < NV_RECORD_SIZE)
+	{
+		uint16_t addr = nvWriteAddr + nvWriteIndex;
+		uint8_t value = p[nvWriteIndex++];
+
+		EEAR = addr;
+		EECR |= _BV(EERE);
+		if (EEDR == value)
+			continue;
+
+		EECR &= ~(_BV(EEPM1) | _BV(EEPM0)); //Erase and write
+		EEDR = value;
+		EECR |= _BV(EEMPE);
+		EECR |= _BV(EEPE);
+		return;
+	}
+
+	EECR &= ~_BV(EERIE);
+	nvWriting = false;
+}
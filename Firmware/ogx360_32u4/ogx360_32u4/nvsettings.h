@@ -0,0 +1,55 @@
+/*
+ * nvsettings.h
+ *
+ * Persistent settings. Everything is loaded into NVSettings at boot and read from RAM from then on.
+ * Changes are journaled to EEPROM in the background, see nvsettings.c.
+ */
+
+#ifndef NVSETTINGS_H_
+#define NVSETTINGS_H_
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#define NV_PLAYERS 4
+#define NV_SB_SENSITIVITY_DEFAULT 400
+#define NV_WRITE_DELAY 2000 //ms a change has to settle before it's written, so a burst of changes is one write
+
+//Firmware before the journal kept the SB sensitivity as an int32_t at 0x00, valid if 0x20 held 0xAB.
+//The journal starts above it and never touches it, so the old layout is only ever read.
+#define NV_LEGACY_SENSITIVITY_ADDR 0x00
+#define NV_LEGACY_MAGIC_ADDR 0x20
+#define NV_LEGACY_MAGIC 0xAB
+
+//Per player settings. 0 has to mean the default for each, since that's what records written before it
+//existed hold. Every byte is in use, growing this would move players 2-4 in records already written.
+typedef struct
+{
+	uint8_t stickCurve; //STICK_CURVES, 0 is linear
+	uint8_t stickDeadzone; //STICK_DEADZONES, 0 is none
+	uint8_t triggerCal[2]; //Learned L and R trigger range, see triggercal.c. 0 is the full 0x00-0xFF
+} NV_PlayerSettings_t;
+
+typedef struct
+{
+	uint16_t sbSensitivity; //Steel Battalion aiming stick divider, larger is slower
+	NV_PlayerSettings_t player[NV_PLAYERS];
+	uint16_t switchWindowGood; //Shortest personality switch detach window (ms) the console has accepted, 0 if none yet
+	uint16_t switchWindowBad; //Longest detach window (ms) the console has missed, 0 if none
+} NV_Settings_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	void NV_Load(void);
+	void NV_Changed(void);
+	void NV_Task(void);
+
+	extern NV_Settings_t NVSettings;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* NVSETTINGS_H_ */
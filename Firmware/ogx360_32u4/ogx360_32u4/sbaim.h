@@ -0,0 +1,80 @@
+/*
+* sbaim.h
+*
+* The Steel Battalion aiming stick, moved like a mouse cursor by the Xbox 360 right stick.
+* The aim is integrated over the ms since the last update, so it moves at the same speed however often
+* main.cpp gets round to it. Integer maths on the settings.h SB_AIM_ values only, which lets
+* tests/sbaim_test.cpp run the same code on the host.
+*/
+
+
+#ifndef SBAIM_H_
+#define SBAIM_H_
+
+#ifdef SUPPORTBATTALION
+
+#define SB_AIM_CENTRE ((int32_t)32768<<8) //Aim position is Q16.8 so slow speeds still add up
+#define SB_AIM_LIMIT ((int32_t)65535<<8)
+#define SB_AIM_MAX_STEP 50 //ms, longest gap integrated in one go, so a stall doesn't fling the aim
+#define SB_AIM_ACCEL_NONE ((uint32_t)1<<16) //Q8.16
+#define SB_AIM_ACCEL_STEP ((((uint32_t)SB_AIM_ACCEL_MAX-256)<<8)/SB_AIM_ACCEL_TIME) //Q8.16 per ms
+
+typedef struct {
+	int32_t x, y; //Q16.8
+	uint32_t accel; //Q8.16
+} SBAim_t;
+
+//Counts per ms at full deflection (Q8.8) for a sensitivity, larger is slower. Only worth calling when it changes.
+static inline uint16_t aimGain(uint16_t sensitivity){
+	return ((uint32_t)32767<<8)/(sensitivity<128 ? 128 : sensitivity);
+}
+
+//Aim speed in counts per ms (Q8) for a stick position, with the response curve and acceleration applied.
+//gain is from aimGain(), accel is Q8.8. No divides, the AVR doesn't have one.
+static inline int32_t aimSpeed(int32_t axis, uint16_t gain, uint16_t accel){
+	if(axis<=SB_AIM_DEADZONE && axis>=-SB_AIM_DEADZONE)
+		return 0;
+	#if SB_AIM_CURVE
+	int32_t cubic=((axis*axis)>>15)*axis>>15;
+	axis+=((cubic-axis)*SB_AIM_CURVE)>>8;
+	#endif
+	int32_t speed=(axis*gain)>>15;
+	#if SB_AIM_ACCEL_MAX != 256
+	speed=(speed*accel)>>8;
+	#else
+	(void)accel;
+	#endif
+	return speed;
+}
+
+//Moves the aim on by dt ms with the right stick at axisX/axisY (Y up is positive, the aim's Y runs down).
+//Returns true if the stick moved it, so the caller knows to keep updating while it's held.
+static inline bool aimStep(SBAim_t* aim, int32_t axisX, int32_t axisY, uint16_t gain, uint16_t dt){
+	if(dt>SB_AIM_MAX_STEP) dt=SB_AIM_MAX_STEP;
+
+	#if SB_AIM_ACCEL_MAX != 256
+	if(axisX>SB_AIM_ACCEL_THRESHOLD || axisX<-SB_AIM_ACCEL_THRESHOLD ||
+	   axisY>SB_AIM_ACCEL_THRESHOLD || axisY<-SB_AIM_ACCEL_THRESHOLD){
+		aim->accel+=SB_AIM_ACCEL_STEP*dt;
+		if(aim->accel>(uint32_t)SB_AIM_ACCEL_MAX<<8) aim->accel=(uint32_t)SB_AIM_ACCEL_MAX<<8;
+	} else {
+		aim->accel=SB_AIM_ACCEL_NONE;
+	}
+	#endif
+
+	int32_t speedX=aimSpeed(axisX, gain, aim->accel>>8);
+	int32_t speedY=aimSpeed(axisY, gain, aim->accel>>8);
+	aim->x += speedX*dt;
+	aim->y -= speedY*dt;
+
+	if(aim->x<0) aim->x=0;
+	if(aim->x>SB_AIM_LIMIT) aim->x=SB_AIM_LIMIT;
+	if(aim->y>SB_AIM_LIMIT) aim->y=SB_AIM_LIMIT;
+	if(aim->y<0) aim->y=0;
+
+	return speedX!=0 || speedY!=0;
+}
+
+#endif
+
+#endif /* SBAIM_H_ */
@@ -0,0 +1,138 @@
+/*
+* sbmapping.h
+*
+* How the Xbox 360 controller and chatpad drive the Steel Battalion controller.
+* Each entry maps one input to one action, main.cpp runs the entries for the inputs held down each frame.
+* Remapping is a matter of editing SBMap below.
+*/
+
+
+#ifndef SBMAPPING_H_
+#define SBMAPPING_H_
+
+#ifdef SUPPORTBATTALION
+
+/* Inputs. Chatpad keys are 0-63 (see CHATPAD_KEY_INDEX), controller buttons follow as 64 + ButtonEnum.
+ * L2 and R2 count as held when they're off the rest position. */
+#define SB_KEY(k) CHATPAD_KEY_INDEX(k)
+#define SB_PAD(b) (64 + (b))
+#define SB_INPUT_BYTES 11
+
+/* When an entry applies. All the SB_IF_ flags given have to hold. */
+#define SB_ALWAYS 0x00
+#define SB_IF_COMMS 0x01 //MESSENGER or BACK held
+#define SB_IF_NOCOMMS 0x02 //Neither held
+#define SB_IF_NORMAL 0x04 //Not comms and ORANGE not held
+#define SB_IF_ORANGE 0x08
+#define SB_IF_STILL 0x10 //Not rotating, D-pad LEFT and RIGHT not held
+#define SB_IF_MASK 0x1F
+#define SB_ON_CLICK 0x80 //Only on the frame the input goes down
+
+/* Actions, the meaning of value depends on it */
+#define SB_SET(w) (0x00 | (w)) //Set the bits in value in dButtons[w]
+#define SB_CLEAR(w) (0x04 | (w)) //Clear them
+#define SB_TOGGLE(w) (0x08 | (w)) //Flip them, use with SB_ON_CLICK
+#define SB_ROTATION 0x10 //rotationLever = value, back to 0 when released outside of comms
+#define SB_BRAKE 0x14 //middlePedal = value, back to 0 when released
+#define SB_GEAR 0x18 //Move the gear lever by value, R,N,1,2,3,4,5
+#define SB_TUNER 0x1C //Move the tuner dial by value, 0-15
+#define SB_SENSITIVITY 0x20 //Aiming stick sensitivity = value, saved to EEPROM
+#define SB_TOGGLE_ALL 0x24 //All toggle switches off if any are on, otherwise all on
+
+typedef struct
+{
+	uint8_t source; //SB_KEY() or SB_PAD()
+	uint8_t when; //SB_IF_ flags, plus SB_ON_CLICK
+	uint8_t action;
+	uint16_t value;
+} SBMapEntry;
+
+/* Has to stay sorted by source, it's binary searched for each input that's held. The chatpad key order is
+ * 7654321, UYTREWQ, JHGFDSA, NBVCXZ, RIGHT M PERIOD SPACE LEFT, COMMA ENTER P098, BACK L O I K,
+ * then SHIFT GREEN ORANGE MESSENGER, then the controller buttons in ButtonEnum order. */
+static const SBMapEntry SBMap[] PROGMEM = {
+	{SB_KEY(CHATPAD_7), SB_IF_NORMAL, SB_SET(1), SBC_GAMEPAD_W1_FUNCTIONF3},
+	{SB_KEY(CHATPAD_7), SB_IF_ORANGE, SB_SENSITIVITY, 300},
+	{SB_KEY(CHATPAD_6), SB_IF_NORMAL, SB_SET(0), SBC_GAMEPAD_W0_FUNCTIONMANIPULATOR},
+	{SB_KEY(CHATPAD_6), SB_IF_ORANGE, SB_SENSITIVITY, 350},
+	{SB_KEY(CHATPAD_5), SB_IF_COMMS, SB_SET(2), SBC_GAMEPAD_W2_COMM5},
+	{SB_KEY(CHATPAD_5), SB_IF_NORMAL, SB_SET(1), SBC_GAMEPAD_W1_FUNCTIONOVERRIDE},
+	{SB_KEY(CHATPAD_5), SB_IF_ORANGE, SB_SENSITIVITY, 400},
+	{SB_KEY(CHATPAD_4), SB_IF_COMMS, SB_SET(1), SBC_GAMEPAD_W1_COMM4},
+	{SB_KEY(CHATPAD_4), SB_IF_NORMAL, SB_SET(1), SBC_GAMEPAD_W1_FUNCTIONF2},
+	{SB_KEY(CHATPAD_4), SB_IF_ORANGE, SB_SENSITIVITY, 650},
+	{SB_KEY(CHATPAD_3), SB_IF_COMMS, SB_SET(1), SBC_GAMEPAD_W1_COMM3},
+	{SB_KEY(CHATPAD_3), SB_IF_NORMAL, SB_SET(0), SBC_GAMEPAD_W0_FUNCTIONFSS},
+	{SB_KEY(CHATPAD_3), SB_IF_ORANGE, SB_SENSITIVITY, 800},
+	{SB_KEY(CHATPAD_2), SB_IF_COMMS, SB_SET(1), SBC_GAMEPAD_W1_COMM2},
+	{SB_KEY(CHATPAD_2), SB_IF_NORMAL, SB_SET(1), SBC_GAMEPAD_W1_FUNCTIONTANKDETACH},
+	{SB_KEY(CHATPAD_2), SB_IF_ORANGE, SB_SENSITIVITY, 1000},
+	{SB_KEY(CHATPAD_1), SB_IF_COMMS, SB_SET(1), SBC_GAMEPAD_W1_COMM1},
+	{SB_KEY(CHATPAD_1), SB_IF_NORMAL, SB_SET(1), SBC_GAMEPAD_W1_FUNCTIONF1},
+	{SB_KEY(CHATPAD_1), SB_IF_ORANGE, SB_SENSITIVITY, 1200},
+
+	{SB_KEY(CHATPAD_U), SB_ALWAYS, SB_SET(0), SBC_GAMEPAD_W0_MULTIMONOPENCLOSE},
+	{SB_KEY(CHATPAD_W), SB_ON_CLICK, SB_TOGGLE(2), SBC_GAMEPAD_W2_TOGGLEVTLOCATION},
+	{SB_KEY(CHATPAD_Q), SB_ON_CLICK, SB_TOGGLE(2), SBC_GAMEPAD_W2_TOGGLEOXYGENSUPPLY},
+
+	{SB_KEY(CHATPAD_J), SB_ALWAYS, SB_SET(0), SBC_GAMEPAD_W0_MULTIMONMODESELECT},
+	{SB_KEY(CHATPAD_G), SB_ALWAYS, SB_SET(1), SBC_GAMEPAD_W1_CHAFF},
+	{SB_KEY(CHATPAD_F), SB_ALWAYS, SB_SET(1), SBC_GAMEPAD_W1_EXTINGUISHER},
+	{SB_KEY(CHATPAD_D), SB_ALWAYS, SB_SET(1), SBC_GAMEPAD_W1_WASHING},
+	{SB_KEY(CHATPAD_S), SB_ON_CLICK, SB_TOGGLE(2), SBC_GAMEPAD_W2_TOGGLEBUFFREMATERIAL},
+	{SB_KEY(CHATPAD_A), SB_ON_CLICK, SB_TOGGLE(2), SBC_GAMEPAD_W2_TOGGLEFILTERCONTROL},
+
+	{SB_KEY(CHATPAD_N), SB_ALWAYS, SB_SET(0), SBC_GAMEPAD_W0_MAINMONZOOMIN},
+	{SB_KEY(CHATPAD_V), SB_ALWAYS, SB_SET(1), SBC_GAMEPAD_W1_WEAPONCONMAGAZINE},
+	{SB_KEY(CHATPAD_C), SB_ALWAYS, SB_SET(1), SBC_GAMEPAD_W1_WEAPONCONSUB},
+	{SB_KEY(CHATPAD_X), SB_ALWAYS, SB_SET(1), SBC_GAMEPAD_W1_WEAPONCONMAIN},
+	{SB_KEY(CHATPAD_Z), SB_ON_CLICK, SB_TOGGLE(2), SBC_GAMEPAD_W2_TOGGLEFUELFLOWRATE},
+
+	{SB_KEY(CHATPAD_RIGHT), SB_ALWAYS, SB_SET(1), SBC_GAMEPAD_W1_WEAPONCONMAIN},
+	{SB_KEY(CHATPAD_M), SB_ALWAYS, SB_SET(0), SBC_GAMEPAD_W0_MAINMONZOOMOUT},
+	{SB_KEY(CHATPAD_SPACE), SB_ALWAYS, SB_SET(1), SBC_GAMEPAD_W1_WEAPONCONMAGAZINE},
+	{SB_KEY(CHATPAD_LEFT), SB_ALWAYS, SB_SET(1), SBC_GAMEPAD_W1_WEAPONCONSUB},
+
+	//Cockpit hatch and ignition can't both be pressed, some bioses will trigger an IGR
+	{SB_KEY(CHATPAD_COMMA), SB_ALWAYS, SB_SET(0), SBC_GAMEPAD_W0_IGNITION},
+	{SB_KEY(CHATPAD_COMMA), SB_ALWAYS, SB_CLEAR(0), SBC_GAMEPAD_W0_COCKPITHATCH},
+	{SB_KEY(CHATPAD_ENTER), SB_ALWAYS, SB_SET(0), SBC_GAMEPAD_W0_START},
+	{SB_KEY(CHATPAD_P), SB_ALWAYS, SB_SET(0), SBC_GAMEPAD_W0_COCKPITHATCH},
+	{SB_KEY(CHATPAD_P), SB_ALWAYS, SB_CLEAR(0), SBC_GAMEPAD_W0_IGNITION},
+	{SB_KEY(CHATPAD_0), SB_ALWAYS, SB_SET(0), SBC_GAMEPAD_W0_EJECT},
+	{SB_KEY(CHATPAD_9), SB_IF_NORMAL, SB_SET(0), SBC_GAMEPAD_W0_FUNCTIONLINECOLORCHANGE},
+	{SB_KEY(CHATPAD_9), SB_IF_ORANGE, SB_SENSITIVITY, 200},
+	{SB_KEY(CHATPAD_8), SB_IF_NORMAL, SB_SET(1), SBC_GAMEPAD_W1_FUNCTIONNIGHTSCOPE},
+	{SB_KEY(CHATPAD_8), SB_IF_ORANGE, SB_SENSITIVITY, 250},
+
+	{SB_KEY(CHATPAD_BACK), SB_ALWAYS, SB_BRAKE, 0xFF00},
+	{SB_KEY(CHATPAD_I), SB_ALWAYS, SB_SET(0), SBC_GAMEPAD_W0_MULTIMONMAPZOOMINOUT},
+	{SB_KEY(CHATPAD_K), SB_ALWAYS, SB_SET(0), SBC_GAMEPAD_W0_MULTIMONSUBMONITOR},
+
+	{SB_KEY(CHATPAD_SHIFT), SB_ON_CLICK, SB_TOGGLE_ALL, 0},
+
+	//Hold MESSENGER (or BACK) and use the D-pad for the tuner dial, otherwise UP/DOWN change gear and LEFT/RIGHT rotate.
+	//Gear changes are ignored while rotating so they don't happen by accident.
+	{SB_PAD(UP), SB_IF_COMMS | SB_ON_CLICK, SB_TUNER, 2},
+	{SB_PAD(UP), SB_IF_NORMAL | SB_IF_STILL | SB_ON_CLICK, SB_GEAR, 1},
+	{SB_PAD(RIGHT), SB_IF_COMMS | SB_ON_CLICK, SB_TUNER, 2},
+	{SB_PAD(RIGHT), SB_IF_NOCOMMS, SB_ROTATION, 32767},
+	{SB_PAD(DOWN), SB_IF_COMMS | SB_ON_CLICK, SB_TUNER, (uint16_t)-2},
+	{SB_PAD(DOWN), SB_IF_NORMAL | SB_IF_STILL | SB_ON_CLICK, SB_GEAR, (uint16_t)-1},
+	{SB_PAD(LEFT), SB_IF_COMMS | SB_ON_CLICK, SB_TUNER, (uint16_t)-2},
+	{SB_PAD(LEFT), SB_IF_NOCOMMS, SB_ROTATION, (uint16_t)-32767},
+	{SB_PAD(START), SB_ALWAYS, SB_SET(0), SBC_GAMEPAD_W0_START},
+	{SB_PAD(L3), SB_ALWAYS, SB_SET(2), SBC_GAMEPAD_W2_LEFTJOYSIGHTCHANGE},
+	{SB_PAD(R3), SB_ALWAYS, SB_SET(0), SBC_GAMEPAD_W0_RIGHTJOYLOCKON},
+	{SB_PAD(L1), SB_ALWAYS, SB_SET(0), SBC_GAMEPAD_W0_RIGHTJOYFIRE},
+	{SB_PAD(R1), SB_ALWAYS, SB_SET(0), SBC_GAMEPAD_W0_RIGHTJOYMAINWEAPON},
+	{SB_PAD(B), SB_ALWAYS, SB_SET(0), SBC_GAMEPAD_W0_RIGHTJOYLOCKON},
+	{SB_PAD(A), SB_ALWAYS, SB_SET(0), SBC_GAMEPAD_W0_RIGHTJOYMAINWEAPON},
+	{SB_PAD(Y), SB_ALWAYS, SB_SET(1), SBC_GAMEPAD_W1_CHAFF},
+	{SB_PAD(XBOX), SB_ALWAYS, SB_SET(0), SBC_GAMEPAD_W0_EJECT},
+};
+#define SB_MAP_ENTRIES (sizeof(SBMap) / sizeof(SBMap[0]))
+
+#endif
+
+#endif /* SBMAPPING_H_ */
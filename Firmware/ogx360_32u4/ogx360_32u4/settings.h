@@ -27,6 +27,16 @@
 /* Define this to add support for Steel Battalion Controller emulation with an Xbox 360 Wireless Controller Chatpad. (It wont work with any wired controllers) *///
 #define SUPPORTBATTALION
 
+/* Steel Battalion aiming stick. The aim moves at (stick/sensitivity) counts per ms, whatever the loop rate. The sensitivity is
+ * picked on the chatpad with ORANGE + 1-9. SB_AIM_CURVE blends in a cubic response for finer control near the centre,
+ * 0 is linear (as before) and 256 fully cubic. Holding the stick past SB_AIM_ACCEL_THRESHOLD speeds the aim up to
+ * SB_AIM_ACCEL_MAX/256 times over SB_AIM_ACCEL_TIME ms, 256 turns acceleration off. */
+#define SB_AIM_DEADZONE 7500
+#define SB_AIM_CURVE 0
+#define SB_AIM_ACCEL_MAX 256
+#define SB_AIM_ACCEL_THRESHOLD 30000
+#define SB_AIM_ACCEL_TIME 1000
+
 /* Define this to add support for Wired Xbox One Controllers. */
 //#define SUPPORTWIREDXBOXONE
 
@@ -35,6 +45,13 @@
 
 #endif
 
+/* Define this to advertise a faster polling interval (OVERCLOCK_INTERVAL ms, 1 or 2) to the console instead of the genuine 4ms.
+ * Only some modded consoles and emulators honour it. On the master it can be toggled at runtime with chatpad GREEN + SHIFT.
+ * Players 2-4 share the I2C fan-out to their slaves, so they won't all keep up with a 1ms poll. XIDTelemetry has the
+ * delivered rates, reportRate for player 1 and slaveReportRate for players 2-4. */
+//#define SUPPORTOVERCLOCK
+#define OVERCLOCK_INTERVAL 1
+
 
 /* prototypes */
 void sendControllerHIDReport();
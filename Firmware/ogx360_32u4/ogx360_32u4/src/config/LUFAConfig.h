@@ -51,4 +51,8 @@
 #define FIXED_CONTROL_ENDPOINT_SIZE      32
 #define FIXED_NUM_CONFIGURATIONS         1
 
+/* Service the control endpoint from the USB_COM interrupt so XID vendor requests and
+ * rumble SET_REPORTs are answered even while the main loop is blocked in the host stack. */
+#define INTERRUPT_CONTROL_ENDPOINT
+
 #endif
@@ -17,13 +17,67 @@ e-mail   :  support@circuitsathome.com
 /* USB functions */
 
 #include "Usb.h"
+#include "timebase.h"
+
+//Task() runs in the main loop's frame, nothing here may block. Waits go through the enumeration state machine instead.
+#pragma GCC poison delay
 
 static uint8_t usb_error = 0;
 static uint8_t usb_task_state;
 
+// Devices that need longer than the USB 2.0 minimums to enumerate. Third party receivers were only ever
+// run with the old library timings (400ms after reset, 300ms after SET_ADDRESS, 200ms before SET_CONFIGURATION),
+// so they keep those until someone confirms they cope with less.
+static const USB_TIMING_QUIRK UsbTimingQuirks[] PROGMEM = {
+        { 0x045E, 0x0291, { 400, 300, 200 } }, // Third party Wireless Gaming Receiver
+        { 0x045E, 0x02AA, { 400, 300, 200 } }, // Another Third party Wireless Gaming Receiver
+        { 0x162E, 0x0291, { 400, 300, 200 } }, // Joytech receivers
+        { 0x162E, 0x02AA, { 400, 300, 200 } },
+        { 0x162E, 0x0719, { 400, 300, 200 } },
+        { 0x1BAD, 0x0291, { 400, 300, 200 } }, // Mad Catz receivers
+        { 0x1BAD, 0x02AA, { 400, 300, 200 } },
+        { 0x1BAD, 0x0719, { 400, 300, 200 } },
+};
+
+// VID/PID pairs we know the driver for, so Configuring() can go straight to it.
+// Must stay sorted by VID then PID, it's binary searched. Anything not in here still gets the full driver walk.
+static const USB_DRIVER_ENTRY UsbDriverTable[] PROGMEM = {
+        { 0x045E, 0x028E, USB_DRIVER_XBOXUSB }, // Microsoft 360 Wired controller, also 8bitdo pads in X-input mode
+        { 0x045E, 0x0291, USB_DRIVER_XBOXRECV }, // Third party Wireless Gaming Receiver
+        { 0x045E, 0x02A7, USB_DRIVER_XBOXONE }, // XBOX_ONE_PID14, XBOXONE takes it under any of its VIDs
+        { 0x045E, 0x02AA, USB_DRIVER_XBOXRECV }, // Another Third party Wireless Gaming Receiver
+        { 0x045E, 0x02D1, USB_DRIVER_XBOXONE }, // Xbox One pad
+        { 0x045E, 0x02DD, USB_DRIVER_XBOXONE }, // Xbox One pad (Firmware 2015)
+        { 0x045E, 0x02E3, USB_DRIVER_XBOXONE }, // Xbox One Elite pad
+        { 0x045E, 0x02EA, USB_DRIVER_XBOXONE }, // Xbox One S pad
+        { 0x045E, 0x0719, USB_DRIVER_XBOXRECV }, // Microsoft Wireless Gaming Receiver
+        { 0x045E, 0x0B0A, USB_DRIVER_XBOXONE }, // Xbox One Adaptive Controller
+        { 0x0738, 0x4A01, USB_DRIVER_XBOXONE }, // Mad Catz FightStick TE 2
+        { 0x0E6F, 0x0139, USB_DRIVER_XBOXONE }, // Afterglow Prismatic Wired Controller
+        { 0x0E6F, 0x0146, USB_DRIVER_XBOXONE }, // Rock Candy Wired Controller for Xbox One
+        { 0x0E6F, 0x0213, USB_DRIVER_XBOXUSB }, // Afterglow wired controller
+        { 0x0E6F, 0x0401, USB_DRIVER_XBOXUSB }, // Gamestop wired controller
+        { 0x0F0D, 0x0067, USB_DRIVER_XBOXONE }, // HORIPAD ONE
+        { 0x1532, 0x0A03, USB_DRIVER_XBOXONE }, // Razer Wildcat
+        { 0x162E, 0x0291, USB_DRIVER_XBOXRECV }, // Joytech Wireless Gaming Receiver
+        { 0x162E, 0x02AA, USB_DRIVER_XBOXRECV }, // Joytech Wireless Gaming Receiver
+        { 0x162E, 0x0719, USB_DRIVER_XBOXRECV }, // Joytech Wireless Gaming Receiver
+        { 0x162E, 0xBEEF, USB_DRIVER_XBOXUSB }, // Joytech wired controller
+        { 0x1BAD, 0x0291, USB_DRIVER_XBOXRECV }, // Mad Catz Wireless Gaming Receiver
+        { 0x1BAD, 0x02AA, USB_DRIVER_XBOXRECV }, // Mad Catz Wireless Gaming Receiver
+        { 0x1BAD, 0x0719, USB_DRIVER_XBOXRECV }, // Mad Catz Wireless Gaming Receiver
+        { 0x1BAD, 0xF016, USB_DRIVER_XBOXUSB }, // Mad Catz wired controller
+        { 0x1BAD, 0xF03A, USB_DRIVER_XBOXUSB }, // Mad Catz FightStick Neo
+        { 0x24C6, 0x02A7, USB_DRIVER_XBOXONE }, // PowerA Xbox One wired controller (XBOX_ONE_PID14)
+        { 0x24C6, 0x541A, USB_DRIVER_XBOXONE }, // PowerA Xbox One Mini Wired Controller
+        { 0x24C6, 0x542A, USB_DRIVER_XBOXONE }, // Xbox ONE spectra
+        { 0x24C6, 0x543A, USB_DRIVER_XBOXONE }, // PowerA Xbox One wired controller
+};
+
 /* constructor */
-USB::USB() : bmHubPre(0) {
+USB::USB() : bmHubPre(0), xferDev(NULL), xferTimeout(0) {
         usb_task_state = USB_DETACHED_SUBSTATE_INITIALIZE; //set up state machine
+        memset(&xferStats, 0, sizeof (xferStats));
         init();
 }
 
@@ -31,6 +85,45 @@ USB::USB() : bmHubPre(0) {
 void USB::init() {
         //devConfigIndex = 0;
         bmHubPre = 0;
+        enumStage = USB_ENUM_IDLE;
+        enumDeadline = 0;
+        LoadEnumTiming(0, 0);
+}
+
+// Driver class for a device, USB_DRIVER_NONE if it isn't one we know
+uint8_t USB::FindDriverClass(uint16_t vid, uint16_t pid, uint8_t klass) {
+        uint32_t key = ((uint32_t)vid << 16) | pid;
+        uint8_t lo = 0;
+        uint8_t hi = sizeof (UsbDriverTable) / sizeof (UsbDriverTable[0]);
+
+        if(klass == 0x09)
+                return USB_DRIVER_HUB;
+
+        while(lo < hi) {
+                uint8_t mid = (lo + hi) >> 1;
+                uint32_t entry = ((uint32_t)pgm_read_word(&UsbDriverTable[mid].vid) << 16) | pgm_read_word(&UsbDriverTable[mid].pid);
+                if(entry == key)
+                        return pgm_read_byte(&UsbDriverTable[mid].driverClass);
+                if(entry < key)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        return USB_DRIVER_NONE;
+}
+
+// Picks the enumeration timing for the device about to be configured
+void USB::LoadEnumTiming(uint16_t vid, uint16_t pid) {
+        enumTiming.resetRecovery = USB_RESET_RECOVERY;
+        enumTiming.setAddrRecovery = USB_SETADDR_RECOVERY;
+        enumTiming.setConfDelay = USB_SETCONF_DELAY;
+
+        for(uint8_t i = 0; i < sizeof (UsbTimingQuirks) / sizeof (UsbTimingQuirks[0]); i++) {
+                if(pgm_read_word(&UsbTimingQuirks[i].vid) == vid && pgm_read_word(&UsbTimingQuirks[i].pid) == pid) {
+                        memcpy_P(&enumTiming, &UsbTimingQuirks[i].timing, sizeof (USB_ENUM_TIMING));
+                        break;
+                }
+        }
 }
 
 uint8_t USB::getUsbTaskState(void) {
@@ -93,6 +186,11 @@ uint8_t USB::SetAddress(uint8_t addr, uint8_t ep, EpInfo **ppep, uint16_t *nak_l
 
         *nak_limit = (0x0001UL << (((*ppep)->bmNakPower > USB_NAK_MAX_POWER) ? USB_NAK_MAX_POWER : (*ppep)->bmNakPower));
         (*nak_limit)--;
+
+        // Endpoints polled with USB_NAK_NOWAIT are interrupt endpoints that get asked again next loop,
+        // they only get a few frames. Everything else is allowed the control transfer timeout.
+        xferDev = p;
+        xferTimeout = ((*ppep)->bmNakPower == USB_NAK_NOWAIT) ? USB_INT_XFER_TIMEOUT : USB_XFER_TIMEOUT * 1000UL;
         /*
           USBTRACE2("\r\nAddress: ", addr);
           USBTRACE2(" EP: ", ep);
@@ -132,6 +230,8 @@ uint8_t USB::ctrlReq(uint8_t addr, uint8_t ep, uint8_t bmReqType, uint8_t bReque
         EpInfo *pep = NULL;
         uint16_t nak_limit = 0;
 
+        ctrlReqCount++;
+
         rcode = SetAddress(addr, ep, &pep, &nak_limit);
 
         if(rcode)
@@ -207,20 +307,27 @@ uint8_t USB::inTransfer(uint8_t addr, uint8_t ep, uint16_t *nbytesptr, uint8_t*
         EpInfo *pep = NULL;
         uint16_t nak_limit = 0;
 
-        /*uint8_t rcode = */SetAddress(addr, ep, &pep, &nak_limit);
-			/*
+        uint8_t rcode = SetAddress(addr, ep, &pep, &nak_limit);
+
         if(rcode) {
-                USBTRACE3("(USB::InTransfer) SetAddress Failed ", rcode, 0x81);
-                USBTRACE3("(USB::InTransfer) addr requested ", addr, 0x81);
-                USBTRACE3("(USB::InTransfer) ep requested ", ep, 0x81);
+                *nbytesptr = 0;
                 return rcode;
-        }*/
-        return InTransfer(pep, nak_limit, nbytesptr, data, bInterval);
+        }
+
+        if(InBackoff(xferDev)) {
+                *nbytesptr = 0;
+                return USB_ERROR_DEVICE_BACKOFF;
+        }
+
+        rcode = InTransfer(pep, nak_limit, nbytesptr, data, bInterval);
+        NoteTransferResult(xferDev, rcode);
+        return rcode;
 }
 
 uint8_t USB::InTransfer(EpInfo *pep, uint16_t nak_limit, uint16_t *nbytesptr, uint8_t* data, uint8_t bInterval /*= 0*/) {
         uint8_t rcode = 0;
         uint8_t pktsize;
+        uint8_t toggle_retries = 0;
 
         uint16_t nbytes = *nbytesptr;
         //printf("Requesting %i bytes ", nbytes);
@@ -232,7 +339,7 @@ uint8_t USB::InTransfer(EpInfo *pep, uint16_t nak_limit, uint16_t *nbytesptr, ui
         // use a 'break' to exit this loop
         while(1) {
                 rcode = dispatchPkt(tokIN, pep->epAddr, nak_limit); //IN packet to EP-'endpoint'. Function takes care of NAKS.
-                if(rcode == hrTOGERR) {
+                if(rcode == hrTOGERR && toggle_retries++ < USB_RETRY_LIMIT) {
                         // yes, we flip it wrong here so that next time it is actually correct!
                         pep->bmRcvToggle = (regRd(rHRSL) & bmRCVTOGRD) ? 0 : 1;
                         regWr(rHCTL, (pep->bmRcvToggle) ? bmRCVTOG1 : bmRCVTOG0); //set toggle value
@@ -280,12 +387,123 @@ uint8_t USB::InTransfer(EpInfo *pep, uint16_t nak_limit, uint16_t *nbytesptr, ui
                         //printf("\r\n");
                         rcode = 0;
                         break;
-                } else if(bInterval > 0)
-                        delay(bInterval); // Delay according to polling interval
+                }
+                // No wait for bInterval between packets, the device NAKs until it has the next one and
+                // the NAK limit and transfer deadline bound that.
         } //while( 1 )
         return ( rcode);
 }
 
+/* One IN packet from each of several interrupt endpoints of the same device. The RCVFIFO is double buffered, so  */
+/* the IN for the next endpoint is launched first and the previous packet is read out of the FIFO while it is on  */
+/* the bus. NAKs are skipped, each packet that arrives is handed to parser->ParseIn().                           */
+
+/* Most of these come back NAK (a controller only reports when something changes), so a NAK costs as few SPI    */
+/* transactions as possible: rHCTL is only written when the toggle differs from the one the SIE already has, and */
+/* nothing else is touched. Bit n of *nakMask is set if eps[n] NAKed.                                           */
+
+/* Returns the first error, the remaining endpoints are still polled. Only for endpoints polled with             */
+/* USB_NAK_NOWAIT and packets that fit in one maxPktSize, it doesn't retry or continue anything.                */
+uint8_t USB::pollInPipes(uint8_t addr, const uint8_t *eps, uint8_t count, uint8_t *data, uint8_t nbytes, USBInPipeParser *parser, uint8_t *nakMask) {
+        EpInfo *pep = NULL;
+        uint16_t nak_limit = 0;
+        uint8_t result = hrSUCCESS;
+        int8_t pending = -1; // eps[] index of the packet waiting in the RCVFIFO
+        uint8_t sieToggle = 0xFF; // receive toggle the SIE has, 0xFF if not known
+        uint8_t naks = 0;
+
+        if(!count)
+                return hrSUCCESS;
+
+        uint8_t rcode = SetAddress(addr, eps[0], &pep, &nak_limit);
+
+        if(rcode)
+                return rcode;
+
+        UsbDevice *p = xferDev;
+
+        if(InBackoff(p))
+                return USB_ERROR_DEVICE_BACKOFF;
+
+        for(uint8_t n = 0; n <= count; n++) {
+                pep = NULL;
+                if(n < count) {
+                        pep = getEpInfoEntry(addr, eps[n]);
+                        if(pep) {
+                                if(pep->bmRcvToggle != sieToggle) {
+                                        regWr(rHCTL, (pep->bmRcvToggle) ? bmRCVTOG1 : bmRCVTOG0); //set toggle value
+                                        sieToggle = pep->bmRcvToggle;
+                                }
+                                regWr(rHXFR, (tokIN | pep->epAddr)); //launch the transfer
+                        } else if(!result)
+                                result = USB_ERROR_EP_NOT_FOUND_IN_TBL;
+                }
+                uint32_t deadline = (uint32_t)micros() + xferTimeout;
+
+                // Read out the previous endpoint's packet while this one is on the bus
+                if(pending >= 0) {
+                        uint8_t pktsize = regRd(rRCVBC); //number of received bytes
+                        if(pktsize > nbytes)
+                                pktsize = nbytes;
+                        bytesRd(rRCVFIFO, pktsize, data);
+                        regWr(rHIRQ, bmRCVDAVIRQ); // Clear the IRQ & free the buffer
+                        parser->ParseIn(pending, pktsize, data);
+                        pending = -1;
+                }
+
+                if(!pep)
+                        continue;
+
+                uint8_t hirq = WaitTransferDone(deadline);
+                if(!hirq) {
+                        CountError(xferStats.timeouts);
+                        if(!result)
+                                result = USB_ERROR_TRANSFER_TIMEOUT;
+                        break;
+                }
+
+                uint8_t hrsl = regRd(rHRSL);
+                rcode = (hrsl & 0x0f); //analyze transfer result
+                if(rcode == hrNAK) {
+                        naks |= (1 << n);
+                        continue;
+                }
+
+                switch(rcode) {
+                        case hrSUCCESS:
+                                if((hirq & bmRCVDAVIRQ) == 0) {
+                                        rcode = 0xf0; //receive error
+                                        sieToggle = 0xFF;
+                                        break;
+                                }
+                                pep->bmRcvToggle = (hrsl & bmRCVTOGRD) ? 1 : 0; // Save toggle value
+                                sieToggle = pep->bmRcvToggle;
+                                pending = n;
+                                break;
+                        case hrTOGERR:
+                                CountError(xferStats.toggleErrors);
+                                // yes, we flip it wrong here so that next time it is actually correct!
+                                pep->bmRcvToggle = (hrsl & bmRCVTOGRD) ? 0 : 1;
+                                sieToggle = 0xFF;
+                                break;
+                        case hrTIMEOUT:
+                                CountError(xferStats.timeouts);
+                                sieToggle = 0xFF;
+                                break;
+                        default:
+                                sieToggle = 0xFF;
+                                break;
+                }
+                if(rcode && !result)
+                        result = rcode;
+        }
+
+        if(nakMask)
+                *nakMask = naks;
+        NoteTransferResult(p, result);
+        return result;
+}
+
 /* OUT transfer to arbitrary endpoint. Handles multiple packets if necessary. Transfers 'nbytes' bytes. */
 /* Handles NAK bug per Maxim Application Note 4000 for single buffer transfer   */
 
@@ -299,7 +517,12 @@ uint8_t USB::outTransfer(uint8_t addr, uint8_t ep, uint16_t nbytes, uint8_t* dat
         if(rcode)
                 return rcode;
 
-        return OutTransfer(pep, nak_limit, nbytes, data);
+        if(InBackoff(xferDev))
+                return USB_ERROR_DEVICE_BACKOFF;
+
+        rcode = OutTransfer(pep, nak_limit, nbytes, data);
+        NoteTransferResult(xferDev, rcode);
+        return rcode;
 }
 
 uint8_t USB::OutTransfer(EpInfo *pep, uint16_t nak_limit, uint16_t nbytes, uint8_t *data) {
@@ -313,7 +536,7 @@ uint8_t USB::OutTransfer(EpInfo *pep, uint16_t nak_limit, uint16_t nbytes, uint8
         if(maxpktsize < 1 || maxpktsize > 64)
                 return USB_ERROR_INVALID_MAX_PKT_SIZE;
 
-        uint32_t timeout = (uint32_t)millis() + USB_XFER_TIMEOUT;
+        uint32_t deadline = (uint32_t)micros() + xferTimeout;
 
         regWr(rHCTL, (pep->bmSndToggle) ? bmSNDTOG1 : bmSNDTOG0); //set toggle value
 
@@ -324,25 +547,36 @@ uint8_t USB::OutTransfer(EpInfo *pep, uint16_t nak_limit, uint16_t nbytes, uint8
                 bytesWr(rSNDFIFO, bytes_tosend, data_p); //filling output FIFO
                 regWr(rSNDBC, bytes_tosend); //set number of bytes
                 regWr(rHXFR, (tokOUT | pep->epAddr)); //dispatch packet
-                while(!(regRd(rHIRQ) & bmHXFRDNIRQ)); //wait for the completion IRQ
-                regWr(rHIRQ, bmHXFRDNIRQ); //clear IRQ
+                if(!WaitTransferDone(deadline))
+                        goto timedout;
                 rcode = (regRd(rHRSL) & 0x0f);
 
-                while(rcode && ((int32_t)((uint32_t)millis() - timeout) < 0L)) {
+                while(rcode) {
+                        if((int32_t)((uint32_t)micros() - deadline) >= 0L) {
+                                if(rcode == hrNAK)
+                                        goto breakout; // same as running out of NAKs
+                                goto timedout;
+                        }
                         switch(rcode) {
                                 case hrNAK:
                                         nak_count++;
-                                        if(nak_limit && (nak_count == nak_limit))
+                                        if(nak_limit && (nak_count == nak_limit)) {
+                                                if(nak_limit > 1)
+                                                        CountError(xferStats.nakLimits);
                                                 goto breakout;
+                                        }
                                         //return ( rcode);
                                         break;
                                 case hrTIMEOUT:
                                         retry_count++;
-                                        if(retry_count == USB_RETRY_LIMIT)
+                                        if(retry_count == USB_RETRY_LIMIT) {
+                                                CountError(xferStats.timeouts);
                                                 goto breakout;
+                                        }
                                         //return ( rcode);
                                         break;
                                 case hrTOGERR:
+                                        CountError(xferStats.toggleErrors);
                                         // yes, we flip it wrong here so that next time it is actually correct!
                                         pep->bmSndToggle = (regRd(rHRSL) & bmSNDTOGRD) ? 0 : 1;
                                         regWr(rHCTL, (pep->bmSndToggle) ? bmSNDTOG1 : bmSNDTOG0); //set toggle value
@@ -356,13 +590,18 @@ uint8_t USB::OutTransfer(EpInfo *pep, uint16_t nak_limit, uint16_t nbytes, uint8
                         regWr(rSNDFIFO, *data_p);
                         regWr(rSNDBC, bytes_tosend);
                         regWr(rHXFR, (tokOUT | pep->epAddr)); //dispatch packet
-                        while(!(regRd(rHIRQ) & bmHXFRDNIRQ)); //wait for the completion IRQ
-                        regWr(rHIRQ, bmHXFRDNIRQ); //clear IRQ
+                        if(!WaitTransferDone(deadline))
+                                goto timedout;
                         rcode = (regRd(rHRSL) & 0x0f);
-                }//while( rcode && ....
+                }//while( rcode...
                 bytes_left -= bytes_tosend;
                 data_p += bytes_tosend;
         }//while( bytes_left...
+        goto breakout;
+
+timedout:
+        CountError(xferStats.timeouts);
+        rcode = USB_ERROR_TRANSFER_TIMEOUT;
 breakout:
 
         pep->bmSndToggle = (regRd(rHRSL) & bmSNDTOGRD) ? 1 : 0; //bmSNDTOG1 : bmSNDTOG0;  //update toggle
@@ -373,66 +612,108 @@ breakout:
 /* If nak_limit == 0, do not count NAKs, exit after timeout                                         */
 /* If bus timeout, re-sends up to USB_RETRY_LIMIT times                                             */
 
+/* The transfer gets xferTimeout us (see SetAddress()) in total, after that it gives up with 0xff, or hrNAK  */
+/* if the device was still NAKing                                                                   */
+
 /* return codes 0x00-0x0f are HRSLT( 0x00 being success ), 0xff means timeout                       */
 uint8_t USB::dispatchPkt(uint8_t token, uint8_t ep, uint16_t nak_limit) {
-        uint32_t timeout = (uint32_t)millis() + USB_XFER_TIMEOUT;
-        uint8_t tmpdata;
-        uint8_t rcode = hrSUCCESS;
+        uint32_t deadline = (uint32_t)micros() + xferTimeout;
+        uint8_t rcode = USB_ERROR_TRANSFER_TIMEOUT;
         uint8_t retry_count = 0;
         uint16_t nak_count = 0;
 
-        while((int32_t)((uint32_t)millis() - timeout) < 0L) {
+        do {
 #if defined(ESP8266) || defined(ESP32)
                         yield(); // needed in order to reset the watchdog timer on the ESP8266
 #endif
                 regWr(rHXFR, (token | ep)); //launch the transfer
-                rcode = USB_ERROR_TRANSFER_TIMEOUT;
-
-                while((int32_t)((uint32_t)millis() - timeout) < 0L) //wait for transfer completion
-                {
-#if defined(ESP8266) || defined(ESP32)
-                        yield(); // needed in order to reset the watchdog timer on the ESP8266
-#endif
-                        tmpdata = regRd(rHIRQ);
 
-                        if(tmpdata & bmHXFRDNIRQ) {
-                                regWr(rHIRQ, bmHXFRDNIRQ); //clear the interrupt
-                                rcode = 0x00;
-                                break;
-                        }//if( tmpdata & bmHXFRDNIRQ
-
-                }//while ( millis() < timeout
-
-                //if (rcode != 0x00) //exit if timeout
-                //        return ( rcode);
+                if(!WaitTransferDone(deadline)) {
+                        rcode = USB_ERROR_TRANSFER_TIMEOUT;
+                        break;
+                }
 
                 rcode = (regRd(rHRSL) & 0x0f); //analyze transfer result
 
                 switch(rcode) {
                         case hrNAK:
                                 nak_count++;
-                                if(nak_limit && (nak_count == nak_limit))
+                                if(nak_limit && (nak_count == nak_limit)) {
+                                        if(nak_limit > 1)
+                                                CountError(xferStats.nakLimits);
                                         return (rcode);
+                                }
                                 break;
                         case hrTIMEOUT:
                                 retry_count++;
-                                if(retry_count == USB_RETRY_LIMIT)
+                                if(retry_count == USB_RETRY_LIMIT) {
+                                        CountError(xferStats.timeouts);
                                         return (rcode);
+                                }
                                 break;
+                        case hrTOGERR:
+                                CountError(xferStats.toggleErrors);
+                                return (rcode);
                         default:
                                 return (rcode);
                 }//switch( rcode
 
-        }//while( timeout > millis()
+        } while((int32_t)((uint32_t)micros() - deadline) < 0L);
+
+        if(rcode != hrNAK)
+                CountError(xferStats.timeouts);
         return ( rcode);
 }
 
+/* Waits for the transfer launched through rHXFR to finish and clears HXFRDNIRQ.    */
+/* Returns rHIRQ as read when the transfer finished, 0 if the deadline (micros())   */
+/* passes first                                                                     */
+uint8_t USB::WaitTransferDone(uint32_t deadline) {
+        uint8_t hirq;
+        while(!((hirq = regRd(rHIRQ)) & bmHXFRDNIRQ)) {
+#if defined(ESP8266) || defined(ESP32)
+                yield(); // needed in order to reset the watchdog timer on the ESP8266
+#endif
+                if((int32_t)((uint32_t)micros() - deadline) >= 0L)
+                        return 0;
+        }
+        regWr(rHIRQ, bmHXFRDNIRQ); //clear the interrupt
+        return hirq;
+}
+
+/* A device that keeps failing data transfers is left alone for a while, doubling each time, */
+/* so one bad receiver or hub port can't eat every player's loop time                          */
+bool USB::InBackoff(UsbDevice *p) {
+        if(p->errorCount < USB_BACKOFF_THRESHOLD)
+                return false;
+        if((int8_t)((uint8_t)timebase_now - p->backoffUntil) < 0) {
+                CountError(xferStats.backoffs);
+                return true;
+        }
+        return false;
+}
+
+void USB::NoteTransferResult(UsbDevice *p, uint8_t rcode) {
+        if(rcode == hrSUCCESS || rcode == hrNAK) {
+                p->errorCount = 0;
+                return;
+        }
+        if(p->errorCount != 0xFF)
+                p->errorCount++;
+        if(p->errorCount >= USB_BACKOFF_THRESHOLD) {
+                uint8_t power = p->errorCount - USB_BACKOFF_THRESHOLD;
+                if(power > USB_BACKOFF_MAX_POWER)
+                        power = USB_BACKOFF_MAX_POWER;
+                p->backoffUntil = (uint8_t)timebase_now + (1 << power);
+        }
+}
+
 /* USB main task. Performs enumeration/cleanup */
 void USB::Task(void) //USB state machine
 {
         uint8_t rcode;
         uint8_t tmpdata;
-        static uint32_t delay = 0;
+        static uint32_t settleDeadline = 0; //millis() the attach settle or reset recovery wait ends
         //USB_DEVICE_DESCRIPTOR buf;
         bool lowspeed = false;
 
@@ -457,7 +738,7 @@ void USB::Task(void) //USB state machine
                         //intentional fallthrough
                 case FSHOST: //attached
                         if((usb_task_state & USB_STATE_MASK) == USB_STATE_DETACHED) {
-                                delay = (uint32_t)millis() + USB_SETTLE_DELAY;
+                                settleDeadline = (uint32_t)millis() + USB_SETTLE_DELAY;
                                 usb_task_state = USB_ATTACHED_SUBSTATE_SETTLE;
                         }
                         break;
@@ -467,6 +748,19 @@ void USB::Task(void) //USB state machine
                 if(devConfig[i])
                         rcode = devConfig[i]->Poll();
 
+        // Carry on with a device that is part way through being configured. The devices above keep being polled meanwhile.
+        if(enumStage != USB_ENUM_IDLE && (usb_task_state & USB_STATE_MASK) != USB_STATE_DETACHED) {
+                bool root = (enumParent == 0);
+                rcode = ContinueConfiguring();
+                if(root && usb_task_state == USB_STATE_CONFIGURING && rcode != USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE) {
+                        if(rcode) {
+                                usb_error = rcode;
+                                usb_task_state = USB_STATE_ERROR;
+                        } else
+                                usb_task_state = USB_STATE_RUNNING;
+                }
+        }
+
         switch(usb_task_state) {
                 case USB_DETACHED_SUBSTATE_INITIALIZE:
                         init();
@@ -482,7 +776,7 @@ void USB::Task(void) //USB state machine
                 case USB_DETACHED_SUBSTATE_ILLEGAL: //just sit here
                         break;
                 case USB_ATTACHED_SUBSTATE_SETTLE: //settle time for just attached device
-                        if((int32_t)((uint32_t)millis() - delay) >= 0L)
+                        if((int32_t)((uint32_t)millis() - settleDeadline) >= 0L)
                                 usb_task_state = USB_ATTACHED_SUBSTATE_RESET_DEVICE;
                         else break; // don't fall through
                 case USB_ATTACHED_SUBSTATE_RESET_DEVICE:
@@ -505,13 +799,14 @@ void USB::Task(void) //USB state machine
                                         usb_task_state = USB_STATE_CONFIGURING;
                                  */
                                 usb_task_state = USB_ATTACHED_SUBSTATE_WAIT_RESET;
-                                delay = (uint32_t)millis() + 20;
+                                settleDeadline = (uint32_t)millis() + USB_RESET_RECOVERY;
                         }
                         break;
                 case USB_ATTACHED_SUBSTATE_WAIT_RESET:
-                        if((int32_t)((uint32_t)millis() - delay) >= 0L) usb_task_state = USB_STATE_CONFIGURING;
+                        if((int32_t)((uint32_t)millis() - settleDeadline) >= 0L) usb_task_state = USB_STATE_CONFIGURING;
                         else break; // don't fall through
                 case USB_STATE_CONFIGURING:
+                        if(enumStage != USB_ENUM_IDLE) break; // still going, see above
 
                         //Serial.print("\r\nConf.LS: ");
                         //Serial.println(lowspeed, HEX);
@@ -574,45 +869,83 @@ uint8_t USB::DefaultAddressing(uint8_t parent, uint8_t port, bool lowspeed) {
         return 0;
 };
 
+// Sends a reset to wherever the device being configured is plugged in
+void USB::ResetDevicePort(uint8_t parent, uint8_t port) {
+        if(parent == 0) {
+                // Send a bus reset on the root interface.
+                regWr(rHCTL, bmBUSRST); //issue bus reset
+        } else {
+                // reset parent port
+                devConfig[parent]->ResetHubPort(port);
+        }
+}
+
+// Starts configuring a device with the given driver. Whenever the device needs time (resets, retries, the driver
+// waiting after SET_ADDRESS) this returns USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE and Task() picks it back up
+// through ContinueConfiguring() once the wait is over, instead of sitting in delay().
 uint8_t USB::AttemptConfig(uint8_t driver, uint8_t parent, uint8_t port, bool lowspeed) {
         //printf("AttemptConfig: parent = %i, port = %i\r\n", parent, port);
-        uint8_t retries = 0;
+        enumDriver = driver;
+        enumParent = parent;
+        enumPort = port;
+        enumLowspeed = lowspeed;
+        enumRetries = 0;
+        enumStage = USB_ENUM_CONFIGURE; // enumDeadline is left alone so a reset from a failed attempt is waited out first
+        return ContinueConfiguring();
+}
 
-again:
-        uint8_t rcode = devConfig[driver]->ConfigureDevice(parent, port, lowspeed);
-        if(rcode == USB_ERROR_CONFIG_REQUIRES_ADDITIONAL_RESET) {
-                if(parent == 0) {
-                        // Send a bus reset on the root interface.
-                        regWr(rHCTL, bmBUSRST); //issue bus reset
-                        delay(102); // delay 102ms, compensate for clock inaccuracy.
-                } else {
-                        // reset parent port
-                        devConfig[parent]->ResetHubPort(port);
-                }
-        } else if(rcode == hrJERR && retries < 3) { // Some devices returns this when plugged in - trying to initialize the device again usually works
-                delay(100);
-                retries++;
-                goto again;
-        } else if(rcode)
-                return rcode;
+uint8_t USB::ContinueConfiguring() {
+        uint8_t rcode;
 
-        rcode = devConfig[driver]->Init(parent, port, lowspeed);
-        if(rcode == hrJERR && retries < 3) { // Some devices returns this when plugged in - trying to initialize the device again usually works
-                delay(100);
-                retries++;
-                goto again;
+        if((int32_t)((uint32_t)millis() - enumDeadline) < 0L)
+                return USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE;
+
+        switch(enumStage) {
+                case USB_ENUM_CONFIGURE:
+                        rcode = devConfig[enumDriver]->ConfigureDevice(enumParent, enumPort, enumLowspeed);
+                        if(rcode == USB_ERROR_CONFIG_REQUIRES_ADDITIONAL_RESET) {
+                                enumStage = USB_ENUM_RESET;
+                                return USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE;
+                        } else if(rcode == hrJERR && enumRetries < 3) { // Some devices returns this when plugged in - trying to initialize the device again usually works
+                                enumRetries++;
+                                enumDeadline = (uint32_t)millis() + USB_ENUM_RETRY_DELAY;
+                                return USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE;
+                        } else if(rcode) {
+                                enumStage = USB_ENUM_IDLE;
+                                return rcode;
+                        }
+                        enumStage = USB_ENUM_INIT;
+                        break;
+                case USB_ENUM_RESET:
+                        ResetDevicePort(enumParent, enumPort);
+                        enumStage = USB_ENUM_RESET_RECOVERY;
+                        // The root reset is watched in rHCTL, a hub port reset is given the longest it's allowed to take
+                        enumDeadline = (uint32_t)millis() + ((enumParent == 0) ? 0 : HUB_PORT_RESET_DELAY);
+                        return USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE;
+                case USB_ENUM_RESET_RECOVERY:
+                        if(enumParent == 0 && (regRd(rHCTL) & bmBUSRST))
+                                return USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE; // still resetting
+                        enumStage = USB_ENUM_INIT;
+                        enumDeadline = (uint32_t)millis() + enumTiming.resetRecovery;
+                        return USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE;
         }
-        if(rcode) {
-                // Issue a bus reset, because the device may be in a limbo state
-                if(parent == 0) {
-                        // Send a bus reset on the root interface.
-                        regWr(rHCTL, bmBUSRST); //issue bus reset
-                        delay(102); // delay 102ms, compensate for clock inaccuracy.
-                } else {
-                        // reset parent port
-                        devConfig[parent]->ResetHubPort(port);
-                }
+
+        rcode = devConfig[enumDriver]->Init(enumParent, enumPort, enumLowspeed);
+        if(rcode == USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE)
+                return rcode; // The driver is waiting on something itself, ask again next time
+        if(rcode == hrJERR && enumRetries < 3) { // Some devices returns this when plugged in - trying to initialize the device again usually works
+                enumRetries++;
+                enumStage = USB_ENUM_CONFIGURE;
+                enumDeadline = (uint32_t)millis() + USB_ENUM_RETRY_DELAY;
+                return USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE;
         }
+        enumStage = USB_ENUM_IDLE;
+        if(rcode) {
+                // Issue a bus reset, because the device may be in a limbo state. The next attempt waits for it to finish.
+                ResetDevicePort(enumParent, enumPort);
+                enumDeadline = (uint32_t)millis() + USB_ENUM_RESET_DELAY;
+        } else
+                configureTime[devConfig[enumDriver]->GetDriverClass()] = (uint32_t)millis() - enumStart;
         return rcode;
 }
 
@@ -667,6 +1000,9 @@ uint8_t USB::Configuring(uint8_t parent, uint8_t port, bool lowspeed) {
         EpInfo *oldep_ptr = NULL;
         EpInfo epInfo;
 
+        if(enumStage != USB_ENUM_IDLE)
+                return USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE; // Another device is still being configured, only one can be on address 0
+
         epInfo.epAddr = 0;
         epInfo.maxPktSize = 8;
         epInfo.bmSndToggle = 0;
@@ -710,6 +1046,24 @@ uint8_t USB::Configuring(uint8_t parent, uint8_t port, bool lowspeed) {
         uint16_t pid = udd->idProduct;
         uint8_t klass = udd->bDeviceClass;
         uint8_t subklass = udd->bDeviceSubClass;
+
+        LoadEnumTiming(vid, pid);
+        enumStart = (uint32_t)millis();
+
+        // Known device, go straight to a free instance of its driver. If it turns the device down
+        // carry on with the walk below.
+        uint8_t driverClass = FindDriverClass(vid, pid, klass);
+        if(driverClass != USB_DRIVER_NONE) {
+                for(devConfigIndex = 0; devConfigIndex < USB_NUMDEVICES; devConfigIndex++) {
+                        if(!devConfig[devConfigIndex]) continue; // no driver
+                        if(devConfig[devConfigIndex]->GetAddress()) continue; // consumed
+                        if(devConfig[devConfigIndex]->GetDriverClass() != driverClass) continue;
+                        rcode = AttemptConfig(devConfigIndex, parent, port, lowspeed);
+                        if(rcode != USB_DEV_CONFIG_ERROR_DEVICE_NOT_SUPPORTED)
+                                return rcode;
+                        break;
+                }
+        }
         // Attempt to configure if VID/PID or device class matches with a driver
         // Qualify with subclass too.
         //
@@ -807,7 +1161,7 @@ uint8_t USB::getStrDescr(uint8_t addr, uint8_t ep, uint16_t ns, uint8_t index, u
 uint8_t USB::setAddr(uint8_t oldaddr, uint8_t ep, uint8_t newaddr) {
         uint8_t rcode = ctrlReq(oldaddr, ep, bmREQ_SET, USB_REQUEST_SET_ADDRESS, newaddr, 0x00, 0x0000, 0x0000, 0x0000, NULL, NULL);
         //delay(2); //per USB 2.0 sect.9.2.6.3
-        delay(300); // Older spec says you should wait at least 200ms
+        // No delay here any more, the caller has to wait getEnumTiming().setAddrRecovery before using the new address
         return rcode;
         //return ( ctrlReq(oldaddr, ep, bmREQ_SET, USB_REQUEST_SET_ADDRESS, newaddr, 0x00, 0x0000, 0x0000, 0x0000, NULL, NULL));
 }
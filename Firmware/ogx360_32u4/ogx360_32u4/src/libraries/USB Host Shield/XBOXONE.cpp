@@ -24,13 +24,25 @@ Web      :  https://github.com/guruthree/
 //#define EXTRADEBUG // Uncomment to get even more debugging data
 //#define PRINTREPORT // Uncomment to print the report send by the Xbox ONE Controller
 
+//Commands that arrive less than this many us after the previous one can be dropped by the controller
+#define XBOXONE_CMD_SPACING 1000UL
+#define XBOXONE_ENABLE_INPUT_REPEATS 3 //onInit() sends enableInput() this many times
+
+//No delay() in here, commands wait in Poll() for their turn instead
+#pragma GCC poison delay
+
 XBOXONE::XBOXONE(USB *p) :
 pUsb(p), // pointer to USB class instance - mandatory
 bAddress(0), // device address - mandatory
+bInitState(0),
+qNextInitTime(0),
 bNumEP(1), // If config descriptor needs to be parsed
 qNextPollTime(0), // Reset NextPollTime
 pollInterval(0),
-bPollEnable(false) { // don't start polling before dongle is connected
+bPollEnable(false), // don't start polling before dongle is connected
+enableInputPending(0),
+rumblePending(false),
+cmdTimer(0) {
 	for(uint8_t i = 0; i < XBOX_ONE_MAX_ENDPOINTS; i++) {
 		epInfo[i].epAddr = 0;
 		epInfo[i].maxPktSize = (i) ? 0 : 8;
@@ -52,8 +64,20 @@ uint8_t XBOXONE::Init(uint8_t parent, uint8_t port, bool lowspeed) {
 	//uint16_t PID, VID;
 	uint8_t num_of_conf; // Number of configurations
 
+	// USB::Task keeps calling Init while it returns USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE.
+	// bInitState is how far we got, qNextInitTime when to carry on.
+	if((int32_t)((uint32_t)millis() - qNextInitTime) < 0L)
+	return USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE;
+
 	// get memory address of USB device address pool
 	AddressPool &addrPool = pUsb->GetAddressPool();
+
+	if(bInitState == 1)
+	goto SetEpInfo;
+	if(bInitState == 2)
+	goto SetConf;
+	if(bInitState == 3)
+	goto EnableInput;
 	#ifdef EXTRADEBUG
 	Notify(PSTR("\r\nXBOXONE Init"), 0x80);
 	#endif
@@ -129,10 +153,12 @@ uint8_t XBOXONE::Init(uint8_t parent, uint8_t port, bool lowspeed) {
 	Notify(PSTR("\r\nAddr: "), 0x80);
 	D_PrintHex<uint8_t > (bAddress, 0x80);
 	#endif
-	//delay(300); // Spec says you should wait at least 200ms
-
 	p->lowspeed = false;
+	bInitState = 1;
+	qNextInitTime = (uint32_t)millis() + pUsb->getEnumTiming().setAddrRecovery;
+	return USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE;
 
+	SetEpInfo:
 	//get pointer to assigned address record
 	p = addrPool.GetUsbDevicePtr(bAddress);
 	if(!p)
@@ -145,6 +171,11 @@ uint8_t XBOXONE::Init(uint8_t parent, uint8_t port, bool lowspeed) {
 	if(rcode)
 	goto FailSetDevTblEntry;
 
+	// The descriptor read before the address change is gone by now, read it again from the new address
+	rcode = pUsb->getDevDescr(bAddress, 0, sizeof (USB_DEVICE_DESCRIPTOR), (uint8_t*)buf);
+	if(rcode)
+	goto FailGetDevDescr;
+
 	num_of_conf = udd->bNumConfigurations; // Number of configurations
 
 	USBTRACE2("NC:", num_of_conf);
@@ -166,8 +197,11 @@ uint8_t XBOXONE::Init(uint8_t parent, uint8_t port, bool lowspeed) {
 	if(rcode)
 	goto FailSetDevTblEntry;
 
-	delay(200); // Give time for address change
+	bInitState = 2;
+	qNextInitTime = (uint32_t)millis() + pUsb->getEnumTiming().setConfDelay;
+	return USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE;
 
+	SetConf:
 	rcode = pUsb->setConf(bAddress, epInfo[ XBOX_ONE_CONTROL_PIPE ].epAddr, bConfNum);
 	if(rcode)
 	goto FailSetConfDescr;
@@ -176,10 +210,17 @@ uint8_t XBOXONE::Init(uint8_t parent, uint8_t port, bool lowspeed) {
 	Notify(PSTR("\r\nXbox One Controller Connected\r\n"), 0x80);
 	#endif
 
-	delay(200); // let things settle
+	bInitState = 3;
+	qNextInitTime = (uint32_t)millis() + 200; // let things settle
+	return USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE;
+
+	EnableInput:
+	bInitState = 0;
 
 	// Initialize the controller for input
 	cmdCounter = 0; // Reset the counter used when sending out the commands
+	enableInputPending = 0;
+	rumblePending = false;
 	uint8_t writeBuf[5];
 	writeBuf[0] = 0x05;
 	writeBuf[1] = 0x20;
@@ -192,6 +233,7 @@ uint8_t XBOXONE::Init(uint8_t parent, uint8_t port, bool lowspeed) {
 
 	onInit();
 	XboxOneConnected = true;
+	qNextPollTime = timebase_now;
 	bPollEnable = true;
 	return 0; // Successful configuration
 
@@ -279,10 +321,13 @@ uint8_t XBOXONE::Release() {
 	XboxOneConnected = false;
 	pUsb->GetAddressPool().FreeAddress(bAddress);
 	bAddress = 0; // Clear device address
+	bInitState = 0;
 	bNumEP = 1; // Must have to be reset to 1
 	qNextPollTime = 0; // Reset next poll time
 	pollInterval = 0;
 	bPollEnable = false;
+	enableInputPending = 0;
+	rumblePending = false;
 	pUsb->busprobe();
 	#ifdef DEBUG_USB_HOST
 	Notify(PSTR("\r\nXbox One Controller Disconnected\r\n"), 0x80);
@@ -295,13 +340,15 @@ uint8_t XBOXONE::Poll() {
 	if(!bPollEnable)
 	return 0;
 
-	if(millis()-enableInputTimer>100){
+	if(timebase_elapsed(enableInputTimer)>100){
 		enableInput();
-		enableInputTimer=millis();
+		enableInputTimer=timebase_now;
 	}
 
-	if((int32_t)((uint32_t)millis() - qNextPollTime) >= 0L) { // Do not poll if shorter than polling interval
-		qNextPollTime = (uint32_t)millis() + pollInterval; // Set new poll time
+	sendQueuedCommand();
+
+	if(deadline_passed(qNextPollTime)) { // Do not poll if shorter than polling interval
+		qNextPollTime = deadline_in(pollInterval); // Set new poll time
 		uint16_t length =  (uint16_t)epInfo[ XBOX_ONE_INPUT_PIPE ].maxPktSize; // Read the maximum packet size from the endpoint
 		uint8_t rcode = pUsb->inTransfer(bAddress, epInfo[ XBOX_ONE_INPUT_PIPE ].epAddr, &length, readBuf, pollInterval);
 		if(!rcode) {
@@ -334,6 +381,7 @@ void XBOXONE::readReport() {
 		ButtonState &= ~pgm_read_word(&XBOX_BUTTONS[XBOX]);
 
 		if(ButtonState != OldButtonState) {
+			inputStateChanged = true;
 			ButtonClickState = ButtonState & ~OldButtonState; // Update click state variable
 			OldButtonState = ButtonState;
 		}
@@ -350,18 +398,25 @@ void XBOXONE::readReport() {
 	// xbox button from before, dpad, abxy, start/back, sync, stick click, shoulder buttons
 	ButtonState = xbox | (((uint16_t)readBuf[5] & 0xF) << 8) | (readBuf[4] & 0xF0)  | (((uint16_t)readBuf[4] & 0x0C) << 10) | ((readBuf[4] & 0x01) << 3) | (((uint16_t)readBuf[5] & 0xC0) << 8) | ((readBuf[5] & 0x30) >> 4);
 
-	triggerValue[0] = (uint16_t)(((uint16_t)readBuf[7] << 8) | readBuf[6]);
-	triggerValue[1] = (uint16_t)(((uint16_t)readBuf[9] << 8) | readBuf[8]);
+	for(uint8_t i = 0; i < 2; i++) {
+		uint16_t value = (uint16_t)(((uint16_t)readBuf[7 + 2 * i] << 8) | readBuf[6 + 2 * i]);
+		if(value != triggerValue[i])
+		inputStateChanged = true;
+		triggerValue[i] = value;
+	}
 
-	hatValue[LeftHatX] = (int16_t)(((uint16_t)readBuf[11] << 8) | readBuf[10]);
-	hatValue[LeftHatY] = (int16_t)(((uint16_t)readBuf[13] << 8) | readBuf[12]);
-	hatValue[RightHatX] = (int16_t)(((uint16_t)readBuf[15] << 8) | readBuf[14]);
-	hatValue[RightHatY] = (int16_t)(((uint16_t)readBuf[17] << 8) | readBuf[16]);
+	for(uint8_t i = 0; i < 4; i++) { // LeftHatX, LeftHatY, RightHatX, RightHatY
+		int16_t value = (int16_t)(((uint16_t)readBuf[11 + 2 * i] << 8) | readBuf[10 + 2 * i]);
+		if(value != hatValue[i])
+		inputStateChanged = true;
+		hatValue[i] = value;
+	}
 
 	//Notify(PSTR("\r\nButtonState"), 0x80);
 	//PrintHex<uint16_t>(ButtonState, 0x80);
 
 	if(ButtonState != OldButtonState) {
+		inputStateChanged = true;
 		ButtonClickState = ButtonState & ~OldButtonState; // Update click state variable
 		OldButtonState = ButtonState;
 	}
@@ -407,78 +462,87 @@ int16_t XBOXONE::getAnalogHat(AnalogHatEnum a) {
 	return hatValue[a];
 }
 
+bool XBOXONE::inputChanged() {
+	bool state = inputStateChanged;
+	inputStateChanged = false;
+	return state;
+}
+
 /* Xbox Controller commands */
 uint8_t XBOXONE::XboxCommand(uint8_t* data, uint16_t nbytes) {
-	static uint32_t outputCommandTimer=0;
 	data[2] = cmdCounter++; // Increment the output command counter
-	while(millis()-outputCommandTimer<1);
 	uint8_t rcode = pUsb->outTransfer(bAddress, epInfo[ XBOX_ONE_OUTPUT_PIPE ].epAddr, nbytes, data);
-	outputCommandTimer=millis();
+	cmdTimer = timebase_ticks();
 	return rcode;
 }
 
+/* One OUT transfer at most, XBOXONE_CMD_SPACING after the previous one. Rumble goes first. */
+void XBOXONE::sendQueuedCommand() {
+	if((uint16_t)(timebase_ticks() - cmdTimer) < XBOXONE_CMD_SPACING * TIMEBASE_TICKS_PER_US)
+	return;
+
+	if(rumblePending) {
+		uint8_t writeBuf[13];
+		bool on = rumbleValue[0] || rumbleValue[1] || rumbleValue[2] || rumbleValue[3];
+
+		// Activate rumble
+		writeBuf[0] = 0x09;
+		writeBuf[1] = 0x00;
+		// Byte 2 is set in "XboxCommand"
+
+		// Continuous rumble effect
+		writeBuf[3] = 0x09; // Substructure (what substructure rest of this packet has)
+		writeBuf[4] = 0x00; // Mode
+		writeBuf[5] = 0x0F; // Rumble mask (what motors are activated) (0000 lT rT L R)
+		writeBuf[6] = rumbleValue[0]; // lT force
+		writeBuf[7] = rumbleValue[1]; // rT force
+		writeBuf[8] = rumbleValue[2]; // L force
+		writeBuf[9] = rumbleValue[3]; // R force
+		writeBuf[10] = on ? 0xFF : 0x00; // On period
+		writeBuf[11] = 0x00; // Off period
+		writeBuf[12] = on ? 0xFF : 0x00; // Repeat count
+		rumblePending = false;
+		XboxCommand(writeBuf, 13);
+		return;
+	}
+
+	if(enableInputPending) {
+		uint8_t writeBuf[5];
+		writeBuf[0] = 0x05;
+		writeBuf[1] = 0x20;
+		writeBuf[2] = 0x00;
+		writeBuf[3] = 0x01;
+		writeBuf[4] = 0x00;
+		enableInputPending--;
+		XboxCommand(writeBuf, 5);
+	}
+}
+
 // The Xbox One packets are described at: https://github.com/quantus/xbox-one-controller-protocol
 void XBOXONE::onInit() {
-	enableInput();
-	enableInput();
+	for(uint8_t i = 0; i < XBOXONE_ENABLE_INPUT_REPEATS; i++)
 	enableInput();
 
 	if(pFuncOnInit)
 	pFuncOnInit(); // Call the user function
 }
 
+//Rumble is latest-wins, all zeros is sent as the rumble off packet
 void XBOXONE::setRumbleOff() {
-	uint8_t writeBuf[13];
-
-	// Activate rumble
-	writeBuf[0] = 0x09;
-	writeBuf[1] = 0x00;
-	// Byte 2 is set in "XboxCommand"
-
-	// Continuous rumble effect
-	writeBuf[3] = 0x09; // Substructure (what substructure rest of this packet has)
-	writeBuf[4] = 0x00; // Mode
-	writeBuf[5] = 0x0F; // Rumble mask (what motors are activated) (0000 lT rT L R)
-	writeBuf[6] = 0x00; // lT force
-	writeBuf[7] = 0x00; // rT force
-	writeBuf[8] = 0x00; // L force
-	writeBuf[9] = 0x00; // R force
-	writeBuf[10] = 0x00; // On period
-	writeBuf[11] = 0x00; // Off period
-	writeBuf[12] = 0x00; // Repeat count
-	XboxCommand(writeBuf, 13);
+	setRumbleOn(0, 0, 0, 0);
 }
 
 void XBOXONE::setRumbleOn(uint8_t leftTrigger, uint8_t rightTrigger, uint8_t leftMotor, uint8_t rightMotor) {
-	uint8_t writeBuf[13];
-
-	// Activate rumble
-	writeBuf[0] = 0x09;
-	writeBuf[1] = 0x00;
-	// Byte 2 is set in "XboxCommand"
-
-	// Continuous rumble effect
-	writeBuf[3] = 0x09; // Substructure (what substructure rest of this packet has)
-	writeBuf[4] = 0x00; // Mode
-	writeBuf[5] = 0x0F; // Rumble mask (what motors are activated) (0000 lT rT L R)
-	writeBuf[6] = leftTrigger; // lT force
-	writeBuf[7] = rightTrigger; // rT force
-	writeBuf[8] = leftMotor; // L force
-	writeBuf[9] = rightMotor; // R force
-	writeBuf[10] = 0xFF; // On period
-	writeBuf[11] = 0x00; // Off period
-	writeBuf[12] = 0xFF; // Repeat count
-	XboxCommand(writeBuf, 13);
+	rumbleValue[0] = leftTrigger;
+	rumbleValue[1] = rightTrigger;
+	rumbleValue[2] = leftMotor;
+	rumbleValue[3] = rightMotor;
+	rumblePending = true;
 }
 
 void XBOXONE::enableInput(){
-	uint8_t writeBuf[5];
-	writeBuf[0] = 0x05;
-	writeBuf[1] = 0x20;
-	writeBuf[2] = 0x00;
-	writeBuf[3] = 0x01;
-	writeBuf[4] = 0x00;
-	XboxCommand(writeBuf, 5);
+	if(enableInputPending < XBOXONE_ENABLE_INPUT_REPEATS)
+	enableInputPending++;
 }
 
 
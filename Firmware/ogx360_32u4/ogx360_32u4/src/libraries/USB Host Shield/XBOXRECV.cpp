@@ -22,9 +22,50 @@ getBatteryLevel and checkStatus functions made by timstamp.co.uk found using Bus
 //#define EXTRADEBUG // Uncomment to get even more debugging data
 //#define PRINTREPORT // Uncomment to print the report send by the Xbox 360 Controller
 
+//All four controllers share this driver, a delay() anywhere stalls every player
+#pragma GCC poison delay
+
+//Controller onboarding, sent a step at a time from Poll() so the other controllers are still read in between.
+//Each step waits its delay (ms) after the previous one, then sends 00 00 b2 b3. The LED steps add the controller number to b3.
+//The Windows driver also reads back two reports before the final LED command, normal polling takes care of those now.
+#define XBOXRECV_INIT_DONE 0xFF
+static const uint8_t XBOXRECV_INIT_SCRIPT[][4] PROGMEM = {
+	//delay, b2, b3, add controller
+	{ 0, 0x08, 0x40 | 0x00, 0 }, //Set LED OFF
+	{ 8, 0x08, 0x40 | 0x02, 1 }, //Set LED quadrant blinking
+	{ 1, 0x02, 0x80, 0 }, //Not sure what this is, but windows driver does it
+	{ 1, 0x00, 0x40, 0 }, //Request battery level
+	{ 2, 0x08, 0x40 | 0x06, 1 }, //Set LED quadrant on (solid)
+};
+#define XBOXRECV_INIT_STEPS (sizeof(XBOXRECV_INIT_SCRIPT) / sizeof(XBOXRECV_INIT_SCRIPT[0]))
+
+//Order queued commands go out in. Rumble is always first, then LEDs, then status requests and chatpad commands.
+#define XBOXRECV_PRIORITY_OTHER 0
+#define XBOXRECV_PRIORITY_LED 1
+#define XBOXRECV_PRIORITY_RUMBLE 2
+
+//Housekeeping commands, sent to each connected controller in turn every XBOXRECV_HOUSEKEEPING_INTERVAL ms
+#define XBOXRECV_HOUSEKEEPING_INTERVAL 2500
+#define XBOXRECV_HK_PRESENCE 0
+#define XBOXRECV_HK_BATTERY 1
+#define XBOXRECV_HK_LED 2
+#define XBOXRECV_HK_LED_AGAIN 3
+#define XBOXRECV_HK_KEEPALIVE1 4
+#define XBOXRECV_HK_KEEPALIVE2 5
+#define XBOXRECV_HK_STEPS 6
+
+//The receiver drops commands that arrive less than this many us after the previous one
+#define XBOXRECV_CMD_SPACING 1000UL
+
+static uint8_t commandPriority(uint8_t b0, uint8_t b2) {
+	return (b0 == 0x00 && b2 == 0x08) ? XBOXRECV_PRIORITY_LED : XBOXRECV_PRIORITY_OTHER;
+}
+
 XBOXRECV::XBOXRECV(USB *p) :
 pUsb(p), // pointer to USB class instance - mandatory
 bAddress(0), // device address - mandatory
+bInitState(0),
+qNextInitTime(0),
 bPollEnable(false) { // don't start polling before dongle is connected
 	for(uint8_t i = 0; i < XBOX_MAX_ENDPOINTS; i++) {
 		epInfo[i].epAddr = 0;
@@ -33,6 +74,15 @@ bPollEnable(false) { // don't start polling before dongle is connected
 		epInfo[i].bmRcvToggle = 0;
 		epInfo[i].bmNakPower = (i) ? USB_NAK_NOWAIT : USB_NAK_MAX_POWER;
 	}
+	rumblePending = 0;
+	housekeepingStep = 0;
+	for(uint8_t i = 0; i < 4; i++) {
+		initStep[i] = XBOXRECV_INIT_DONE;
+		clearCommands(i);
+		nakStreak[i] = 0;
+	}
+	cmdNextController = 0;
+	cmdTimer = 0;
 
 	if(pUsb) // register in USB subsystem
 	pUsb->RegisterDeviceClass(this); //set devConfig[] entry
@@ -93,8 +143,6 @@ uint8_t XBOXRECV::ConfigureDevice(uint8_t parent, uint8_t port, bool lowspeed) {
 
 	epInfo[0].maxPktSize = udd->bMaxPacketSize0; // Extract Max Packet Size from device descriptor
 
-	delay(20); // Wait a little before resetting device
-
 	return USB_ERROR_CONFIG_REQUIRES_ADDITIONAL_RESET;
 
 	/* Diagnostic messages */
@@ -124,8 +172,14 @@ uint8_t XBOXRECV::ConfigureDevice(uint8_t parent, uint8_t port, bool lowspeed) {
 uint8_t XBOXRECV::Init(uint8_t parent __attribute__((unused)), uint8_t port __attribute__((unused)), bool lowspeed) {
 	uint8_t rcode;
 
+	// USB::Task keeps calling Init while it returns USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE.
+	// bInitState is how far we got, qNextInitTime when to carry on.
+	if((int32_t)((uint32_t)millis() - qNextInitTime) < 0L)
+	return USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE;
+
 	AddressPool &addrPool = pUsb->GetAddressPool();
 	#ifdef EXTRADEBUG
+	if(!bInitState)
 	Notify(PSTR("\r\nBTD Init"), 0x80);
 	#endif
 	UsbDevice *p = addrPool.GetUsbDevicePtr(bAddress); // Get pointer to assigned address record
@@ -137,30 +191,29 @@ uint8_t XBOXRECV::Init(uint8_t parent __attribute__((unused)), uint8_t port __at
 		return USB_ERROR_ADDRESS_NOT_FOUND_IN_POOL;
 	}
 
-	delay(300); // Assign new address to the device
-
-	rcode = pUsb->setAddr(0, 0, bAddress); // Assign new address to the device
-	if(rcode) {
-		#ifdef DEBUG_USB_HOST
-		Notify(PSTR("\r\nsetAddr: "), 0x80);
-		D_PrintHex<uint8_t > (rcode, 0x80);
+	switch(bInitState) {
+		case 0:
+		rcode = pUsb->setAddr(0, 0, bAddress); // Assign new address to the device
+		if(rcode) {
+			#ifdef DEBUG_USB_HOST
+			Notify(PSTR("\r\nsetAddr: "), 0x80);
+			D_PrintHex<uint8_t > (rcode, 0x80);
+			#endif
+			p->lowspeed = false;
+			goto Fail;
+		}
+		#ifdef EXTRADEBUG
+		Notify(PSTR("\r\nAddr: "), 0x80);
+		D_PrintHex<uint8_t > (bAddress, 0x80);
 		#endif
-		p->lowspeed = false;
-		goto Fail;
-	}
-	#ifdef EXTRADEBUG
-	Notify(PSTR("\r\nAddr: "), 0x80);
-	D_PrintHex<uint8_t > (bAddress, 0x80);
-	#endif
 
-	p->lowspeed = false;
+		p->lowspeed = false;
+		bInitState = 1;
+		qNextInitTime = (uint32_t)millis() + pUsb->getEnumTiming().setAddrRecovery;
+		return USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE;
 
-	p = addrPool.GetUsbDevicePtr(bAddress); // Get pointer to assigned address record
-	if(!p) {
-		#ifdef DEBUG_USB_HOST
-		Notify(PSTR("\r\nAddress not found"), 0x80);
-		#endif
-		return USB_ERROR_ADDRESS_NOT_FOUND_IN_POOL;
+		case 2:
+		goto SetConf;
 	}
 
 	p->lowspeed = lowspeed;
@@ -230,15 +283,20 @@ uint8_t XBOXRECV::Init(uint8_t parent __attribute__((unused)), uint8_t port __at
 	if(rcode)
 	goto FailSetDevTblEntry;
 
-	delay(200); //Give time for address change
+	bInitState = 2;
+	qNextInitTime = (uint32_t)millis() + pUsb->getEnumTiming().setConfDelay;
+	return USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE;
 
+	SetConf:
 	rcode = pUsb->setConf(bAddress, epInfo[ XBOX_CONTROL_PIPE ].epAddr, 1);
 	if(rcode)
 	goto FailSetConfDescr;
 
+	bInitState = 0;
 	XboxReceiverConnected = true;
 	bPollEnable = true;
-	checkStatusTimer = 0; // Reset timer
+	checkStatusTimer = timebase_now - XBOXRECV_HOUSEKEEPING_INTERVAL; // Reset timer
+	housekeepingStep = 0;
 	return 0; // Successful configuration
 
 	/* Diagnostic messages */
@@ -257,11 +315,16 @@ uint8_t XBOXRECV::Init(uint8_t parent __attribute__((unused)), uint8_t port __at
 /* Performs a cleanup after failed Init() attempt */
 uint8_t XBOXRECV::Release() {
 	XboxReceiverConnected = false;
-	for(uint8_t i = 0; i < 4; i++)
+	for(uint8_t i = 0; i < 4; i++) {
 		Xbox360Connected[i] = 0x00;
+		initStep[i] = XBOXRECV_INIT_DONE;
+		clearCommands(i);
+		nakStreak[i] = 0;
+	}
 
 	pUsb->GetAddressPool().FreeAddress(bAddress);
 	bAddress = 0;
+	bInitState = 0;
 	bPollEnable = false;
 	return 0;
 }
@@ -272,85 +335,64 @@ uint8_t XBOXRECV::Poll() {
 
 	//Chatpad LEDs are really finicky.
 	//I queue them up in a FIFO buffer then slowly process the queue.
-	if(millis()-chatPadLedTimer>250){
+	if(timebase_elapsed(chatPadLedTimer)>250){
 		for(uint8_t i=0; i<4; i++){
 			chatPadProcessLed(i);
 		}
-		chatPadLedTimer=millis();
+		chatPadLedTimer=timebase_now;
 
 	//Windows driver does this every 2.5 seconds. May aswell do the same
-	//Polls controller to check if present
-	//Requests the controllers battery status
-	//Set the LED to the correct quadrant
-	} else if(millis()-checkStatusTimer>2500){
-		static int8_t pollState=0;
-		for (uint8_t i=0;i<4;i++){
-			switch (pollState){
-				case 0:
-				checkControllerPresence(i);
-				break;
-
-				case 1:
-				if(Xbox360Connected[i]){
-					checkControllerBattery(i);
-					setLedRaw(0x06+i, i);
-				}
-				break;
-
-				case 2:
-				if(Xbox360Connected[i]){
-					setLedRaw(0x06+i, i);
-				}
-				break;
-
-				case 3:
-				chatPadKeepAlive1(i);
-				break;
-
-				case 4:
-				chatPadKeepAlive2(i);
-				break;
-
-				case 5:
-				checkStatusTimer=millis();
-				pollState=-1;
-				break;
-			}
-		}
-		pollState++;
-	 }
+	} else if(timebase_elapsed(checkStatusTimer)>XBOXRECV_HOUSEKEEPING_INTERVAL){
+		runHousekeeping();
+	}
 
-	uint8_t inputPipe;
-	uint16_t bufferSize;
-	for(uint8_t i = 0; i < 4; i++) {
+	runInitScript();
+
+	//One OUT transfer per poll at most, so a burst of commands doesn't hold up everyone's input
+	sendQueuedCommand();
 
+	for(uint8_t i = 0; i < 4; i++) {
 		//If there is a chatpad installed, we send init
-		//packets to it if required.
-		if(chatPadInitNeeded[i]){
+		//packets to it if required. Wait for the controller's own onboarding to finish first.
+		if(chatPadInitNeeded[i] && initStep[i] == XBOXRECV_INIT_DONE){
 			enableChatPad(i);
 			chatPadInitNeeded[i]=0;
 		}
+	}
 
-		if(i == 0)
-			inputPipe = XBOX_INPUT_PIPE_1;
-		else if(i == 1)
-			inputPipe = XBOX_INPUT_PIPE_2;
-		else if(i == 2)
-			inputPipe = XBOX_INPUT_PIPE_3;
-		else
-			inputPipe = XBOX_INPUT_PIPE_4;
-
-
-		bufferSize = EP_MAXPKTSIZE; // This is the maximum number of bytes we want to receive
-		pUsb->inTransfer(bAddress, epInfo[ inputPipe ].epAddr, &bufferSize, readBuf);
-		if(bufferSize > 0) { // The number of received bytes
-			readReport(i);
+	//Input pipes back to back, each report is handed to ParseIn() while the next IN is on the bus.
+	//Connected controllers are polled every time. An empty slot only has to notice a controller
+	//syncing, so once it has been quiet for a while it's only polled every XBOXRECV_IDLE_POLL_INTERVAL ms.
+	uint8_t inputEps[4];
+	uint8_t count = 0;
+	for(uint8_t i = 0; i < 4; i++) {
+		if(!Xbox360Connected[i] && nakStreak[i] >= XBOXRECV_IDLE_NAKS) {
+			if((uint8_t)((uint8_t)timebase_now - idlePollTimer[i]) < XBOXRECV_IDLE_POLL_INTERVAL)
+				continue;
+			idlePollTimer[i] = (uint8_t)timebase_now;
 		}
+		inputEps[count] = epInfo[ XBOX_INPUT_PIPE_1 + 2 * i ].epAddr;
+		pollSlot[count++] = i;
+	}
+
+	uint8_t naks = 0;
+	pUsb->pollInPipes(bAddress, inputEps, count, readBuf, EP_MAXPKTSIZE, this, &naks);
+	for(uint8_t n = 0; n < count; n++) {
+		uint8_t i = pollSlot[n];
+		if(!(naks & (1 << n)))
+			nakStreak[i] = 0;
+		else if(nakStreak[i] != 0xFF)
+			nakStreak[i]++;
 	}
 	return 0;
 
 }
 
+void XBOXRECV::ParseIn(uint8_t index, uint8_t len, uint8_t *pbuf __attribute__((unused))) {
+	if(len > 0) // The number of received bytes
+	readReport(pollSlot[index]);
+}
+
 void XBOXRECV::readReport(uint8_t controller) {
 	if(readBuf == NULL)
 	return;
@@ -368,6 +410,8 @@ void XBOXRECV::readReport(uint8_t controller) {
 			onInit(controller);
 		} else {
 			chatPadInitNeeded[controller]=0;
+			initStep[controller] = XBOXRECV_INIT_DONE;
+			clearCommands(controller);
 		}
 		return;
 	}
@@ -388,13 +432,16 @@ void XBOXRECV::readReport(uint8_t controller) {
 
 		ButtonState[controller] = (uint32_t)(readBuf[9] | ((uint16_t)readBuf[8] << 8) | ((uint32_t)readBuf[7] << 16) | ((uint32_t)readBuf[6] << 24));
 
-		hatValue[controller][LeftHatX] = (int16_t)(((uint16_t)readBuf[11] << 8) | readBuf[10]);
-		hatValue[controller][LeftHatY] = (int16_t)(((uint16_t)readBuf[13] << 8) | readBuf[12]);
-		hatValue[controller][RightHatX] = (int16_t)(((uint16_t)readBuf[15] << 8) | readBuf[14]);
-		hatValue[controller][RightHatY] = (int16_t)(((uint16_t)readBuf[17] << 8) | readBuf[16]);
+		for(uint8_t i = 0; i < 4; i++) { // LeftHatX, LeftHatY, RightHatX, RightHatY
+			int16_t value = (int16_t)(((uint16_t)readBuf[11 + 2 * i] << 8) | readBuf[10 + 2 * i]);
+			if(value != hatValue[controller][i])
+			inputStateChanged[controller] = true;
+			hatValue[controller][i] = value;
+		}
 
 		if(ButtonState[controller] != OldButtonState[controller]) {
 			buttonStateChanged[controller] = true;
+			inputStateChanged[controller] = true;
 			ButtonClickState[controller] = (ButtonState[controller] >> 16) & ((~OldButtonState[controller]) >> 16); // Update click state variable, but don't include the two trigger buttons L2 and R2
 			if(((uint8_t)OldButtonState[controller]) == 0 && ((uint8_t)ButtonState[controller]) != 0) {
 				R2Clicked[controller] = true;
@@ -412,15 +459,20 @@ void XBOXRECV::readReport(uint8_t controller) {
 
 		//This s a key press event
 		if(readBuf[24] == 0x00){
-			ChatPadState[controller]=0;
-			ChatPadState[controller]	|=((uint32_t)(readBuf[25])<<16) & 0xFF0000; //This contains modifiers like shift, green, orange and messenger buttons They are OR'd together in one byte
-			ChatPadState[controller]	|=((uint32_t)(readBuf[26])<<8)  & 0xFFFF00;  //This contains the first button being pressed.
-			ChatPadState[controller]	|=(uint32_t)(readBuf[27]);		//This contains the second button being pressed.
-
-			if(ChatPadState[controller] != OldChatPadState[controller]) {
-				ChatPadStateChanged[controller] = true;
-				ChatPadClickState[controller] = ChatPadState[controller] & ~OldChatPadState[controller];
-				OldChatPadState[controller] = ChatPadState[controller];
+			uint8_t keys[CHATPAD_KEY_BYTES];
+			memset(keys, 0x00, CHATPAD_KEY_BYTES);
+			keys[7] = readBuf[25] & 0x0F; //This contains modifiers like shift, green, orange and messenger buttons They are OR'd together in one byte
+			for(uint8_t n = 26; n <= 27; n++) { //The first and second button being pressed
+				uint8_t row = readBuf[n] >> 4;
+				if(row >= 1 && row <= 7)
+				keys[row - 1] |= 1 << (readBuf[n] & 7);
+			}
+
+			for(uint8_t n = 0; n < CHATPAD_KEY_BYTES; n++) {
+				if(keys[n] != chatPadKeys[controller][n])
+				inputStateChanged[controller] = true;
+				chatPadClicks[controller][n] |= keys[n] & ~chatPadKeys[controller][n];
+				chatPadKeys[controller][n] = keys[n];
 			}
 		//This is a handshake request
 		} else if (readBuf[24] == 0xF0 && readBuf[25] == 0x03){
@@ -462,39 +514,26 @@ bool XBOXRECV::getButtonClick(ButtonEnum b, uint8_t controller) {
 
 
 uint8_t XBOXRECV::getChatPadPress(ChatPadButton b, uint8_t controller) {
-	uint8_t button = b;
-	uint8_t ChatPadState1=(uint8_t)(ChatPadState[controller]>>16 & 0x0000FF);
-	uint8_t ChatPadState2=(uint8_t)(ChatPadState[controller]>>8 & 0x0000FF);
-	uint8_t ChatPadState3=(uint8_t)(ChatPadState[controller]>>0 & 0x0000FF);
-
-	if(button<17 && ChatPadState1&button){
-		return 1;
-	} else if (ChatPadState2==button || ChatPadState3==button){
-		return 1;
-	} else {
-		return 0;
-	}
+	uint8_t index = CHATPAD_KEY_INDEX(b);
+	return (chatPadKeys[controller][index >> 3] >> (index & 7)) & 1;
 }
 
 uint8_t XBOXRECV::getChatPadClick(ChatPadButton b, uint8_t controller) {
-	uint8_t button = b;
-	uint8_t ChatPadClickState1=(uint8_t)(ChatPadClickState[controller]>>16 & 0x0000FF);
-	uint8_t ChatPadClickState2=(uint8_t)(ChatPadClickState[controller]>>8 & 0x0000FF);
-	uint8_t ChatPadClickState3=(uint8_t)(ChatPadClickState[controller]>>0 & 0x0000FF);
-
-	if(button<17 && ChatPadClickState1&button){
-		ChatPadClickState[controller] &= ~(((uint32_t)button<<16)&0xFF0000);
-		return 1;
-	} else if (ChatPadClickState2==button){
-		ChatPadClickState[controller]&=0xFF00FF;
-		return 1;
-	} else if (ChatPadClickState3==button){
-		ChatPadClickState[controller]&=0xFFFF00;
-		return 1;
-	} else {
-		return 0;
-	}
+	uint8_t index = CHATPAD_KEY_INDEX(b);
+	uint8_t mask = 1 << (index & 7);
+	if(!(chatPadClicks[controller][index >> 3] & mask))
+	return 0;
+	chatPadClicks[controller][index >> 3] &= ~mask; // clear "click" event
+	return 1;
+}
+
+void XBOXRECV::getChatPadKeys(uint8_t* keys, uint8_t controller) {
+	memcpy(keys, chatPadKeys[controller], CHATPAD_KEY_BYTES);
+}
 
+void XBOXRECV::takeChatPadClicks(uint8_t* clicks, uint8_t controller) {
+	memcpy(clicks, chatPadClicks[controller], CHATPAD_KEY_BYTES);
+	memset(chatPadClicks[controller], 0x00, CHATPAD_KEY_BYTES);
 }
 
 int16_t XBOXRECV::getAnalogHat(AnalogHatEnum a, uint8_t controller) {
@@ -507,6 +546,12 @@ bool XBOXRECV::buttonChanged(uint8_t controller) {
 	return state;
 }
 
+bool XBOXRECV::inputChanged(uint8_t controller) {
+	bool state = inputStateChanged[controller];
+	inputStateChanged[controller] = false;
+	return state;
+}
+
 /*
 ControllerStatus Breakdown
 ControllerStatus[controller] & 0x0001   // 0
@@ -530,8 +575,7 @@ uint8_t XBOXRECV::getBatteryLevel(uint8_t controller) {
 	return ((controllerStatus[controller] & 0x00C0) >> 6);
 }
 
-void XBOXRECV::XboxCommand(uint8_t controller, uint8_t* data, uint16_t nbytes) {
-	static uint32_t outputCommandTimer=0;
+uint8_t XBOXRECV::XboxCommand(uint8_t controller, uint8_t* data, uint16_t nbytes) {
 	uint8_t outputPipe;
 	switch(controller) {
 		case 0: outputPipe = XBOX_OUTPUT_PIPE_1;
@@ -543,23 +587,110 @@ void XBOXRECV::XboxCommand(uint8_t controller, uint8_t* data, uint16_t nbytes) {
 		case 3: outputPipe = XBOX_OUTPUT_PIPE_4;
 		break;
 		default:
-		return;
+		return USB_ERROR_INVALID_ARGUMENT;
 	}
 
-	while(millis()-outputCommandTimer<1);
-	pUsb->outTransfer(bAddress, epInfo[ outputPipe ].epAddr, nbytes, data);
-	outputCommandTimer=millis();
+	uint8_t rcode = pUsb->outTransfer(bAddress, epInfo[ outputPipe ].epAddr, nbytes, data);
+	cmdTimer = timebase_ticks();
+	return rcode;
+}
+
+void XBOXRECV::queueCommand(uint8_t controller, uint8_t b0, uint8_t b2, uint8_t b3) {
+	if(controller > 3)
+	return;
+
+	XboxQueuedCommand *q = cmdQueue[controller];
+	uint8_t count = cmdCount[controller];
+	for(uint8_t j = 0; j < count; j++) {
+		if(q[j].b0 == b0 && q[j].b2 == b2 && q[j].b3 == b3)
+		return; // Already waiting to go out
+	}
 
+	if(count >= XBOXRECV_CMD_QUEUE_SIZE) {
+		//Full. Drop the newest command that matters less than this one, or this one if there isn't any
+		uint8_t priority = commandPriority(b0, b2);
+		int8_t j;
+		for(j = count - 1; j >= 0; j--) {
+			if(commandPriority(q[j].b0, q[j].b2) < priority)
+			break;
+		}
+		if(j < 0)
+		return;
+		for(; j < count - 1; j++)
+		q[j] = q[j + 1];
+		count--;
+	}
+
+	q[count].b0 = b0;
+	q[count].b2 = b2;
+	q[count].b3 = b3;
+	cmdCount[controller] = count + 1;
 }
 
-void XBOXRECV::disconnect(uint8_t controller) {
+bool XBOXRECV::sendQueuedCommand() {
+	if((uint16_t)(timebase_ticks() - cmdTimer) < XBOXRECV_CMD_SPACING * TIMEBASE_TICKS_PER_US)
+	return false;
+
+	//Most important command across all controllers, oldest first within a controller
+	int8_t best = -1;
+	uint8_t bestPriority = 0, bestIndex = 0;
+	for(uint8_t n = 0; n < 4; n++) {
+		uint8_t i = (cmdNextController + n) & 0x03;
+		if(rumblePending & (1 << i)) {
+			if(best < 0 || bestPriority < XBOXRECV_PRIORITY_RUMBLE) {
+				best = i;
+				bestPriority = XBOXRECV_PRIORITY_RUMBLE;
+			}
+			continue;
+		}
+		for(uint8_t j = 0; j < cmdCount[i]; j++) {
+			uint8_t priority = commandPriority(cmdQueue[i][j].b0, cmdQueue[i][j].b2);
+			if(best < 0 || priority > bestPriority) {
+				best = i;
+				bestPriority = priority;
+				bestIndex = j;
+			}
+		}
+	}
+	if(best < 0)
+	return false;
+
 	memset(writeBuf,0x00,12);
-	writeBuf[0] = 0x00;
-	writeBuf[1] = 0x00;
-	writeBuf[2] = 0x08;
-	writeBuf[3] = 0xC0;
+	if(bestPriority == XBOXRECV_PRIORITY_RUMBLE) {
+		writeBuf[1] = 0x01;
+		writeBuf[2] = 0x0f;
+		writeBuf[3] = 0xc0;
+		writeBuf[5] = rumbleValue[best][0]; // big weight
+		writeBuf[6] = rumbleValue[best][1]; // small weight
+		//Keep it pending if it didn't go out, a lost "rumble off" would leave the motors running
+		if(!XboxCommand(best, writeBuf, 12)) {
+			rumbleSent[best][0] = rumbleValue[best][0];
+			rumbleSent[best][1] = rumbleValue[best][1];
+			rumblePending &= ~(1 << best);
+		}
+	} else {
+		XboxQueuedCommand *q = cmdQueue[best];
+		writeBuf[0] = q[bestIndex].b0;
+		writeBuf[2] = q[bestIndex].b2;
+		writeBuf[3] = q[bestIndex].b3;
+		for(uint8_t j = bestIndex; j < cmdCount[best] - 1; j++)
+		q[j] = q[j + 1];
+		cmdCount[best]--;
+		XboxCommand(best, writeBuf, 12);
+	}
+	cmdNextController = (best + 1) & 0x03;
+	return true;
+}
 
-	XboxCommand(controller, writeBuf, 12);
+void XBOXRECV::clearCommands(uint8_t controller) {
+	cmdCount[controller] = 0;
+	rumblePending &= ~(1 << controller);
+	rumbleValue[controller][0] = rumbleValue[controller][1] = 0;
+	rumbleSent[controller][0] = rumbleSent[controller][1] = 0; // Controllers connect with the motors off
+}
+
+void XBOXRECV::disconnect(uint8_t controller) {
+	queueCommand(controller, 0x00, 0x08, 0xC0);
 }
 
 /*
@@ -581,114 +712,118 @@ void XBOXRECV::disconnect(uint8_t controller) {
  * 15: blink once, then previous setting
  */
 void XBOXRECV::setLedRaw(uint8_t value, uint8_t controller) {
-	memset(writeBuf,0x00,12);
-	writeBuf[0] = 0x00;
-	writeBuf[1] = 0x00;
-	writeBuf[2] = 0x08;
-	writeBuf[3] = value | 0x40;
-
-	XboxCommand(controller, writeBuf, 12);
+	queueCommand(controller, 0x00, 0x08, value | 0x40);
 }
 
 void XBOXRECV::checkControllerPresence(uint8_t controller) {
-	memset(writeBuf,0x00,12);
-	writeBuf[0] = 0x08;
-	writeBuf[1] = 0x00;
-	writeBuf[2] = 0x0F;
-	writeBuf[3] = 0xc0;
-	XboxCommand(controller, writeBuf, 12);
-
+	queueCommand(controller, 0x08, 0x0F, 0xc0);
 }
 
 void XBOXRECV::checkControllerBattery(uint8_t controller) {
-	memset(writeBuf,0x00,12);
-	writeBuf[0] = 0x00;
-	writeBuf[1] = 0x00;
-	writeBuf[2] = 0x00;
-	writeBuf[3] = 0x40;
-	XboxCommand(controller, writeBuf, 12);
+	queueCommand(controller, 0x00, 0x00, 0x40);
 }
 
 void XBOXRECV::enableChatPad(uint8_t controller) {
-	memset(writeBuf,0x00,12);
-	writeBuf[0] = 0x00;
-	writeBuf[1] = 0x00;
-	writeBuf[2] = 0x0C;
-	writeBuf[3] = 0x1B;
-	XboxCommand(controller, writeBuf, 12);
+	queueCommand(controller, 0x00, 0x0C, 0x1B);
 	chatpadEnabled=1;
 }
 
 
 void XBOXRECV::chatPadKeepAlive1(uint8_t controller) {
-	memset(writeBuf,0x00,12);
-	writeBuf[0] = 0x00;
-	writeBuf[1] = 0x00;
-	writeBuf[2] = 0x0C;
-	writeBuf[3] = 0x1F;
-	XboxCommand(controller, writeBuf, 12);
+	queueCommand(controller, 0x00, 0x0C, 0x1F);
 	chatpadEnabled=1;
 }
 
 void XBOXRECV::chatPadKeepAlive2(uint8_t controller) {
-	memset(writeBuf,0x00,12);
-	writeBuf[0] = 0x00;
-	writeBuf[1] = 0x00;
-	writeBuf[2] = 0x0C;
-	writeBuf[3] = 0x1E;
-	XboxCommand(controller, writeBuf, 12);
+	queueCommand(controller, 0x00, 0x0C, 0x1E);
 }
 
 
+//Latest value wins. Nothing is sent if the controller already has it.
 void XBOXRECV::setRumbleOn(uint8_t lValue, uint8_t rValue, uint8_t controller) {
-	memset(writeBuf,0x00,12);
-	writeBuf[0] = 0x00;
-	writeBuf[1] = 0x01;
-	writeBuf[2] = 0x0f;
-	writeBuf[3] = 0xc0;
-	writeBuf[4] = 0x00;
-	writeBuf[5] = lValue; // big weight
-	writeBuf[6] = rValue; // small weight
+	if(controller > 3)
+	return;
 
-	XboxCommand(controller, writeBuf, 12);
+	rumbleValue[controller][0] = lValue;
+	rumbleValue[controller][1] = rValue;
+	if(lValue == rumbleSent[controller][0] && rValue == rumbleSent[controller][1])
+	rumblePending &= ~(1 << controller);
+	else
+	rumblePending |= (1 << controller);
 }
 
 void XBOXRECV::onInit(uint8_t controller) {
-	memset(writeBuf,0x00,12);
-	setLedRaw(0x00, controller); //Set LED OFF
-	delay(8);
-	setLedRaw(0x02+controller, controller); //Set LED quadrant blinking
-
-	//Not sure what this is, but windows driver does it
-	writeBuf[0] = 0x00;
-	writeBuf[1] = 0x00;
-	writeBuf[2] = 0x02;
-	writeBuf[3] = 0x80;
-	XboxCommand(controller, writeBuf, 12);
-
-	//Request battery level
-	checkControllerBattery(controller);
-
-	uint8_t inputPipe;
-	uint16_t bufferSize;
-	if(controller == 0)
-		inputPipe = XBOX_INPUT_PIPE_1;
-	else if(controller == 1)
-		inputPipe = XBOX_INPUT_PIPE_2;
-	else if(controller == 2)
-		inputPipe = XBOX_INPUT_PIPE_3;
-	else
-		inputPipe = XBOX_INPUT_PIPE_4;
-
+	//Kick off the onboarding script, Poll() sends it
+	initStep[controller] = 0;
+	initTimer[controller] = (uint8_t)timebase_now;
+}
 
-	bufferSize = EP_MAXPKTSIZE; // This is the maximum number of bytes we want to receive
-	pUsb->inTransfer(bAddress, epInfo[ inputPipe ].epAddr, &bufferSize, readBuf);
-	pUsb->inTransfer(bAddress, epInfo[ inputPipe ].epAddr, &bufferSize, readBuf);
-	delay(2);
+void XBOXRECV::runInitScript() {
+	for(uint8_t i = 0; i < 4; i++) {
+		//Wait for the previous step to actually go out, the delays are between transfers
+		if(initStep[i] >= XBOXRECV_INIT_STEPS || cmdCount[i])
+			continue;
+
+		const uint8_t *step = XBOXRECV_INIT_SCRIPT[initStep[i]];
+		if((uint8_t)((uint8_t)timebase_now - initTimer[i]) < pgm_read_byte(&step[0]))
+			continue;
+
+		uint8_t b3 = pgm_read_byte(&step[2]);
+		if(pgm_read_byte(&step[3]))
+			b3 += i;
+		queueCommand(i, 0x00, pgm_read_byte(&step[1]), b3);
+
+		initTimer[i] = (uint8_t)timebase_now;
+		if(++initStep[i] >= XBOXRECV_INIT_STEPS)
+			initStep[i] = XBOXRECV_INIT_DONE;
+	}
+}
 
-	setLedRaw(0x06+controller, controller); //Set LED quadrant on (solid);
+//Polls the controller to check it's present, requests its battery status, sets the LED to the correct quadrant
+//and keeps the chatpad awake. This used to go out as a burst of up to 8 commands at once, now it's one
+//command at a time, only when nothing else is waiting to be sent. Slots without a controller are skipped.
+void XBOXRECV::runHousekeeping() {
+	if(rumblePending)
+	return;
+	for(uint8_t i = 0; i < 4; i++) {
+		if(cmdCount[i])
+		return;
+	}
 
+	while(housekeepingStep < XBOXRECV_HK_STEPS * 4) {
+		uint8_t i = housekeepingStep & 0x03;
+		uint8_t step = housekeepingStep >> 2;
+		housekeepingStep++;
+		if(!Xbox360Connected[i])
+		continue;
+
+		switch(step) {
+			case XBOXRECV_HK_PRESENCE:
+			checkControllerPresence(i);
+			break;
+
+			case XBOXRECV_HK_BATTERY:
+			checkControllerBattery(i);
+			break;
+
+			case XBOXRECV_HK_LED:
+			case XBOXRECV_HK_LED_AGAIN:
+			setLedRaw(0x06+i, i);
+			break;
+
+			case XBOXRECV_HK_KEEPALIVE1:
+			chatPadKeepAlive1(i);
+			break;
+
+			case XBOXRECV_HK_KEEPALIVE2:
+			chatPadKeepAlive2(i);
+			break;
+		}
+		return;
+	}
 
+	housekeepingStep = 0;
+	checkStatusTimer = timebase_now;
 }
 
 void XBOXRECV::chatPadQueueLed(uint8_t led, uint8_t controller){
@@ -702,12 +837,7 @@ void XBOXRECV::chatPadQueueLed(uint8_t led, uint8_t controller){
 
 void XBOXRECV::chatPadProcessLed(uint8_t controller) {
 	if(chatPadLedQueue[controller][0]!=0xFF){
-			memset(writeBuf,0x00,12);
-			writeBuf[0] = 0x00;
-			writeBuf[1] = 0x00;
-			writeBuf[2] = 0x0C;
-			writeBuf[3] = chatPadLedQueue[controller][0];
-			XboxCommand(controller, writeBuf, 12);
+			queueCommand(controller, 0x00, 0x0C, chatPadLedQueue[controller][0]);
 			chatPadLedQueue[controller][0]=chatPadLedQueue[controller][1];
 			chatPadLedQueue[controller][1]=chatPadLedQueue[controller][2];
 			chatPadLedQueue[controller][2]=chatPadLedQueue[controller][3];
@@ -20,10 +20,21 @@
 //#define EXTRADEBUG // Uncomment to get even more debugging data
 //#define PRINTREPORT // Uncomment to print the report send by the Xbox 360 Controller
 
+//Commands that arrive less than this many us after the previous one can be dropped by the controller
+#define XBOXUSB_CMD_SPACING 1000UL
+
+//Init() and Poll() are called from the main loop's frame. Waits are Init() states or sendQueuedCommand() spacing, never delay().
+#pragma GCC poison delay
+
 XBOXUSB::XBOXUSB(USB *p) :
 pUsb(p), // pointer to USB class instance - mandatory
 bAddress(0), // device address - mandatory
-bPollEnable(false) { // don't start polling before dongle is connected
+bInitState(0),
+qNextInitTime(0),
+bPollEnable(false), // don't start polling before dongle is connected
+cmdCount(0),
+rumblePending(false),
+cmdTimer(0) {
         for(uint8_t i = 0; i < 3; i++) {
                 epInfo[i].epAddr = 0;
                 epInfo[i].maxPktSize = (i) ? 0 : 8;
@@ -45,8 +56,20 @@ uint8_t XBOXUSB::Init(uint8_t parent, uint8_t port, bool lowspeed) {
         uint16_t PID;
         uint16_t VID;
 
+        // USB::Task keeps calling Init while it returns USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE.
+        // bInitState is how far we got, qNextInitTime when to carry on.
+        if((int32_t)((uint32_t)millis() - qNextInitTime) < 0L)
+                return USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE;
+
         // get memory address of USB device address pool
         AddressPool &addrPool = pUsb->GetAddressPool();
+
+        if(bInitState == 1)
+                goto SetEpInfo;
+        if(bInitState == 2)
+                goto SetConf;
+        if(bInitState == 3)
+                goto StringDescriptor;
 #ifdef EXTRADEBUG
         Notify(PSTR("\r\nXBOXUSB Init"), 0x80);
 #endif
@@ -135,10 +158,12 @@ uint8_t XBOXUSB::Init(uint8_t parent, uint8_t port, bool lowspeed) {
         Notify(PSTR("\r\nAddr: "), 0x80);
         D_PrintHex<uint8_t > (bAddress, 0x80);
 #endif
-        //delay(300); // Spec says you should wait at least 200ms
-
         p->lowspeed = false;
+        bInitState = 1;
+        qNextInitTime = (uint32_t)millis() + pUsb->getEnumTiming().setAddrRecovery;
+        return USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE;
 
+SetEpInfo:
         //get pointer to assigned address record
         p = addrPool.GetUsbDevicePtr(bAddress);
         if(!p)
@@ -173,12 +198,30 @@ uint8_t XBOXUSB::Init(uint8_t parent, uint8_t port, bool lowspeed) {
         if(rcode)
                 goto FailSetDevTblEntry;
 
-        delay(200); // Give time for address change
+        bInitState = 2;
+        qNextInitTime = (uint32_t)millis() + pUsb->getEnumTiming().setConfDelay;
+        return USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE;
 
+SetConf:
         rcode = pUsb->setConf(bAddress, epInfo[ XBOX_CONTROL_PIPE ].epAddr, 1);
         if(rcode)
                 goto FailSetConfDescr;
 
+        //8bit-do appears as a Wired Xbox 360 controller, but will quickly change to a switch controller if you do not request a string descriptor
+        pUsb->ctrlReq(bAddress, epInfo[XBOX_CONTROL_PIPE].epAddr, 0x80, 0x06, 0x02, 0x03, 0x0409, 0x0002, 2, NULL, NULL); //Request string descriptor
+        bInitState = 3;
+        qNextInitTime = (uint32_t)millis() + 2; // At least 1ms between the two requests
+        return USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE;
+
+StringDescriptor:
+        {
+                uint8_t stringDescriptor[10];
+                pUsb->ctrlReq(bAddress, epInfo[XBOX_CONTROL_PIPE].epAddr, 0x80, 0x06, 0x02, 0x03, 0x0409, 0x0022, 10, stringDescriptor, NULL); //Request string descriptor
+                cmdTimer = timebase_ticks(); // The onboarding commands wait 1ms after this too
+        }
+
+        bInitState = 0;
+
 #ifdef DEBUG_USB_HOST
         Notify(PSTR("\r\nXbox 360 Controller Connected\r\n"), 0x80);
 #endif
@@ -224,8 +267,11 @@ Fail:
 /* Performs a cleanup after failed Init() attempt */
 uint8_t XBOXUSB::Release() {
         Xbox360Connected = false;
+        cmdCount = 0;
+        rumblePending = false;
         pUsb->GetAddressPool().FreeAddress(bAddress);
         bAddress = 0;
+        bInitState = 0;
         bPollEnable = false;
         return 0;
 }
@@ -233,6 +279,7 @@ uint8_t XBOXUSB::Release() {
 uint8_t XBOXUSB::Poll() {
         if(!bPollEnable)
                 return 0;
+        sendQueuedCommand();
         uint16_t BUFFER_SIZE = EP_MAXPKTSIZE;
         pUsb->inTransfer(bAddress, epInfo[ XBOX_INPUT_PIPE ].epAddr, &BUFFER_SIZE, readBuf); // input on endpoint 1
         readReport();
@@ -251,15 +298,18 @@ void XBOXUSB::readReport() {
 
         ButtonState = (uint32_t)(readBuf[5] | ((uint16_t)readBuf[4] << 8) | ((uint32_t)readBuf[3] << 16) | ((uint32_t)readBuf[2] << 24));
 
-        hatValue[LeftHatX] = (int16_t)(((uint16_t)readBuf[7] << 8) | readBuf[6]);
-        hatValue[LeftHatY] = (int16_t)(((uint16_t)readBuf[9] << 8) | readBuf[8]);
-        hatValue[RightHatX] = (int16_t)(((uint16_t)readBuf[11] << 8) | readBuf[10]);
-        hatValue[RightHatY] = (int16_t)(((uint16_t)readBuf[13] << 8) | readBuf[12]);
+        for(uint8_t i = 0; i < 4; i++) { // LeftHatX, LeftHatY, RightHatX, RightHatY
+                int16_t value = (int16_t)(((uint16_t)readBuf[7 + 2 * i] << 8) | readBuf[6 + 2 * i]);
+                if(value != hatValue[i])
+                        inputStateChanged = true;
+                hatValue[i] = value;
+        }
 
         //Notify(PSTR("\r\nButtonState"), 0x80);
         //PrintHex<uint32_t>(ButtonState, 0x80);
 
         if(ButtonState != OldButtonState) {
+                inputStateChanged = true;
                 ButtonClickState = (ButtonState >> 16) & ((~OldButtonState) >> 16); // Update click state variable, but don't include the two trigger buttons L2 and R2
                 if(((uint8_t)OldButtonState) == 0 && ((uint8_t)ButtonState) != 0) // The L2 and R2 buttons are special as they are analog buttons
                         R2Clicked = true;
@@ -313,21 +363,70 @@ int16_t XBOXUSB::getAnalogHat(AnalogHatEnum a) {
         return hatValue[a];
 }
 
+bool XBOXUSB::inputChanged() {
+        bool state = inputStateChanged;
+        inputStateChanged = false;
+        return state;
+}
+
 /* Xbox Controller commands */
 void XBOXUSB::XboxCommand(uint8_t* data, uint16_t nbytes) {
         //pUsb->ctrlReq(bAddress, epInfo[XBOX_CONTROL_PIPE].epAddr, bmREQ_HID_OUT, HID_REQUEST_SET_REPORT, 0x00, 0x02, 0x00, nbytes, nbytes, data, NULL);
         pUsb->outTransfer(bAddress,epInfo[XBOX_OUTPUT_PIPE].epAddr,nbytes,data);
-				delay(1);
+        cmdTimer = timebase_ticks();
 }
 
-void XBOXUSB::setLedRaw(uint8_t value) {
-        writeBuf[0] = 0x01;
-        writeBuf[1] = 0x03;
-        writeBuf[2] = value;
+void XBOXUSB::queueCommand(uint8_t b0, uint8_t b1, uint8_t b2) {
+        for(uint8_t i = 0; i < cmdCount; i++) {
+                if(cmdQueue[i][0] == b0 && cmdQueue[i][1] == b1 && cmdQueue[i][2] == b2)
+                        return; // Already waiting to go out
+        }
+        if(cmdCount >= XBOXUSB_CMD_QUEUE_SIZE)
+                return; // Full, drop it
 
+        cmdQueue[cmdCount][0] = b0;
+        cmdQueue[cmdCount][1] = b1;
+        cmdQueue[cmdCount][2] = b2;
+        cmdCount++;
+}
+
+/* One OUT transfer at most, XBOXUSB_CMD_SPACING after the previous one. Rumble goes first. */
+void XBOXUSB::sendQueuedCommand() {
+        if((uint16_t)(timebase_ticks() - cmdTimer) < XBOXUSB_CMD_SPACING * TIMEBASE_TICKS_PER_US)
+                return;
+
+        if(rumblePending) {
+                writeBuf[0] = 0x00;
+                writeBuf[1] = 0x08;
+                writeBuf[2] = 0x00;
+                writeBuf[3] = rumbleValue[0]; // big weight
+                writeBuf[4] = rumbleValue[1]; // small weight
+                writeBuf[5] = 0x00;
+                writeBuf[6] = 0x00;
+                writeBuf[7] = 0x00;
+                rumblePending = false;
+                XboxCommand(writeBuf, 8);
+                return;
+        }
+
+        if(!cmdCount)
+                return;
+        writeBuf[0] = cmdQueue[0][0];
+        writeBuf[1] = cmdQueue[0][1];
+        writeBuf[2] = cmdQueue[0][2];
+        cmdCount--;
+        for(uint8_t i = 0; i < cmdCount; i++) {
+                cmdQueue[i][0] = cmdQueue[i + 1][0];
+                cmdQueue[i][1] = cmdQueue[i + 1][1];
+                cmdQueue[i][2] = cmdQueue[i + 1][2];
+        }
         XboxCommand(writeBuf, 3);
 }
 
+void XBOXUSB::setLedRaw(uint8_t value) {
+        queueCommand(0x01, 0x03, value);
+}
+
 void XBOXUSB::setLedOn(LEDEnum led) {
         if(led == OFF)
                 setLedRaw(0);
@@ -344,33 +443,17 @@ void XBOXUSB::setLedMode(LEDModeEnum ledMode) { // This function is used to do s
 }
 
 void XBOXUSB::setRumbleOn(uint8_t lValue, uint8_t rValue) {
-        writeBuf[0] = 0x00;
-        writeBuf[1] = 0x08;
-        writeBuf[2] = 0x00;
-        writeBuf[3] = lValue; // big weight
-        writeBuf[4] = rValue; // small weight
-        writeBuf[5] = 0x00;
-        writeBuf[6] = 0x00;
-        writeBuf[7] = 0x00;
-
-        XboxCommand(writeBuf, 8);
+        rumbleValue[0] = lValue;
+        rumbleValue[1] = rValue;
+        rumblePending = true;
 }
 
 void XBOXUSB::onInit() {
-	uint8_t stringDescriptor[10];
-	//8bit-do appears as a Wired Xbox 360 controller, but will quickly change to a switch controller if you do not request a string descriptor
-	pUsb->ctrlReq(bAddress, epInfo[XBOX_CONTROL_PIPE].epAddr, 0x80, 0x06, 0x02, 0x03, 0x0409, 0x0002, 2, NULL, NULL); //Request string descriptor
-	delay(1);
-	pUsb->ctrlReq(bAddress, epInfo[XBOX_CONTROL_PIPE].epAddr, 0x80, 0x06, 0x02, 0x03, 0x0409, 0x0022, 10, stringDescriptor, NULL); //Request string descriptor
-	delay(1);
-	uint8_t outBuf0[3] = { 0x01, 0x03, 0x02 };
-	uint8_t outBuf1[3] = { 0x01, 0x03, 0x06 };
-	uint8_t outBuf2[3] = { 0x02, 0x08, 0x03 }; //Not sure what this. Seen in windows driver
-	uint8_t outBuf3[3] = { 0x00, 0x03, 0x00 }; //Turn off rumble?
-	XboxCommand(outBuf0,3);
-	XboxCommand(outBuf1,3);
-	XboxCommand(outBuf2,3);
-	XboxCommand(outBuf3,3);
+	//Poll() sends these 1ms apart
+	queueCommand(0x01, 0x03, 0x02);
+	queueCommand(0x01, 0x03, 0x06);
+	queueCommand(0x02, 0x08, 0x03); //Not sure what this. Seen in windows driver
+	queueCommand(0x00, 0x03, 0x00); //Turn off rumble?
 
 	if(pFuncOnInit)
 	pFuncOnInit(); // Call the user function
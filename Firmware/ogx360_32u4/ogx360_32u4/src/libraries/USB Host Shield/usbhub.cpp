@@ -16,14 +16,21 @@ e-mail   :  support@circuitsathome.com
  */
 #include "usbhub.h"
 
+//Hub polling runs from USB::Task() every frame
+#pragma GCC poison delay
+
 bool USBHub::bResetInitiated = false;
 
 USBHub::USBHub(USB *p) :
 pUsb(p),
 bAddress(0),
 bNbrPorts(0),
-//bInitState(0),
+bInitState(0),
+qNextInitTime(0),
+bPendingPort(0),
+bDriverResetPort(0),
 qNextPollTime(0),
+bPollInterval(HUB_POLL_INTERVAL),
 bPollEnable(false) {
         epInfo[0].epAddr = 0;
         epInfo[0].maxPktSize = 8;
@@ -55,8 +62,17 @@ uint8_t USBHub::Init(uint8_t parent, uint8_t port, bool lowspeed) {
         //USBTRACE("\r\nHub Init Start ");
         //D_PrintHex<uint8_t > (bInitState, 0x80);
 
+        // USB::Task keeps calling Init while it returns USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE
+        if((int32_t)((uint32_t)millis() - qNextInitTime) < 0L)
+                return USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE;
+
         AddressPool &addrPool = pUsb->GetAddressPool();
 
+        if(bInitState == 1) {
+                len = sizeof (USB_DEVICE_DESCRIPTOR);
+                goto AddressSet;
+        }
+
         //switch (bInitState) {
         //        case 0:
         if(bAddress)
@@ -123,6 +139,14 @@ uint8_t USBHub::Init(uint8_t parent, uint8_t port, bool lowspeed) {
         // Restore p->epinfo
         p->epinfo = oldep_ptr;
 
+        // Give the hub time to take the new address
+        bInitState = 1;
+        qNextInitTime = (uint32_t)millis() + pUsb->getEnumTiming().setAddrRecovery;
+        return USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE;
+
+AddressSet:
+        bInitState = 0;
+
         if(len)
                 rcode = pUsb->getDevDescr(bAddress, 0, len, (uint8_t*)buf);
 
@@ -160,6 +184,16 @@ uint8_t USBHub::Init(uint8_t parent, uint8_t port, bool lowspeed) {
         if(rcode)
                 goto FailGetConfDescr;
 
+        // Poll the status change endpoint as often as it asks for, but never less often than we used to
+        bPollInterval = HUB_POLL_INTERVAL;
+        for(uint8_t i = 0; i + 6 < cd_len && i + 6 < sizeof (buf) && buf[i]; i += buf[i]) {
+                if(buf[i + 1] == USB_DESCRIPTOR_ENDPOINT && (buf[i + 2] & 0x80)) {
+                        if(buf[i + 6] && buf[i + 6] < HUB_POLL_INTERVAL)
+                                bPollInterval = buf[i + 6];
+                        break;
+                }
+        }
+
         // The following code is of no practical use in real life applications.
         // It only intended for the usb protocol sniffer to properly parse hub-class requests.
         {
@@ -185,6 +219,7 @@ uint8_t USBHub::Init(uint8_t parent, uint8_t port, bool lowspeed) {
                 SetPortFeature(HUB_FEATURE_PORT_POWER, j, 0); //HubPortPowerOn(j);
 
         pUsb->SetHubPreMask();
+        qNextPollTime = timebase_now;
         bPollEnable = true;
         //                bInitState = 0;
         //}
@@ -221,6 +256,10 @@ uint8_t USBHub::Release() {
 
         bAddress = 0;
         bNbrPorts = 0;
+        bPollInterval = HUB_POLL_INTERVAL;
+        bInitState = 0;
+        bPendingPort = 0;
+        bDriverResetPort = 0;
         qNextPollTime = 0;
         bPollEnable = false;
         return 0;
@@ -232,9 +271,18 @@ uint8_t USBHub::Poll() {
         if(!bPollEnable)
                 return 0;
 
-        if(((int32_t)((uint32_t)millis() - qNextPollTime) >= 0L)) {
+        // Configure a port that finished resetting once it has had time to recover, and nothing else is on address 0
+        if(bPendingPort && deadline_passed(qPendingTime) && !pUsb->isConfiguring()) {
+                UsbDeviceAddress a;
+                a.devAddress = bAddress;
+                pUsb->Configuring(a.bmAddress, bPendingPort, bPendingLowspeed);
+                bPendingPort = 0;
+                bResetInitiated = false;
+        }
+
+        if(deadline_passed(qNextPollTime)) {
                 rcode = CheckHubStatus();
-                qNextPollTime = (uint32_t)millis() + 100;
+                qNextPollTime = deadline_in(bPollInterval);
         }
         return rcode;
 }
@@ -260,7 +308,11 @@ uint8_t USBHub::CheckHubStatus() {
         //                return rcode;
         //        }
         //}
-        for(uint8_t port = 1, mask = 0x02; port < 8; mask <<= 1, port++) {
+        // Only the ports flagged in the change bitmap are asked for their status. Nothing flagged means the
+        // endpoint NAKed and we never get here. So a change costs one GetPortStatus per flagged port, where the
+        // scan of every port that used to follow added bNbrPorts more. Counted from the code, XIDTelemetry.controlRate
+        // is where a measurement would show it.
+        for(uint8_t port = 1, mask = 0x02; port < 8 && port <= bNbrPorts; mask <<= 1, port++) {
                 if(buf[0] & mask) {
                         HubEvent evt;
                         evt.bmEvent = 0;
@@ -280,53 +332,16 @@ uint8_t USBHub::CheckHubStatus() {
                 }
         } // for
 
-        for(uint8_t port = 1; port <= bNbrPorts; port++) {
-                HubEvent evt;
-                evt.bmEvent = 0;
-
-                rcode = GetPortStatus(port, 4, evt.evtBuff);
-
-                if(rcode)
-                        continue;
-
-                if((evt.bmStatus & bmHUB_PORT_STATE_CHECK_DISABLED) != bmHUB_PORT_STATE_DISABLED)
-                        continue;
-
-                // Emulate connection event for the port
-                evt.bmChange |= bmHUB_PORT_STATUS_C_PORT_CONNECTION;
-
-                rcode = PortStatusChange(port, evt);
-
-                if(rcode == HUB_ERROR_PORT_HAS_BEEN_RESET)
-                        return 0;
-
-                if(rcode)
-                        return rcode;
-        } // for
         return 0;
 }
 
+// Reset asked for by a driver part way through configuring a device. USB waits for the reset to finish
+// itself, the reset complete event is only acknowledged in PortStatusChange().
 void USBHub::ResetHubPort(uint8_t port) {
-        HubEvent evt;
-        evt.bmEvent = 0;
-        uint8_t rcode;
-
         ClearPortFeature(HUB_FEATURE_C_PORT_ENABLE, port, 0);
         ClearPortFeature(HUB_FEATURE_C_PORT_CONNECTION, port, 0);
         SetPortFeature(HUB_FEATURE_PORT_RESET, port, 0);
-
-
-        for(int i = 0; i < 3; i++) {
-                rcode = GetPortStatus(port, 4, evt.evtBuff);
-                if(rcode) break; // Some kind of error, bail.
-                if(evt.bmEvent == bmHUB_PORT_EVENT_RESET_COMPLETE || evt.bmEvent == bmHUB_PORT_EVENT_LS_RESET_COMPLETE) {
-                        break;
-                }
-                delay(100); // simulate polling.
-        }
-        ClearPortFeature(HUB_FEATURE_C_PORT_RESET, port, 0);
-        ClearPortFeature(HUB_FEATURE_C_PORT_CONNECTION, port, 0);
-        delay(20);
+        bDriverResetPort = port;
 }
 
 uint8_t USBHub::PortStatusChange(uint8_t port, HubEvent &evt) {
@@ -334,8 +349,8 @@ uint8_t USBHub::PortStatusChange(uint8_t port, HubEvent &evt) {
                         // Device connected event
                 case bmHUB_PORT_EVENT_CONNECT:
                 case bmHUB_PORT_EVENT_LS_CONNECT:
-                        if(bResetInitiated)
-                                return 0;
+                        if(bResetInitiated || pUsb->isConfiguring())
+                                return 0; // Leave the change bit set, it's picked up again once the other device is done
 
                         ClearPortFeature(HUB_FEATURE_C_PORT_ENABLE, port, 0);
                         ClearPortFeature(HUB_FEATURE_C_PORT_CONNECTION, port, 0);
@@ -348,6 +363,8 @@ uint8_t USBHub::PortStatusChange(uint8_t port, HubEvent &evt) {
                         ClearPortFeature(HUB_FEATURE_C_PORT_ENABLE, port, 0);
                         ClearPortFeature(HUB_FEATURE_C_PORT_CONNECTION, port, 0);
                         bResetInitiated = false;
+                        if(port == bPendingPort)
+                                bPendingPort = 0;
 
                         UsbDeviceAddress a;
                         a.devAddress = 0;
@@ -363,12 +380,15 @@ uint8_t USBHub::PortStatusChange(uint8_t port, HubEvent &evt) {
                         ClearPortFeature(HUB_FEATURE_C_PORT_RESET, port, 0);
                         ClearPortFeature(HUB_FEATURE_C_PORT_CONNECTION, port, 0);
 
-                        delay(20);
+                        if(port == bDriverResetPort) {
+                                bDriverResetPort = 0; // Device is already being configured
+                                break;
+                        }
 
-                        a.devAddress = bAddress;
-
-                        pUsb->Configuring(a.bmAddress, port, (evt.bmStatus & bmHUB_PORT_STATUS_PORT_LOW_SPEED));
-                        bResetInitiated = false;
+                        // Poll() starts configuring it after the reset recovery time
+                        bPendingPort = port;
+                        bPendingLowspeed = (evt.bmStatus & bmHUB_PORT_STATUS_PORT_LOW_SPEED);
+                        qPendingTime = deadline_in(USB_RESET_RECOVERY);
                         break;
 
         } // switch (evt.bmEvent)
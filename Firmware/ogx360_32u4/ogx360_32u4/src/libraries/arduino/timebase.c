@@ -0,0 +1,142 @@
+/*
+ timebase.c - Timer3 timebase, deadlines and timer wheel for the ogx360
+
+ Timer3 counts free at F_CPU/8. The compare A interrupt moves OCR3A on by 1ms of ticks each time
+ it fires and counts the milliseconds. init() in wiring.c sets Timer3 up for PWM, nothing uses
+ that so timebase_init() takes it over.
+*/
+
+#include <stddef.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include "timebase.h"
+
+#define TIMER_WHEEL_END 0xFF
+
+typedef struct
+{
+	timer_callback_t callback; //NULL when the entry is free
+	uint8_t arg;
+	uint8_t rounds; //Full turns of the wheel left before it fires
+	uint8_t next; //Next timer in the same slot
+} timer_entry_t;
+
+static volatile uint16_t timebase_ms;
+uint16_t timebase_now;
+
+static timer_entry_t timers[TIMER_WHEEL_TIMERS];
+static uint8_t wheel[TIMER_WHEEL_SLOTS]; //First timer in each slot
+static uint8_t wheelPos; //Slot for timebase_now
+
+ISR(TIMER3_COMPA_vect)
+{
+	OCR3A += TIMEBASE_TICKS_PER_MS;
+	timebase_ms++;
+}
+
+void timebase_init(void)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		TCCR3A = 0; //Normal mode, no outputs
+		TCCR3B = _BV(CS31); //F_CPU/8
+		TCNT3 = 0;
+		OCR3A = TIMEBASE_TICKS_PER_MS;
+		TIFR3 = _BV(OCF3A);
+		TIMSK3 = _BV(OCIE3A);
+	}
+	for (uint8_t i = 0; i < TIMER_WHEEL_SLOTS; i++)
+		wheel[i] = TIMER_WHEEL_END;
+}
+
+//Free running tick count, TIMEBASE_TICKS_PER_US per us. Differences are good up to 32ms.
+//The ISR writes OCR3A which shares the 16 bit TEMP register with TCNT3, hence the atomic read.
+uint16_t timebase_ticks(void)
+{
+	uint16_t t;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		t = TCNT3;
+	}
+	return t;
+}
+
+//Takes the millisecond snapshot used by deadlines and runs every timer that has come due.
+//Called once per frame by the main loop. Callbacks run from here, never from the interrupt.
+void timebase_poll(void)
+{
+	uint16_t now;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		now = timebase_ms;
+	}
+
+	while (timebase_now != now) {
+		timebase_now++;
+		wheelPos = (wheelPos + 1) & (TIMER_WHEEL_SLOTS - 1);
+
+		//Unlink everything that's due first, so a callback can schedule itself again into this slot
+		uint8_t due = TIMER_WHEEL_END;
+		uint8_t *link = &wheel[wheelPos];
+		while (*link != TIMER_WHEEL_END) {
+			uint8_t i = *link;
+			timer_entry_t *t = &timers[i];
+			if (t->rounds) {
+				t->rounds--;
+				link = &t->next;
+				continue;
+			}
+			*link = t->next;
+			t->next = due;
+			due = i;
+		}
+
+		while (due != TIMER_WHEEL_END) {
+			timer_entry_t *t = &timers[due];
+			timer_callback_t callback = t->callback;
+			due = t->next;
+			t->callback = NULL;
+			callback(t->arg);
+		}
+	}
+}
+
+//Calls callback(arg) from timebase_poll() ms from now, counted from the last poll.
+//Returns false if ms is out of range or every timer is in use.
+bool timer_after(uint16_t ms, timer_callback_t callback, uint8_t arg)
+{
+	if (ms == 0)
+		ms = 1;
+	if (ms > TIMER_WHEEL_MAX_MS)
+		return false;
+
+	for (uint8_t i = 0; i < TIMER_WHEEL_TIMERS; i++) {
+		timer_entry_t *t = &timers[i];
+		if (t->callback != NULL)
+			continue;
+
+		uint8_t slot = (wheelPos + ms) & (TIMER_WHEEL_SLOTS - 1);
+		t->callback = callback;
+		t->arg = arg;
+		t->rounds = (ms - 1) / TIMER_WHEEL_SLOTS;
+		t->next = wheel[slot];
+		wheel[slot] = i;
+		return true;
+	}
+	return false;
+}
+
+//Drops any pending timer for callback(arg).
+void timer_cancel(timer_callback_t callback, uint8_t arg)
+{
+	for (uint8_t slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+		uint8_t *link = &wheel[slot];
+		while (*link != TIMER_WHEEL_END) {
+			timer_entry_t *t = &timers[*link];
+			if (t->callback == callback && t->arg == arg) {
+				*link = t->next;
+				t->callback = NULL;
+			} else {
+				link = &t->next;
+			}
+		}
+	}
+}
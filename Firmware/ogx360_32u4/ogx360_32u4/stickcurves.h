@@ -0,0 +1,126 @@
+/*
+* stickcurves.h
+*
+* Tables for stickshape.c. Each curve is the output magnitude (0-32767) at 256 even steps across the live
+* zone, from just outside the deadzone to STICK_OUTER. Entries in between are interpolated, so a curve only
+* has to be monotonic, not smooth.
+*/
+
+
+#ifndef STICKCURVES_H_
+#define STICKCURVES_H_
+
+#include <avr/pgmspace.h>
+#include "stickshape.h"
+
+/* Curves 1 onwards, curve 0 (linear) is worked out without a table */
+static const uint16_t StickCurves[STICK_CURVES - 1][256] PROGMEM = {
+	//1 Precise, t^2. Small movements are slower, for aiming
+	{
+		0, 1, 2, 5, 8, 13, 18, 25, 32, 41, 50, 61,
+		73, 85, 99, 113, 129, 146, 163, 182, 202, 222, 244, 267,
+		290, 315, 341, 367, 395, 424, 454, 484, 516, 549, 583, 617,
+		653, 690, 728, 766, 806, 847, 889, 932, 976, 1020, 1066, 1113,
+		1161, 1210, 1260, 1311, 1363, 1415, 1469, 1524, 1580, 1637, 1695, 1754,
+		1814, 1875, 1937, 2000, 2064, 2129, 2195, 2262, 2330, 2399, 2469, 2540,
+		2612, 2685, 2759, 2835, 2911, 2988, 3066, 3145, 3225, 3306, 3388, 3471,
+		3556, 3641, 3727, 3814, 3902, 3992, 4082, 4173, 4265, 4358, 4453, 4548,
+		4644, 4741, 4840, 4939, 5039, 5140, 5243, 5346, 5450, 5556, 5662, 5769,
+		5878, 5987, 6097, 6209, 6321, 6434, 6549, 6664, 6781, 6898, 7016, 7136,
+		7256, 7378, 7500, 7624, 7748, 7874, 8000, 8128, 8256, 8386, 8516, 8648,
+		8780, 8914, 9048, 9184, 9320, 9458, 9597, 9736, 9877, 10018, 10161, 10305,
+		10449, 10595, 10741, 10889, 11038, 11187, 11338, 11490, 11642, 11796, 11951, 12107,
+		12263, 12421, 12580, 12739, 12900, 13062, 13225, 13388, 13553, 13719, 13886, 14054,
+		14222, 14392, 14563, 14735, 14908, 15082, 15256, 15432, 15609, 15787, 15966, 16146,
+		16327, 16509, 16692, 16876, 17061, 17246, 17433, 17621, 17810, 18000, 18191, 18383,
+		18576, 18770, 18965, 19161, 19358, 19556, 19755, 19955, 20157, 20359, 20562, 20766,
+		20971, 21177, 21384, 21592, 21801, 22011, 22223, 22435, 22648, 22862, 23077, 23293,
+		23511, 23729, 23948, 24168, 24389, 24612, 24835, 25059, 25284, 25511, 25738, 25966,
+		26195, 26426, 26657, 26889, 27123, 27357, 27592, 27829, 28066, 28304, 28544, 28784,
+		29025, 29268, 29511, 29756, 30001, 30247, 30495, 30743, 30993, 31243, 31495, 31747,
+		32001, 32255, 32511, 32767
+	},
+	//2 Quick, 1-(1-t)^2. Gets going sooner, for games that feel sluggish
+	{
+		0, 256, 512, 766, 1020, 1272, 1524, 1774, 2024, 2272, 2520, 2766,
+		3011, 3256, 3499, 3742, 3983, 4223, 4463, 4701, 4938, 5175, 5410, 5644,
+		5878, 6110, 6341, 6572, 6801, 7029, 7256, 7483, 7708, 7932, 8155, 8378,
+		8599, 8819, 9038, 9256, 9474, 9690, 9905, 10119, 10332, 10544, 10756, 10966,
+		11175, 11383, 11590, 11796, 12001, 12205, 12408, 12610, 12812, 13012, 13211, 13409,
+		13606, 13802, 13997, 14191, 14384, 14576, 14767, 14957, 15146, 15334, 15521, 15706,
+		15891, 16075, 16258, 16440, 16621, 16801, 16980, 17158, 17335, 17511, 17685, 17859,
+		18032, 18204, 18375, 18545, 18713, 18881, 19048, 19214, 19379, 19542, 19705, 19867,
+		20028, 20187, 20346, 20504, 20660, 20816, 20971, 21125, 21277, 21429, 21580, 21729,
+		21878, 22026, 22172, 22318, 22462, 22606, 22749, 22890, 23031, 23170, 23309, 23447,
+		23583, 23719, 23853, 23987, 24119, 24251, 24381, 24511, 24639, 24767, 24893, 25019,
+		25143, 25267, 25389, 25511, 25631, 25751, 25869, 25986, 26103, 26218, 26333, 26446,
+		26558, 26670, 26780, 26889, 26998, 27105, 27211, 27317, 27421, 27524, 27627, 27728,
+		27828, 27927, 28026, 28123, 28219, 28314, 28409, 28502, 28594, 28685, 28775, 28865,
+		28953, 29040, 29126, 29211, 29296, 29379, 29461, 29542, 29622, 29701, 29779, 29856,
+		29932, 30008, 30082, 30155, 30227, 30298, 30368, 30437, 30505, 30572, 30638, 30703,
+		30767, 30830, 30892, 30953, 31013, 31072, 31130, 31187, 31243, 31298, 31352, 31404,
+		31456, 31507, 31557, 31606, 31654, 31701, 31747, 31791, 31835, 31878, 31920, 31961,
+		32001, 32039, 32077, 32114, 32150, 32184, 32218, 32251, 32283, 32313, 32343, 32372,
+		32400, 32426, 32452, 32477, 32500, 32523, 32545, 32565, 32585, 32604, 32621, 32638,
+		32654, 32668, 32682, 32694, 32706, 32717, 32726, 32735, 32742, 32749, 32754, 32759,
+		32762, 32765, 32766, 32767
+	},
+	//3 Anti-deadzone, 25% + 75%t. Jumps past the game's own deadzone so the smallest movement registers
+	{
+		8192, 8288, 8384, 8481, 8577, 8674, 8770, 8866, 8963, 9059, 9155, 9252,
+		9348, 9445, 9541, 9637, 9734, 9830, 9926, 10023, 10119, 10216, 10312, 10408,
+		10505, 10601, 10697, 10794, 10890, 10987, 11083, 11179, 11276, 11372, 11468, 11565,
+		11661, 11758, 11854, 11950, 12047, 12143, 12239, 12336, 12432, 12529, 12625, 12721,
+		12818, 12914, 13010, 13107, 13203, 13300, 13396, 13492, 13589, 13685, 13781, 13878,
+		13974, 14071, 14167, 14263, 14360, 14456, 14552, 14649, 14745, 14842, 14938, 15034,
+		15131, 15227, 15323, 15420, 15516, 15613, 15709, 15805, 15902, 15998, 16094, 16191,
+		16287, 16384, 16480, 16576, 16673, 16769, 16865, 16962, 17058, 17154, 17251, 17347,
+		17444, 17540, 17636, 17733, 17829, 17925, 18022, 18118, 18215, 18311, 18407, 18504,
+		18600, 18696, 18793, 18889, 18986, 19082, 19178, 19275, 19371, 19467, 19564, 19660,
+		19757, 19853, 19949, 20046, 20142, 20238, 20335, 20431, 20528, 20624, 20720, 20817,
+		20913, 21009, 21106, 21202, 21299, 21395, 21491, 21588, 21684, 21780, 21877, 21973,
+		22070, 22166, 22262, 22359, 22455, 22551, 22648, 22744, 22841, 22937, 23033, 23130,
+		23226, 23322, 23419, 23515, 23612, 23708, 23804, 23901, 23997, 24093, 24190, 24286,
+		24383, 24479, 24575, 24672, 24768, 24864, 24961, 25057, 25153, 25250, 25346, 25443,
+		25539, 25635, 25732, 25828, 25924, 26021, 26117, 26214, 26310, 26406, 26503, 26599,
+		26695, 26792, 26888, 26985, 27081, 27177, 27274, 27370, 27466, 27563, 27659, 27756,
+		27852, 27948, 28045, 28141, 28237, 28334, 28430, 28527, 28623, 28719, 28816, 28912,
+		29008, 29105, 29201, 29298, 29394, 29490, 29587, 29683, 29779, 29876, 29972, 30069,
+		30165, 30261, 30358, 30454, 30550, 30647, 30743, 30840, 30936, 31032, 31129, 31225,
+		31321, 31418, 31514, 31611, 31707, 31803, 31900, 31996, 32092, 32189, 32285, 32382,
+		32478, 32574, 32671, 32767
+	}
+};
+
+typedef struct
+{
+	uint16_t inner; //Magnitude at or below which the stick reads centred
+	uint16_t scale; //65280/(STICK_OUTER - inner) in Q14, takes the live zone to the 8.8 curve position
+} StickDeadzone_t;
+
+#define STICK_DEADZONE(inner) {(inner), (uint16_t)(((uint32_t)65280 << 14) / (STICK_OUTER - (inner)))}
+
+static const StickDeadzone_t StickDeadzones[STICK_DEADZONES] PROGMEM = {
+	STICK_DEADZONE(0),
+	STICK_DEADZONE(3277), //10%
+	STICK_DEADZONE(4915), //15%
+	STICK_DEADZONE(6554), //20%
+	STICK_DEADZONE(8192) //25%
+};
+
+/* 2^31/m for m normalised to 0x8000-0xFFFF, indexed by its top byte - 128, taken at the middle of each step */
+static const uint16_t StickReciprocal[128] PROGMEM = {
+	65281, 64777, 64281, 63792, 63310, 62836, 62369, 61909, 61455, 61008, 60568, 60133,
+	59705, 59283, 58867, 58457, 58053, 57654, 57260, 56872, 56489, 56111, 55738, 55370,
+	55007, 54649, 54295, 53946, 53601, 53261, 52925, 52593, 52265, 51942, 51622, 51306,
+	50995, 50686, 50382, 50081, 49784, 49490, 49200, 48913, 48630, 48349, 48072, 47798,
+	47528, 47260, 46995, 46733, 46474, 46218, 45965, 45714, 45467, 45222, 44979, 44739,
+	44502, 44267, 44035, 43805, 43577, 43352, 43129, 42908, 42690, 42474, 42260, 42048,
+	41838, 41631, 41425, 41222, 41020, 40820, 40623, 40427, 40233, 40041, 39851, 39662,
+	39476, 39291, 39108, 38926, 38746, 38568, 38392, 38217, 38044, 37872, 37702, 37533,
+	37366, 37200, 37036, 36873, 36712, 36552, 36393, 36236, 36080, 35926, 35772, 35620,
+	35470, 35320, 35172, 35026, 34880, 34735, 34592, 34450, 34309, 34169, 34031, 33893,
+	33757, 33622, 33487, 33354, 33222, 33091, 32961, 32832
+};
+
+#endif /* STICKCURVES_H_ */
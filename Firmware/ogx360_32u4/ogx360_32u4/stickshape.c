@@ -0,0 +1,91 @@
+/*
+ * stickshape.c
+ *
+ * The deadzone is radial. The stick's magnitude is approximated as max(|x|,|y|) or 7/8 max + 1/2 min,
+ * whichever is larger (within -3% to +1% of the true length), and the stick reads centred inside the
+ * deadzone. The rest of the travel, up to STICK_OUTER, is run through the player's curve and the result
+ * is scaled back onto the stick's direction.
+ *
+ * There is no divide or float anywhere. The curve is a table lookup with linear interpolation, and
+ * out/magnitude uses a reciprocal table. That comes to about 300 cycles (~20us) per stick, which is
+ * within the frame for all eight sticks. The mapping only runs for a controller whose input has changed.
+ */
+
+#include <avr/pgmspace.h>
+#include "stickshape.h"
+#include "stickcurves.h"
+#include "nvsettings.h"
+
+//Scales one axis by out/magnitude. normalised is |value| shifted up as far as the magnitude was.
+static int16_t Stick_Axis(int16_t value, uint16_t normalised, uint16_t reciprocal, uint16_t out)
+{
+	uint16_t ratio = ((uint32_t)normalised * reciprocal) >> 16; //|value|/magnitude, Q15
+	uint32_t scaled = ((uint32_t)out * ratio) >> 15;
+	if (scaled > 32767)
+		scaled = 32767;
+	return (value < 0) ? -(int16_t)scaled : (int16_t)scaled;
+}
+
+//Applies the player's deadzone and curve to one stick.
+void Stick_Shape(int16_t* x, int16_t* y, uint8_t player)
+{
+	uint8_t curve = NVSettings.player[player].stickCurve;
+	uint8_t deadzone = NVSettings.player[player].stickDeadzone;
+	if (curve >= STICK_CURVES)
+		curve = 0;
+	if (deadzone >= STICK_DEADZONES)
+		deadzone = 0;
+	//The anti-deadzone curve jumps straight to 25%, so without a deadzone a resting stick's noise would walk
+	if (curve == STICK_CURVE_ANTIDEADZONE && deadzone < STICK_ANTIDEADZONE_MIN)
+		deadzone = STICK_ANTIDEADZONE_MIN;
+	if (curve == 0 && deadzone == 0)
+		return; //Linear with no deadzone, the stick goes through untouched
+
+	uint16_t ax = (*x < 0) ? -(uint16_t)*x : (uint16_t)*x;
+	uint16_t ay = (*y < 0) ? -(uint16_t)*y : (uint16_t)*y;
+	uint16_t mx = (ax > ay) ? ax : ay;
+	uint16_t mn = (ax > ay) ? ay : ax;
+	uint16_t mag = mx - (mx >> 3) + (mn >> 1);
+	if (mag < mx)
+		mag = mx;
+
+	uint16_t inner = pgm_read_word(&StickDeadzones[deadzone].inner);
+	if (mag <= inner)
+	{
+		*x = 0;
+		*y = 0;
+		return;
+	}
+
+	//Position across the live zone, 0-255 in 8.8
+	uint16_t live = ((mag < STICK_OUTER) ? mag : STICK_OUTER) - inner;
+	uint16_t t = ((uint32_t)(uint16_t)(live << 1) * pgm_read_word(&StickDeadzones[deadzone].scale)) >> 15;
+	if (t > 0xFF00)
+		t = 0xFF00;
+
+	uint16_t out;
+	if (curve == 0)
+	{
+		out = (t >> 1) + (t >> 9); //t * 32767/65280
+	}
+	else
+	{
+		const uint16_t* lut = StickCurves[curve - 1];
+		uint8_t i = t >> 8;
+		out = pgm_read_word(&lut[i]);
+		if (i < 255)
+			out += ((uint32_t)(uint16_t)(pgm_read_word(&lut[i + 1]) - out) * (uint8_t)t) >> 8;
+	}
+
+	//Normalise the magnitude to 0x8000-0xFFFF so its reciprocal comes from a 128 entry table
+	uint16_t m = mag;
+	uint8_t e = 0;
+	if (!(m & 0xFF00)) { m <<= 8; e += 8; }
+	if (!(m & 0xF000)) { m <<= 4; e += 4; }
+	if (!(m & 0xC000)) { m <<= 2; e += 2; }
+	if (!(m & 0x8000)) { m <<= 1; e += 1; }
+	uint16_t reciprocal = pgm_read_word(&StickReciprocal[(m >> 8) - 128]);
+
+	*x = Stick_Axis(*x, (uint16_t)(ax << e), reciprocal, out);
+	*y = Stick_Axis(*y, (uint16_t)(ay << e), reciprocal, out);
+}
@@ -0,0 +1,29 @@
+/*
+ * stickshape.h
+ *
+ * Per player analog stick shaping, a radial deadzone and a response curve. Both are picked on the controller
+ * with XBOX + D-pad and kept in NVSettings. See stickshape.c.
+ */
+
+#ifndef STICKSHAPE_H_
+#define STICKSHAPE_H_
+
+#include <inttypes.h>
+
+#define STICK_CURVES 4 //0 Linear, 1 Precise, 2 Quick, 3 Anti-deadzone. See stickcurves.h
+#define STICK_DEADZONES 5 //0 None, then 10, 15, 20 and 25% of full deflection
+#define STICK_CURVE_ANTIDEADZONE 3
+#define STICK_ANTIDEADZONE_MIN 1 //Smallest deadzone used with the anti-deadzone curve
+#define STICK_OUTER 32000 //Magnitude taken as full deflection. Most sticks stop short of 32767 on the diagonals.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	void Stick_Shape(int16_t* x, int16_t* y, uint8_t player);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STICKSHAPE_H_ */
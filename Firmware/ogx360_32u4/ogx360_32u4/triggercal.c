@@ -0,0 +1,125 @@
+/*
+ * triggercal.c
+ *
+ * The lowest reading seen since the controller connected is taken as the rest position once it's at or
+ * below TRIGGER_REST_MAX. Until then the range saved from last time is used. Learning starts again on
+ * every connect, so a trigger that wears further, or a different controller in the slot, is picked up.
+ *
+ * Fully pressed is only learned from whole pulls, the peak reading between leaving rest and coming back
+ * to it. A pull that goes past the range widens it straight away. Narrowing it takes TRIGGER_FULL_PULLS
+ * pulls in a row that all peak within TRIGGER_FULL_SLACK of each other, as a worn trigger hitting its
+ * stop does, so the partial pulls of a healthy trigger don't shrink its range.
+ *
+ * Each range is saved in one NVSettings byte, a nibble per end in steps of 4, rounded inwards.
+ * Calibrated values are a subtract and a multiply by a gain. The gain is worked out again only when
+ * the range moves.
+ */
+
+#include "triggercal.h"
+#include "nvsettings.h"
+
+typedef struct
+{
+	uint8_t rest; //At or below reads 0x00
+	uint8_t full; //At or above reads 0xFF
+	uint8_t lowest; //Lowest reading since the controller connected
+	uint8_t peak; //Highest reading of the pull in progress
+	uint8_t candidate; //Peak the last pulls short of full agreed on
+	uint8_t pulls; //How many pulls in a row have agreed on candidate
+	uint16_t gain; //255/(full - rest) in Q8.8
+} TriggerCal_t;
+
+static TriggerCal_t TriggerCal[NV_PLAYERS][2];
+
+static void TriggerCal_Changed(TriggerCal_t* cal, uint8_t player, uint8_t trigger)
+{
+	cal->gain = 0xFF00 / (uint8_t)(cal->full - cal->rest); //At least 135 apart, so the gain fits
+
+	uint8_t packed = (uint8_t)((cal->rest + 3) >> 2) | (uint8_t)(((uint8_t)(255 - cal->full) + 3) >> 2) << 4;
+	if (NVSettings.player[player].triggerCal[trigger] != packed)
+	{
+		NVSettings.player[player].triggerCal[trigger] = packed;
+		NV_Changed();
+	}
+}
+
+//Starts learning the player's triggers again from the saved ranges. Called when a controller connects.
+void TriggerCal_Reset(uint8_t player)
+{
+	for (uint8_t trigger = 0; trigger < 2; trigger++)
+	{
+		TriggerCal_t* cal = &TriggerCal[player][trigger];
+		uint8_t packed = NVSettings.player[player].triggerCal[trigger];
+		cal->rest = (packed & 0x0F) << 2;
+		cal->full = 255 - ((packed >> 4) << 2);
+		cal->lowest = 0xFF;
+		cal->peak = 0x00;
+		cal->pulls = 0;
+		cal->gain = 0xFF00 / (uint8_t)(cal->full - cal->rest);
+	}
+}
+
+//A pull that got past TRIGGER_FULL_MIN has come back to rest
+static void TriggerCal_Pulled(TriggerCal_t* cal, uint8_t player, uint8_t trigger)
+{
+	uint8_t peak = cal->peak;
+	if (peak >= cal->full)
+	{
+		cal->pulls = 0;
+		if (peak > cal->full)
+		{
+			cal->full = peak;
+			TriggerCal_Changed(cal, player, trigger);
+		}
+		return;
+	}
+
+	if (cal->pulls && peak + TRIGGER_FULL_SLACK >= cal->candidate && peak <= cal->candidate + TRIGGER_FULL_SLACK)
+	{
+		if (peak > cal->candidate)
+			cal->candidate = peak;
+		cal->pulls++;
+	}
+	else
+	{
+		cal->candidate = peak;
+		cal->pulls = 1;
+	}
+
+	if (cal->pulls >= TRIGGER_FULL_PULLS)
+	{
+		cal->pulls = 0;
+		cal->full = cal->candidate;
+		TriggerCal_Changed(cal, player, trigger);
+	}
+}
+
+//Learns from a raw trigger reading (0x00-0xFF) and returns it calibrated.
+uint8_t TriggerCal_Apply(uint8_t value, uint8_t player, uint8_t trigger)
+{
+	TriggerCal_t* cal = &TriggerCal[player][trigger];
+
+	if (value < cal->lowest)
+	{
+		cal->lowest = value;
+		if (value <= TRIGGER_REST_MAX && value != cal->rest)
+		{
+			cal->rest = value;
+			TriggerCal_Changed(cal, player, trigger);
+		}
+	}
+	if (value > cal->peak)
+		cal->peak = value;
+	if (value <= TRIGGER_REST_MAX)
+	{
+		if (cal->peak >= TRIGGER_FULL_MIN)
+			TriggerCal_Pulled(cal, player, trigger);
+		cal->peak = value;
+	}
+
+	if (value <= cal->rest)
+		return 0x00;
+	if (value >= cal->full)
+		return 0xFF;
+	return ((uint16_t)(value - cal->rest) * cal->gain) >> 8;
+}
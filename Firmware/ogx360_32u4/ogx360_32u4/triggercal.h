@@ -0,0 +1,31 @@
+/*
+ * triggercal.h
+ *
+ * Per player trigger calibration. Worn triggers often rest above 0 and never reach 0xFF, so each
+ * trigger's travel is learned as it's used and stretched back out to 0x00-0xFF. See triggercal.c.
+ */
+
+#ifndef TRIGGERCAL_H_
+#define TRIGGERCAL_H_
+
+#include <inttypes.h>
+
+#define TRIGGER_LEFT 0
+#define TRIGGER_RIGHT 1
+#define TRIGGER_REST_MAX 60 //Highest reading that can be learned as the trigger's rest position
+#define TRIGGER_FULL_MIN 195 //Lowest reading that can be learned as fully pressed
+#define TRIGGER_FULL_PULLS 3 //Pulls in a row peaking at the same reading before fully pressed is brought in to it
+#define TRIGGER_FULL_SLACK 2 //How far apart those peaks can be
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+	void TriggerCal_Reset(uint8_t player);
+	uint8_t TriggerCal_Apply(uint8_t value, uint8_t player, uint8_t trigger);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TRIGGERCAL_H_ */
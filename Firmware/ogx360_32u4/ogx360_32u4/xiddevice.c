@@ -29,23 +29,63 @@ this software.
 */
 
 #include "settings.h"
+#include "Arduino.h"
+#include "timebase.h"
 #include "xiddevice.h"
+#include "nvsettings.h"
 #include "dukecontroller.h"
 
 #ifdef SUPPORTBATTALION
 #include "steelbattalion.h"
 #endif
 
+#include <string.h>
 
-extern bool enumerationComplete;
-extern uint8_t ConnectedXID;
+//Runs from the main loop and the USB interrupt, neither can wait
+#pragma GCC poison delay
 
-USB_XboxGamepad_Data_t PrevDukeHIDReportBuffer;
+//Last report handed over by the main loop. GET_REPORT requests are answered from the USB interrupt
+//and may land in the middle of the main loop mapping a controller, so the console is only ever sent
+//this snapshot, which is updated in one go by PublishHIDReport().
+static uint8_t PublishedReport[XID_MAX_REPORT_SIZE];
 
-#ifdef SUPPORTBATTALION
-USB_XboxSteelBattalion_Data_t PrevBattalionHIDReportBuffer;
+//The main loop flags a new report with XID_ReportChanged() rather than the HID driver comparing every report
+//against the last one (PrevReportINBuffer is left NULL for that reason).
+static bool ReportChanged = true; //Player 1's report has changed since it was last published
+static volatile bool ReportUnsent = true; //The published report hasn't been written to the IN endpoint yet
+
+XID_Telemetry_t XIDTelemetry;
+
+//Set when the faster configuration descriptor is being advertised. On by default when built with SUPPORTOVERCLOCK.
+#ifdef SUPPORTOVERCLOCK
+volatile bool XIDOverclock = true;
+#else
+volatile bool XIDOverclock = false;
 #endif
 
+static volatile bool ReportPending; //An IN report is sitting in the endpoint bank waiting for the console
+static volatile uint16_t ReportCount;
+static uint16_t ReportRateTimer; //timebase_now
+
+XID_Freshness_t XIDFreshness;
+static volatile uint16_t SOFTicks; //timebase_ticks() at the last SOF
+static uint32_t SampleMicros; //When the main loop last sampled player 1's controller
+static uint32_t PublishedSampleMicros; //Sample time of the published report
+static uint32_t BankSampleMicros; //Sample time of the report sitting in the IN endpoint bank
+static uint32_t LastINMicros;
+static uint32_t LastOUTMicros;
+static volatile bool OUTArrived; //OUT report seen by the SOF handler but not read by the main loop yet
+static volatile uint8_t SOFCount; //Incremented every SOF, the main loop's frames start on it
+
+static void CheckINCollected(uint8_t INEndpoint);
+static void NoteOUT(void);
+
+//Personality switch state. See XID_BeginSwitch().
+static uint8_t SwitchState = XID_SWITCH_IDLE;
+static uint16_t SwitchWindow;
+static uint16_t SwitchTimer; //timebase_now
+static uint16_t SwitchStart;
+
 /** LUFA HID Class driver interface configuration and state information. This structure is
 passed to all HID Class driver functions, so that multiple instances of the same class
 within a device can be differentiated from one another.
@@ -58,8 +98,8 @@ USB_ClassInfo_HID_Device_t DukeController_HID_Interface = {
 			.Size                 = 20,
 			.Banks                = 1,
 		},
-		.PrevReportINBuffer           = &PrevDukeHIDReportBuffer,
-		.PrevReportINBufferSize       = sizeof(PrevDukeHIDReportBuffer),
+		.PrevReportINBuffer           = NULL,
+		.PrevReportINBufferSize       = sizeof(USB_XboxGamepad_Data_t),
 	},
 };
 
@@ -72,12 +112,125 @@ USB_ClassInfo_HID_Device_t SteelBattalion_HID_Interface = {
 			.Size                 = 26,
 			.Banks                = 1,
 		},
-		.PrevReportINBuffer           = &PrevBattalionHIDReportBuffer,
-		.PrevReportINBufferSize       = sizeof(PrevBattalionHIDReportBuffer),
+		.PrevReportINBuffer           = NULL,
+		.PrevReportINBufferSize       = sizeof(USB_XboxSteelBattalion_Data_t),
 	},
 };
 #endif
 
+//One entry per emulated XID device, indexed by DUKE_CONTROLLER/STEELBATTALION. Everything that differs between
+//the devices lives here so the USB callbacks just read the active entry instead of switching on the device type.
+static const XID_Profile_t XIDProfiles[] PROGMEM = {
+	[DUKE_CONTROLLER] = {
+		.deviceDescriptor     = DUKE_USB_DESCRIPTOR_DEVICE,
+		.configDescriptor     = DUKE_USB_DESCRIPTOR_CONFIGURATION,
+		#ifdef SUPPORTOVERCLOCK
+		.configDescriptorFast = DUKE_USB_DESCRIPTOR_CONFIGURATION_FAST,
+		#endif
+		.xidDescriptor        = DUKE_HID_DESCRIPTOR_XID,
+		.capabilitiesIn       = DUKE_HID_CAPABILITIES_IN,
+		.capabilitiesOut      = DUKE_HID_CAPABILITIES_OUT,
+		.configDescriptorSize = sizeof(DUKE_USB_DESCRIPTOR_CONFIGURATION),
+		.capabilitiesInSize   = 20,
+		.capabilitiesOutSize  = 6,
+		.outEndpointAddress   = 0x02,
+		.outEndpointSize      = 6,
+		.hidInterface         = &DukeController_HID_Interface,
+		.report               = &XboxOGDuke[0],
+		.reportSize           = 20,
+	},
+	#ifdef SUPPORTBATTALION
+	[STEELBATTALION] = {
+		.deviceDescriptor     = BATTALION_USB_DESCRIPTOR_DEVICE,
+		.configDescriptor     = BATTALION_USB_DESCRIPTOR_CONFIGURATION,
+		#ifdef SUPPORTOVERCLOCK
+		.configDescriptorFast = BATTALION_USB_DESCRIPTOR_CONFIGURATION_FAST,
+		#endif
+		.xidDescriptor        = BATTALION_HID_DESCRIPTOR_XID,
+		.capabilitiesIn       = BATTALION_HID_CAPABILITIES_IN,
+		.capabilitiesOut      = BATTALION_HID_CAPABILITIES_OUT,
+		.configDescriptorSize = sizeof(BATTALION_USB_DESCRIPTOR_CONFIGURATION),
+		.capabilitiesInSize   = 21,
+		.capabilitiesOutSize  = 22,
+		.outEndpointAddress   = 0x01,
+		.outEndpointSize      = 32,
+		.hidInterface         = &SteelBattalion_HID_Interface,
+		.report               = &XboxOGSteelBattalion,
+		.reportSize           = 26,
+	},
+	#endif
+};
+
+//Active profile. Only changed through XID_SelectProfile() while detached from the console.
+static const XID_Profile_t* XIDProfile = &XIDProfiles[DUKE_CONTROLLER];
+
+#define XIDProfileByte(field) pgm_read_byte(&XIDProfile->field)
+#define XIDProfilePtr(field) ((const void*)pgm_read_word(&XIDProfile->field))
+
+//Selects the emulated XID device. ConnectedXID is kept alongside for the controller mapping in the main loop.
+void XID_SelectProfile(uint8_t xid){
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		ConnectedXID = xid;
+		XIDProfile = &XIDProfiles[xid];
+	}
+	ReportChanged = true;
+}
+
+USB_ClassInfo_HID_Device_t* XID_HIDInterface(void){
+	return (USB_ClassInfo_HID_Device_t*)XIDProfilePtr(hidInterface);
+}
+
+//Changing the polling interval needs the console to read the configuration descriptor again, so re-enumerate.
+void XID_SetOverclock(bool enable){
+	#ifdef SUPPORTOVERCLOCK
+	if (XIDOverclock == enable)
+		return;
+	XIDOverclock = enable;
+	if (!XID_SwitchInProgress())
+		XID_BeginSwitch(ConnectedXID);
+	#endif
+}
+
+//Publishes the latest report and hands it to the IN endpoint when the polling interval allows.
+void XID_USBTask(void){
+	USB_ClassInfo_HID_Device_t* HIDInterface = XID_HIDInterface();
+	uint8_t INEndpoint = HIDInterface->Config.ReportINEndpoint.Address;
+	uint8_t PollFrames = XIDOverclock ? OVERCLOCK_INTERVAL : XID_POLL_FRAMES;
+
+	PublishHIDReport();
+
+	if (timebase_elapsed(ReportRateTimer) >= 1000){
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+			XIDTelemetry.reportRate = ReportCount;
+			ReportCount = 0;
+		}
+		XIDTelemetry.pollFrames = PollFrames;
+		ReportRateTimer = timebase_now;
+	}
+
+	if (USB_DeviceState != DEVICE_STATE_Configured)
+		return;
+
+	//The IN endpoint is single banked, so if the bank we filled is free again the console has collected it.
+	//Account for that before the bank is refilled below.
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		CheckINCollected(INEndpoint);
+	}
+
+	//Frame numbers are 11 bits and wrap every 2048ms.
+	if (((USB_Device_GetFrameNumber() - HIDInterface->State.PrevFrameNum) & 0x7FF) >= PollFrames){
+		HID_Device_USBTask(HIDInterface);
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+			Endpoint_SelectEndpoint(INEndpoint);
+			if (!ReportPending && !Endpoint_IsINReady()){
+				ReportUnsent = false;
+				ReportPending = true;
+				BankSampleMicros = PublishedSampleMicros;
+			}
+		}
+	}
+}
+
 /** Configures the board hardware and chip peripherals */
 void SetupHardware(void){
 	MCUSR &= ~(1 << WDRF);
@@ -100,18 +253,20 @@ void EVENT_USB_Device_Disconnect(void){
 /** Event handler for the library USB Configuration Changed event. */
 void EVENT_USB_Device_ConfigurationChanged(void){
 	bool ConfigSuccess = true;
-	switch (ConnectedXID){
-		case DUKE_CONTROLLER:
-		ConfigSuccess &= HID_Device_ConfigureEndpoints(&DukeController_HID_Interface);
-		ConfigSuccess &= Endpoint_ConfigureEndpoint(0x02, EP_TYPE_INTERRUPT, 6, 1); //Host Out endpoint opened manually for Duke.
-		break;
-		#ifdef SUPPORTBATTALION
-		case STEELBATTALION:
-		ConfigSuccess &= HID_Device_ConfigureEndpoints(&SteelBattalion_HID_Interface);
-		ConfigSuccess &= Endpoint_ConfigureEndpoint(0x01, EP_TYPE_INTERRUPT, 32, 1); //Host Out endpoint opened manually for SB.
-		break;
-		#endif
+
+	//Endpoints aren't cleared on a bus reset, so after a personality switch the other device's endpoints are
+	//still enabled (EP1 even has the opposite direction). Disable them first so only the new set is live.
+	for (uint8_t ep = ENDPOINT_TOTAL_ENDPOINTS - 1; ep > 0; ep--){
+		Endpoint_SelectEndpoint(ep);
+		Endpoint_DisableEndpoint();
 	}
+
+	ConfigSuccess &= HID_Device_ConfigureEndpoints(XID_HIDInterface());
+	ReportUnsent = true; //Newly configured, the console hasn't seen anything yet
+	ReportPending = false; //Whatever was in the old bank is gone, it mustn't count as collected or block the next report
+	//Host Out endpoint is opened manually, the LUFA HID driver only handles the IN endpoint.
+	ConfigSuccess &= Endpoint_ConfigureEndpoint(XIDProfileByte(outEndpointAddress), EP_TYPE_INTERRUPT,
+	                                            XIDProfileByte(outEndpointSize), 1);
 	USB_Device_EnableSOFEvents();
 	enumerationComplete=ConfigSuccess;
 }
@@ -128,46 +283,31 @@ void EVENT_USB_Device_ControlRequest(void){
 	if (USB_ControlRequest.bmRequestType == 0xC1){
 			if (USB_ControlRequest.bRequest == 0x06 && USB_ControlRequest.wValue == 0x4200) {
 				Endpoint_ClearSETUP();
-				switch (ConnectedXID){
-					case DUKE_CONTROLLER:
-					Endpoint_Write_Control_Stream_LE(&DUKE_HID_DESCRIPTOR_XID, 16);
-					break;
-					#ifdef SUPPORTBATTALION
-					case STEELBATTALION:
-					Endpoint_Write_Control_Stream_LE(&BATTALION_HID_DESCRIPTOR_XID, 16);
-					break;
-					#endif
-				}
+				Endpoint_Write_Control_PStream_LE(XIDProfilePtr(xidDescriptor), 16);
 				Endpoint_ClearOUT();
 				return;
 			}
 			else if (USB_ControlRequest.bRequest == 0x01 && USB_ControlRequest.wValue == 0x0100) {
 				Endpoint_ClearSETUP();
-				switch (ConnectedXID){
-					case DUKE_CONTROLLER:
-					Endpoint_Write_Control_Stream_LE(&DUKE_HID_CAPABILITIES_IN, 20);
-					break;
-					#ifdef SUPPORTBATTALION
-					case STEELBATTALION:
-					Endpoint_Write_Control_Stream_LE(&BATTALION_HID_CAPABILITIES_IN, 21);
-					break;
-					#endif
-				}
-
+				Endpoint_Write_Control_PStream_LE(XIDProfilePtr(capabilitiesIn), XIDProfileByte(capabilitiesInSize));
 				Endpoint_ClearOUT();
 				return;
 			}
 			else if (USB_ControlRequest.bRequest == 0x01 && USB_ControlRequest.wValue == 0x0200) {
 				Endpoint_ClearSETUP();
-				switch (ConnectedXID){
-					case DUKE_CONTROLLER:
-					Endpoint_Write_Control_Stream_LE(&DUKE_HID_CAPABILITIES_OUT, 6);
+				Endpoint_Write_Control_PStream_LE(XIDProfilePtr(capabilitiesOut), XIDProfileByte(capabilitiesOutSize));
+				Endpoint_ClearOUT();
+				return;
+			}
+			else if (USB_ControlRequest.bRequest == XID_REQUEST_TELEMETRY) {
+				Endpoint_ClearSETUP();
+				switch (USB_ControlRequest.wValue){
+					case XID_TELEMETRY_FRESHNESS:
+					Endpoint_Write_Control_Stream_LE(&XIDFreshness, sizeof(XIDFreshness));
 					break;
-					#ifdef SUPPORTBATTALION
-					case STEELBATTALION:
-					Endpoint_Write_Control_Stream_LE(&BATTALION_HID_CAPABILITIES_OUT, 22);
+					default:
+					Endpoint_Write_Control_Stream_LE(&XIDTelemetry, sizeof(XIDTelemetry));
 					break;
-					#endif
 				}
 				Endpoint_ClearOUT();
 				return;
@@ -175,34 +315,188 @@ void EVENT_USB_Device_ControlRequest(void){
 	}
 
 	//If the request is a standard HID control request, jump into the LUFA library to handle it for us.
-	switch (ConnectedXID){
-		case DUKE_CONTROLLER:
-		HID_Device_ProcessControlRequest(&DukeController_HID_Interface);
-		break;
-		#ifdef SUPPORTBATTALION
-		case STEELBATTALION:
-		HID_Device_ProcessControlRequest(&SteelBattalion_HID_Interface);
-		break;
-		#endif
-	}
-
+	HID_Device_ProcessControlRequest(XID_HIDInterface());
 }
 
 
 /** Event handler for the USB device Start Of Frame event. */
 void EVENT_USB_Device_StartOfFrame(void){
-	switch (ConnectedXID){
-		case DUKE_CONTROLLER:
-		HID_Device_MillisecondElapsed(&DukeController_HID_Interface);
+	HID_Device_MillisecondElapsed(XID_HIDInterface());
+	SOFTicks = timebase_ticks();
+	SOFCount++;
+
+	//This runs from USB_GEN_vect which, unlike the control endpoint interrupt, doesn't preserve the selected endpoint.
+	uint8_t PrevEndpoint = Endpoint_GetCurrentEndpoint();
+	CheckINCollected(XID_HIDInterface()->Config.ReportINEndpoint.Address);
+	Endpoint_SelectEndpoint(XIDProfileByte(outEndpointAddress));
+	if (!OUTArrived && Endpoint_IsOUTReceived()){
+		OUTArrived = true;
+		NoteOUT();
+	}
+	Endpoint_SelectEndpoint(PrevEndpoint);
+}
+
+
+//Copies the player 1 input report into the snapshot read by CreateHIDReport if it has changed. Called from
+//the main loop once the report has been fully mapped.
+void PublishHIDReport(void){
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		if (ReportChanged){
+			memcpy(PublishedReport, XIDProfilePtr(report), XIDProfileByte(reportSize));
+			ReportChanged = false;
+			ReportUnsent = true;
+		}
+		PublishedSampleMicros = SampleMicros;
+	}
+}
+
+//Called by the main loop whenever it changes player 1's report, so it's published and sent.
+void XID_ReportChanged(void){
+	ReportChanged = true;
+}
+
+//Number of SOFs seen, wraps. Only moves while the console has us configured.
+uint8_t XID_FrameCount(void){
+	return SOFCount;
+}
+
+//Called by the main loop once it has read player 1's controller, so the report age can be measured.
+void XID_MarkSample(void){
+	SampleMicros = micros();
+}
+
+static void HistogramAdd(uint16_t* Histogram, uint32_t Value){
+	uint8_t Bin = 0;
+	while (Value > 1 && Bin < XID_HISTOGRAM_BINS - 1){
+		Value >>= 1;
+		Bin++;
+	}
+	if (Histogram[Bin] != 0xFFFF)
+		Histogram[Bin]++;
+}
+
+static void Stamp(uint16_t* Frame, uint16_t* SubFrame){
+	*Frame = USB_Device_GetFrameNumber();
+	*SubFrame = (uint16_t)(timebase_ticks() - SOFTicks) / TIMEBASE_TICKS_PER_US;
+}
+
+//Checks if the console has collected the IN report we left in the bank. Called from the SOF interrupt and
+//from the main loop (with interrupts off) before the bank is refilled, whichever sees it first.
+static void CheckINCollected(uint8_t INEndpoint){
+	if (!ReportPending)
+		return;
+	Endpoint_SelectEndpoint(INEndpoint);
+	if (!Endpoint_IsINReady())
+		return;
+
+	uint32_t Now = micros();
+	ReportPending = false;
+	ReportCount++;
+	Stamp(&XIDFreshness.lastInFrame, &XIDFreshness.lastInSubFrame);
+	XIDFreshness.lastReportAge = Now - BankSampleMicros;
+	HistogramAdd(XIDFreshness.pollInterval, (Now - LastINMicros) / 1000);
+	HistogramAdd(XIDFreshness.reportAge, (Now - BankSampleMicros) >> 8);
+	LastINMicros = Now;
+
+	//Boot benchmark. millis() starts counting at power-on (after the bootloader), BankSampleMicros stays 0
+	//until the main loop has sampled a connected controller.
+	if (!XIDTelemetry.bootTime && BankSampleMicros && ConnectedXID == DUKE_CONTROLLER)
+		XIDTelemetry.bootTime = millis();
+}
+
+static void NoteOUT(void){
+	uint32_t Now = micros();
+	Stamp(&XIDFreshness.lastOutFrame, &XIDFreshness.lastOutSubFrame);
+	HistogramAdd(XIDFreshness.outInterval, (Now - LastOUTMicros) / 1000);
+	LastOUTMicros = Now;
+}
+
+//Called by the main loop after it reads the OUT endpoint. Stamps the report if the SOF handler hadn't seen it yet.
+void XID_OUTRead(void){
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		if (!OUTArrived)
+			NoteOUT();
+		OUTArrived = false;
+	}
+}
+
+
+//Switches the emulated XID device. Rather than a fixed long detach, the shortest detach window that still makes
+//the console re-enumerate is searched for: each switch tries halfway between the shortest window that has worked
+//and the longest one that hasn't. If the console doesn't enumerate in time, XID_SwitchTask() detaches again
+//with the known good window. Call XID_SwitchTask() every loop until XID_SwitchInProgress() returns false.
+//The known good and bad windows are kept in NVSettings, so the search carries on from where it was after a power cycle.
+static uint16_t SwitchWindowGood(void){
+	return NVSettings.switchWindowGood ? NVSettings.switchWindowGood : XID_SWITCH_WINDOW_MAX;
+}
+
+static void SetSwitchWindows(uint16_t Good, uint16_t Bad){
+	if (NVSettings.switchWindowGood == Good && NVSettings.switchWindowBad == Bad)
+		return;
+	NVSettings.switchWindowGood = Good;
+	NVSettings.switchWindowBad = Bad;
+	NV_Changed();
+}
+
+void XID_BeginSwitch(uint8_t xid){
+	uint16_t Good = SwitchWindowGood();
+	if (Good - NVSettings.switchWindowBad <= XID_SWITCH_WINDOW_STEP)
+		SwitchWindow = Good;
+	else
+		SwitchWindow = (Good + NVSettings.switchWindowBad) / 2;
+	if (SwitchWindow < XID_SWITCH_WINDOW_MIN)
+		SwitchWindow = XID_SWITCH_WINDOW_MIN;
+
+	//Both descriptor sets are in flash, so the new personality can be selected straight away. The console
+	//won't request anything until we re-attach.
+	USB_Detach();
+	enumerationComplete = false;
+	XID_SelectProfile(xid);
+	SwitchStart = SwitchTimer = timebase_now;
+	SwitchState = XID_SWITCH_DETACHED;
+	XIDTelemetry.switchRetries = 0;
+}
+
+void XID_SwitchTask(void){
+	switch (SwitchState){
+		case XID_SWITCH_DETACHED:
+		if (timebase_elapsed(SwitchTimer) >= SwitchWindow){
+			USB_Attach();
+			SwitchTimer = timebase_now;
+			SwitchState = XID_SWITCH_ENUMERATING;
+		}
 		break;
-		#ifdef SUPPORTBATTALION
-		case STEELBATTALION:
-		HID_Device_MillisecondElapsed(&SteelBattalion_HID_Interface);
+		case XID_SWITCH_ENUMERATING:
+		if (enumerationComplete){
+			if (SwitchWindow < SwitchWindowGood())
+				SetSwitchWindows(SwitchWindow, NVSettings.switchWindowBad);
+			XIDTelemetry.switchLatency = timebase_elapsed(SwitchStart);
+			XIDTelemetry.switchWindow = SwitchWindow;
+			XIDTelemetry.switchCount++;
+			SwitchState = XID_SWITCH_IDLE;
+		} else if (timebase_elapsed(SwitchTimer) > XID_SWITCH_ENUM_TIMEOUT){
+			//The console didn't see us go. Give up once even the longest window has failed (console probably off).
+			if (SwitchWindow >= XID_SWITCH_WINDOW_MAX){
+				SwitchState = XID_SWITCH_IDLE;
+				break;
+			}
+			//If the known good window failed too, start the search again from the top.
+			uint16_t Good = SwitchWindowGood();
+			if (SwitchWindow >= Good)
+				Good = XID_SWITCH_WINDOW_MAX;
+			SetSwitchWindows(Good, SwitchWindow);
+			SwitchWindow = Good;
+			XIDTelemetry.switchRetries++;
+			USB_Detach();
+			SwitchTimer = timebase_now;
+			SwitchState = XID_SWITCH_DETACHED;
+		}
 		break;
-		#endif
 	}
+}
 
-
+bool XID_SwitchInProgress(void){
+	return SwitchState != XID_SWITCH_IDLE;
 }
 
 
@@ -211,54 +505,15 @@ bool CALLBACK_HID_Device_CreateHIDReport(USB_ClassInfo_HID_Device_t* const HIDIn
 													uint8_t* const ReportID, const uint8_t ReportType,
 													void* ReportData,	uint16_t* const ReportSize){
 
-	USB_XboxGamepad_Data_t* DukeReport = (USB_XboxGamepad_Data_t*)ReportData;
-	#ifdef SUPPORTBATTALION
-	USB_XboxSteelBattalion_Data_t* BattalionReport = (USB_XboxSteelBattalion_Data_t*)ReportData;
-	#endif
+	//Every XID input report is startByte, bLength then the data, so the published snapshot can be sent as is.
+	uint8_t Size = XIDProfileByte(reportSize);
+	memcpy(ReportData, PublishedReport, Size);
+	((uint8_t*)ReportData)[0] = 0x00;
+	((uint8_t*)ReportData)[1] = Size;
+	*ReportSize = Size;
 
-	switch (ConnectedXID){
-		case DUKE_CONTROLLER:
-		DukeReport->startByte = 0x00;
-		DukeReport->bLength = 20;
-		DukeReport->dButtons = XboxOGDuke[0].dButtons;
-		DukeReport->reserved = 0x00;
-		DukeReport->A = XboxOGDuke[0].A;
-		DukeReport->B = XboxOGDuke[0].B;
-		DukeReport->X = XboxOGDuke[0].X;
-		DukeReport->Y = XboxOGDuke[0].Y;
-		DukeReport->BLACK = XboxOGDuke[0].BLACK;
-		DukeReport->WHITE = XboxOGDuke[0].WHITE;
-		DukeReport->L = XboxOGDuke[0].L;
-		DukeReport->R = XboxOGDuke[0].R;
-		DukeReport->leftStickX = XboxOGDuke[0].leftStickX;
-		DukeReport->leftStickY = XboxOGDuke[0].leftStickY;
-		DukeReport->rightStickX = XboxOGDuke[0].rightStickX;
-		DukeReport->rightStickY = XboxOGDuke[0].rightStickY;
-		*ReportSize = DukeReport->bLength;
-		break;
-		#ifdef SUPPORTBATTALION
-		case STEELBATTALION:
-		BattalionReport->startByte = 0x00;
-		BattalionReport->bLength = 26;
-		BattalionReport->dButtons[0] = XboxOGSteelBattalion.dButtons[0];
-		BattalionReport->dButtons[1] = XboxOGSteelBattalion.dButtons[1];
-		BattalionReport->dButtons[2] = XboxOGSteelBattalion.dButtons[2];
-		BattalionReport->aimingX = XboxOGSteelBattalion.aimingX;
-		BattalionReport->aimingY = XboxOGSteelBattalion.aimingY;
-		BattalionReport->rotationLever = XboxOGSteelBattalion.rotationLever;
-		BattalionReport->sightChangeX = XboxOGSteelBattalion.sightChangeX;
-		BattalionReport->sightChangeY = XboxOGSteelBattalion.sightChangeY;
-		BattalionReport->leftPedal = XboxOGSteelBattalion.leftPedal;
-		BattalionReport->middlePedal = XboxOGSteelBattalion.middlePedal;
-		BattalionReport->rightPedal = XboxOGSteelBattalion.rightPedal;
-		BattalionReport->tunerDial = XboxOGSteelBattalion.tunerDial;
-		BattalionReport->gearLever = XboxOGSteelBattalion.gearLever;
-		*ReportSize = BattalionReport->bLength;
-		break;
-		#endif
-	}
-
-	return false;
+	//When overclocked every poll gets the newest sample, even if nothing has changed.
+	return XIDOverclock || ReportUnsent;
 }
 
 
@@ -272,10 +527,13 @@ void CALLBACK_HID_Device_ProcessHIDReport(
 	//Only expect one HID report from the host and this is the actuator levels. The command is always 6 bytes long.
 	//bit 3 is the left actuator value, bit 5 is the right actuator level.
 	//See http://euc.jp/periphs/xbox-controller.en.html - Output Report
-	if (ConnectedXID == DUKE_CONTROLLER && ReportSize == 0x06) {
+	//This can run from the control endpoint interrupt. The main loop takes the actuator pair and clears
+	//rumbleUpdate inside an atomic block, so no extra protection is needed here.
+	if (HIDInterfaceInfo == &DukeController_HID_Interface && ReportSize == 0x06) {
 		XboxOGDuke[0].left_actuator =  ((uint8_t *)ReportData)[3];
 		XboxOGDuke[0].right_actuator = ((uint8_t *)ReportData)[5];
 		XboxOGDuke[0].rumbleUpdate = 1;
+		NoteOUT();
 	}
 
 }
@@ -294,33 +552,16 @@ uint16_t CALLBACK_USB_GetDescriptor(
 	switch (DescriptorType)
 	{
 		case DTYPE_Device:
-		switch (ConnectedXID){
-			case DUKE_CONTROLLER:
-			Address = &DUKE_USB_DESCRIPTOR_DEVICE;
-			Size    = 18;
-			break;
-			#ifdef SUPPORTBATTALION
-			case STEELBATTALION:
-			Address = &BATTALION_USB_DESCRIPTOR_DEVICE;
-			Size    = 18;
-			break;
-			#endif
-		}
+		Address = XIDProfilePtr(deviceDescriptor);
+		Size    = 18;
 		break;
 		case DTYPE_Configuration:
-
-		switch (ConnectedXID){
-			case DUKE_CONTROLLER:
-			Address = &DUKE_USB_DESCRIPTOR_CONFIGURATION;
-			Size    = 32;
-			break;
-			#ifdef SUPPORTBATTALION
-			case STEELBATTALION:
-			Address = &BATTALION_USB_DESCRIPTOR_CONFIGURATION;
-			Size    = 32;
-			break;
-			#endif
-		}
+		#ifdef SUPPORTOVERCLOCK
+		Address = XIDOverclock ? XIDProfilePtr(configDescriptorFast) : XIDProfilePtr(configDescriptor);
+		#else
+		Address = XIDProfilePtr(configDescriptor);
+		#endif
+		Size    = XIDProfileByte(configDescriptorSize);
 		break;
 		case DTYPE_String:
 		Address = &nullString; //OG Xbox controller doesn't use these.
@@ -39,6 +39,7 @@ this software.
 /* Includes: */
 #include <avr/wdt.h>
 #include <avr/power.h>
+#include <util/atomic.h>
 #include <LUFAConfig.h>
 #include <LUFA/LUFA/Drivers/USB/USB.h>
 #include "dukecontroller.h"
@@ -48,6 +49,95 @@ this software.
 #define DUKE_CONTROLLER 0
 #define STEELBATTALION 1
 
+//Vendor request (bmRequestType 0xC1) used to read back XID_Telemetry_t. The console never sends this, it's for debugging from a PC.
+#define XID_REQUEST_TELEMETRY 0x50
+
+//Frames between IN reports at the genuine 4ms bInterval
+#define XID_POLL_FRAMES 4
+
+//Personality switch detach window search (ms). XID_SWITCH_WINDOW_MAX is the old fixed 500ms detach which every console accepts.
+#define XID_SWITCH_WINDOW_MIN 10
+#define XID_SWITCH_WINDOW_MAX 500
+#define XID_SWITCH_WINDOW_STEP 5 //Stop searching once the known good and known bad windows are this close
+#define XID_SWITCH_ENUM_TIMEOUT 1000 //If the console hasn't enumerated us this long after re-attaching, the window was too short
+
+#define XID_SWITCH_IDLE 0
+#define XID_SWITCH_DETACHED 1
+#define XID_SWITCH_ENUMERATING 2
+
+#ifdef SUPPORTBATTALION
+#define XID_MAX_REPORT_SIZE 26
+#else
+#define XID_MAX_REPORT_SIZE 20
+#endif
+
+//Everything that differs between the emulated XID devices. Entries live in flash (see xiddevice.c),
+//so all pointers except hidInterface and report point to PROGMEM data.
+typedef struct
+{
+	const uint8_t* deviceDescriptor;
+	const uint8_t* configDescriptor;
+	#ifdef SUPPORTOVERCLOCK
+	const uint8_t* configDescriptorFast;
+	#endif
+	const uint8_t* xidDescriptor;
+	const uint8_t* capabilitiesIn;
+	const uint8_t* capabilitiesOut;
+	uint8_t configDescriptorSize;
+	uint8_t capabilitiesInSize;
+	uint8_t capabilitiesOutSize;
+	uint8_t outEndpointAddress; //Host OUT endpoint, opened manually
+	uint8_t outEndpointSize;
+	USB_ClassInfo_HID_Device_t* hidInterface;
+	const void* report; //Input report built by the main loop, sent to the console as the first reportSize bytes
+	uint8_t reportSize;
+} XID_Profile_t;
+
+#define XID_TELEMETRY_GENERAL 0 //wValue of XID_REQUEST_TELEMETRY selects the block to read
+#define XID_TELEMETRY_FRESHNESS 1
+
+#define XID_HISTOGRAM_BINS 8
+
+#define XID_FRAME_PHASES 5 //Phases of the main loop's 1ms frame, see FRAME_PHASE_* in main.cpp
+
+typedef struct
+{
+	uint16_t switchLatency; //ms from USB_Detach() to the console configuring the new personality, last switch
+	uint16_t switchWindow; //Detach window used by the last successful switch
+	uint8_t switchRetries; //Number of times the last switch had to fall back to a longer window
+	uint8_t switchCount;
+	uint16_t reportRate; //IN reports actually collected by the console in the last second
+	uint16_t loopRate; //Main loop frames in the last second. Each of players 2-4 gets a refresh and rumble read every third frame
+	uint8_t pollFrames; //Current frame gate between IN reports
+	uint16_t bootTime; //ms from power-on to the console collecting the first report with player 1's input in it, 0 until then
+	uint16_t configureTime[4]; //ms the last hub, wireless receiver, wired 360 pad and Xbox One pad took to configure (USB host side)
+	uint16_t controlRate; //USB host control transfers in the last second
+	uint16_t loopTimeMax; //Longest frame in the last second, us from the frame starting to its last phase finishing
+	uint16_t frameOverruns; //Frames that started late because the previous one ran past the next SOF, since power-on
+	uint16_t phaseTimeMax[XID_FRAME_PHASES]; //Longest run of each frame phase in the last second (us)
+	uint16_t phaseOverruns[XID_FRAME_PHASES]; //Times each phase went over its budget, since power-on
+	uint16_t xferTimeouts; //USB host transfer errors since power-on, see USB_XFER_STATS
+	uint16_t xferNakLimits;
+	uint16_t xferToggleErrors;
+	uint16_t xferBackoffs;
+	uint16_t slaveReportRate[3]; //Reports delivered to the slaves for players 2-4 in the last second (master only)
+} XID_Telemetry_t;
+
+//Console side timing. Events are stamped with the SOF frame number and the time in us since that SOF.
+//Histogram bins are powers of two: bin n counts values from 2^n up to 2^(n+1) units, bin 0 also counts 0
+//and the last bin counts everything above. Bins saturate at 0xFFFF.
+typedef struct
+{
+	uint16_t lastInFrame; //Last IN report collected by the console
+	uint16_t lastInSubFrame;
+	uint16_t lastOutFrame; //Last OUT report (rumble/feedback) received from the console
+	uint16_t lastOutSubFrame;
+	uint16_t lastReportAge; //us from the input sample to the console collecting the report
+	uint16_t pollInterval[XID_HISTOGRAM_BINS]; //ms between IN reports being collected
+	uint16_t reportAge[XID_HISTOGRAM_BINS]; //256us units, input sample to collection
+	uint16_t outInterval[XID_HISTOGRAM_BINS]; //ms between rumble/feedback commands
+} XID_Freshness_t;
+
 /* Function Prototypes: */
 #ifdef __cplusplus
 extern "C" {
@@ -73,6 +163,18 @@ extern "C" {
 	const uint8_t ReportType,
 	const void* ReportData,
 	const uint16_t ReportSize);
+	void PublishHIDReport(void);
+	void XID_SelectProfile(uint8_t xid);
+	USB_ClassInfo_HID_Device_t* XID_HIDInterface(void);
+	void XID_USBTask(void);
+	void XID_SetOverclock(bool enable);
+	void XID_MarkSample(void);
+	void XID_ReportChanged(void);
+	uint8_t XID_FrameCount(void);
+	void XID_OUTRead(void);
+	void XID_BeginSwitch(uint8_t xid);
+	void XID_SwitchTask(void);
+	bool XID_SwitchInProgress(void);
 
 	
 
@@ -84,8 +186,14 @@ extern "C" {
 	extern USB_XboxSteelBattalion_Data_t XboxOGSteelBattalion;
 	extern USB_XboxSteelBattalion_Feedback_t XboxOGSteelBattalionFeedback;
 	#endif
-	extern bool enumerationComplete;
+	//The control endpoint is serviced from the USB interrupt (INTERRUPT_CONTROL_ENDPOINT), so anything shared
+	//with the control request handlers is volatile and is only changed as a whole inside an ATOMIC_BLOCK.
+	extern volatile bool enumerationComplete;
+	extern volatile uint8_t ConnectedXID;
 	extern uint8_t playerID;
+	extern XID_Telemetry_t XIDTelemetry;
+	extern XID_Freshness_t XIDFreshness;
+	extern volatile bool XIDOverclock;
 	#ifdef __cplusplus
 }
 #endif
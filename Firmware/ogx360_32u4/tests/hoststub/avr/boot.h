@@ -0,0 +1,13 @@
+/* avr/boot.h for the host test build. */
+
+#ifndef HOSTSTUB_AVR_BOOT_H_
+#define HOSTSTUB_AVR_BOOT_H_
+
+#define GET_LOW_FUSE_BITS 0
+#define GET_LOCK_BITS 1
+#define GET_EXTENDED_FUSE_BITS 2
+#define GET_HIGH_FUSE_BITS 3
+#define boot_signature_byte_get(a) 0
+#define boot_lock_fuse_bits_get(a) 0
+
+#endif /* HOSTSTUB_AVR_BOOT_H_ */
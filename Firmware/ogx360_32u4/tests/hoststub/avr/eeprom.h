@@ -0,0 +1,29 @@
+/* avr/eeprom.h for the host test build. */
+
+#ifndef HOSTSTUB_AVR_EEPROM_H_
+#define HOSTSTUB_AVR_EEPROM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define EEMEM
+#define eeprom_is_ready() 1
+#define eeprom_busy_wait() do{}while(0)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+uint8_t eeprom_read_byte(const uint8_t *p);
+uint16_t eeprom_read_word(const uint16_t *p);
+void eeprom_read_block(void *dst, const void *src, size_t n);
+void eeprom_write_byte(uint8_t *p, uint8_t value);
+void eeprom_write_word(uint16_t *p, uint16_t value);
+void eeprom_write_block(const void *src, void *dst, size_t n);
+void eeprom_update_byte(uint8_t *p, uint8_t value);
+void eeprom_update_word(uint16_t *p, uint16_t value);
+void eeprom_update_block(const void *src, void *dst, size_t n);
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOSTSTUB_AVR_EEPROM_H_ */
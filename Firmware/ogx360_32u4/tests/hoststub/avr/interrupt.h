@@ -0,0 +1,20 @@
+/* avr/interrupt.h for the host test build. ISR(v) defines a plain function named after the vector. */
+
+#ifndef HOSTSTUB_AVR_INTERRUPT_H_
+#define HOSTSTUB_AVR_INTERRUPT_H_
+
+#include <avr/io.h>
+
+#ifdef __cplusplus
+#define ISR(v, ...) extern "C" void v(void); extern "C" void v(void)
+#else
+#define ISR(v, ...) void v(void); void v(void)
+#endif
+#define SIGNAL ISR
+#define ISR_BLOCK
+#define ISR_NOBLOCK
+#define ISR_ALIASOF(v)
+#define sei() do{}while(0)
+#define cli() do{}while(0)
+
+#endif /* HOSTSTUB_AVR_INTERRUPT_H_ */
@@ -0,0 +1,439 @@
+/*
+* avr/io.h for the host test build.
+*
+* Just enough of avr-libc for the firmware to compile on the host so its call graph can be checked, nothing here
+* is meant to run. Register addresses and bit numbers are made up.
+*/
+
+#ifndef HOSTSTUB_AVR_IO_H_
+#define HOSTSTUB_AVR_IO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define _SFR_MEM8(a) (*(volatile uint8_t*)(uintptr_t)(a))
+#define _SFR_MEM16(a) (*(volatile uint16_t*)(uintptr_t)(a))
+#define _SFR_IO8(a) _SFR_MEM8(a)
+#define _SFR_BYTE(s) (s)
+#define _SFR_WORD(s) (s)
+#define _SFR_ADDR(s) ((uintptr_t)&(s))
+#define _SFR_MEM_ADDR(s) ((uintptr_t)&(s))
+#define _BV(b) (1<<(b))
+#define bit_is_set(s,b) ((s)&_BV(b))
+#define bit_is_clear(s,b) (!((s)&_BV(b)))
+#define loop_until_bit_is_set(s,b) do{}while(bit_is_clear(s,b))
+
+#define E2END 0x3FF
+#define RAMEND 0xAFF
+#define FLASHEND 0x7FFF
+#define SPM_PAGESIZE 128
+#define SIGNATURE_0 0x1E
+#define SIGNATURE_1 0x95
+#define SIGNATURE_2 0x87
+
+#define INT6_vect __vector_7
+#define USB_GEN_vect __vector_10
+#define USB_COM_vect __vector_11
+#define TIMER0_OVF_vect __vector_23
+#define USART1_RX_vect __vector_25
+#define USART1_UDRE_vect __vector_26
+#define USART1_TX_vect __vector_27
+#define ADC_vect __vector_29
+#define TIMER3_COMPA_vect __vector_32
+#define TIMER3_OVF_vect __vector_35
+#define TWI_vect __vector_36
+
+//Registers
+#define PLLCSR _SFR_MEM8(0x20)
+#define SREG _SFR_MEM8(0x21)
+#define UDADDR _SFR_MEM8(0x22)
+#define UDCON _SFR_MEM8(0x23)
+#define UDIEN _SFR_MEM8(0x24)
+#define UDINT _SFR_MEM8(0x25)
+#define UEBCHX _SFR_MEM8(0x26)
+#define UEBCLX _SFR_MEM8(0x27)
+#define UECFG0X _SFR_MEM8(0x28)
+#define UECFG1X _SFR_MEM8(0x29)
+#define UECONX _SFR_MEM8(0x2A)
+#define UEDATX _SFR_MEM8(0x2B)
+#define UEIENX _SFR_MEM8(0x2C)
+#define UEINT _SFR_MEM8(0x2D)
+#define UEINTX _SFR_MEM8(0x2E)
+#define UENUM _SFR_MEM8(0x2F)
+#define UERST _SFR_MEM8(0x30)
+#define UESTA0X _SFR_MEM8(0x31)
+#define UESTA1X _SFR_MEM8(0x32)
+#define UHWCON _SFR_MEM8(0x33)
+#define USBCON _SFR_MEM8(0x34)
+#define USBINT _SFR_MEM8(0x35)
+#define USBSTA _SFR_MEM8(0x36)
+#define UDMFN _SFR_MEM8(0x37)
+#define UDFNUML _SFR_MEM8(0x38)
+#define UDFNUMH _SFR_MEM8(0x39)
+#define PORTB _SFR_MEM8(0x3A)
+#define PORTC _SFR_MEM8(0x3B)
+#define PORTD _SFR_MEM8(0x3C)
+#define PORTE _SFR_MEM8(0x3D)
+#define PORTF _SFR_MEM8(0x3E)
+#define DDRB _SFR_MEM8(0x3F)
+#define DDRC _SFR_MEM8(0x40)
+#define DDRD _SFR_MEM8(0x41)
+#define DDRE _SFR_MEM8(0x42)
+#define DDRF _SFR_MEM8(0x43)
+#define PINB _SFR_MEM8(0x44)
+#define PINC _SFR_MEM8(0x45)
+#define PIND _SFR_MEM8(0x46)
+#define PINE _SFR_MEM8(0x47)
+#define PINF _SFR_MEM8(0x48)
+#define SPCR _SFR_MEM8(0x49)
+#define SPSR _SFR_MEM8(0x4A)
+#define SPDR _SFR_MEM8(0x4B)
+#define UBRR1H _SFR_MEM8(0x4C)
+#define UBRR1L _SFR_MEM8(0x4D)
+#define UCSR1A _SFR_MEM8(0x4E)
+#define UCSR1B _SFR_MEM8(0x4F)
+#define UCSR1C _SFR_MEM8(0x50)
+#define UCSR1D _SFR_MEM8(0x51)
+#define UDR1 _SFR_MEM8(0x52)
+#define TWBR _SFR_MEM8(0x53)
+#define TWSR _SFR_MEM8(0x54)
+#define TWAR _SFR_MEM8(0x55)
+#define TWDR _SFR_MEM8(0x56)
+#define TWCR _SFR_MEM8(0x57)
+#define TWAMR _SFR_MEM8(0x58)
+#define TCCR0A _SFR_MEM8(0x59)
+#define TCCR0B _SFR_MEM8(0x5A)
+#define TIMSK0 _SFR_MEM8(0x5B)
+#define TCNT0 _SFR_MEM8(0x5C)
+#define TIFR0 _SFR_MEM8(0x5D)
+#define OCR0A _SFR_MEM8(0x5E)
+#define OCR0B _SFR_MEM8(0x5F)
+#define TCCR1A _SFR_MEM8(0x60)
+#define TCCR1B _SFR_MEM8(0x61)
+#define TCCR1C _SFR_MEM8(0x62)
+#define TIMSK1 _SFR_MEM8(0x63)
+#define TIFR1 _SFR_MEM8(0x64)
+#define TCCR3A _SFR_MEM8(0x65)
+#define TCCR3B _SFR_MEM8(0x66)
+#define TCCR3C _SFR_MEM8(0x67)
+#define TIMSK3 _SFR_MEM8(0x68)
+#define TIFR3 _SFR_MEM8(0x69)
+#define TCCR4A _SFR_MEM8(0x6A)
+#define TCCR4B _SFR_MEM8(0x6B)
+#define TCCR4C _SFR_MEM8(0x6C)
+#define TCCR4D _SFR_MEM8(0x6D)
+#define TCCR4E _SFR_MEM8(0x6E)
+#define TC4H _SFR_MEM8(0x6F)
+#define OCR4A _SFR_MEM8(0x70)
+#define OCR4B _SFR_MEM8(0x71)
+#define OCR4C _SFR_MEM8(0x72)
+#define OCR4D _SFR_MEM8(0x73)
+#define TIMSK4 _SFR_MEM8(0x74)
+#define TCNT4 _SFR_MEM8(0x75)
+#define ADCSRA _SFR_MEM8(0x76)
+#define ADCSRB _SFR_MEM8(0x77)
+#define ADMUX _SFR_MEM8(0x78)
+#define ADCL _SFR_MEM8(0x79)
+#define ADCH _SFR_MEM8(0x7A)
+#define DIDR0 _SFR_MEM8(0x7B)
+#define DIDR2 _SFR_MEM8(0x7C)
+#define EECR _SFR_MEM8(0x7D)
+#define EEDR _SFR_MEM8(0x7E)
+#define MCUSR _SFR_MEM8(0x7F)
+#define MCUCR _SFR_MEM8(0x80)
+#define WDTCSR _SFR_MEM8(0x81)
+#define CLKPR _SFR_MEM8(0x82)
+#define SMCR _SFR_MEM8(0x83)
+#define PRR0 _SFR_MEM8(0x84)
+#define PRR1 _SFR_MEM8(0x85)
+#define EICRA _SFR_MEM8(0x86)
+#define EICRB _SFR_MEM8(0x87)
+#define EIMSK _SFR_MEM8(0x88)
+#define EIFR _SFR_MEM8(0x89)
+#define PCICR _SFR_MEM8(0x8A)
+#define PCMSK0 _SFR_MEM8(0x8B)
+#define GPIOR0 _SFR_MEM8(0x8C)
+#define ACSR _SFR_MEM8(0x8D)
+#define OSCCAL _SFR_MEM8(0x8E)
+#define RAMPZ _SFR_MEM8(0x8F)
+#define SPMCSR _SFR_MEM8(0x90)
+#define EEARL _SFR_MEM8(0x91)
+#define EEARH _SFR_MEM8(0x92)
+#define PLLFRQ _SFR_MEM8(0x93)
+
+//16 bit registers
+#define UDFNUM _SFR_MEM16(0x94)
+#define TCNT1 _SFR_MEM16(0x96)
+#define TCNT3 _SFR_MEM16(0x98)
+#define OCR1A _SFR_MEM16(0x9A)
+#define OCR1B _SFR_MEM16(0x9C)
+#define OCR1C _SFR_MEM16(0x9E)
+#define OCR3A _SFR_MEM16(0xA0)
+#define OCR3B _SFR_MEM16(0xA2)
+#define OCR3C _SFR_MEM16(0xA4)
+#define ICR1 _SFR_MEM16(0xA6)
+#define ICR3 _SFR_MEM16(0xA8)
+#define ADC _SFR_MEM16(0xAA)
+#define ADCW _SFR_MEM16(0xAC)
+#define UBRR1 _SFR_MEM16(0xAE)
+#define EEAR _SFR_MEM16(0xB0)
+
+//Bits
+#define ADDEN 0
+#define ALLOC 1
+#define CFGOK 2
+#define DETACH 3
+#define EORSTE 4
+#define EORSTI 5
+#define EPBK0 6
+#define EPBK1 7
+#define EPDIR 0
+#define EPEN 1
+#define EPSIZE0 2
+#define EPSIZE1 3
+#define EPSIZE2 4
+#define EPTYPE0 5
+#define EPTYPE1 6
+#define FIFOCON 7
+#define FRZCLK 0
+#define LSM 1
+#define NBUSYBK0 2
+#define NBUSYBK1 3
+#define OTGPADE 4
+#define PINDIV 5
+#define PLLE 6
+#define PLOCK 7
+#define RSTDT 0
+#define RWAL 1
+#define RXOUTI 2
+#define RXSTPE 3
+#define RXSTPI 4
+#define SOFE 5
+#define SOFI 6
+#define STALLRQ 7
+#define STALLRQC 0
+#define SUSPE 1
+#define SUSPI 2
+#define TXINI 3
+#define USBE 4
+#define UVREGE 5
+#define VBUS 6
+#define VBUSTE 7
+#define VBUSTI 0
+#define WAKEUPE 1
+#define WAKEUPI 2
+#define UPRSME 3
+#define UPRSMI 4
+#define EORSME 5
+#define EORSMI 6
+#define STALLEDI 7
+#define STALLEDE 0
+#define NAKOUTI 1
+#define NAKINI 2
+#define NAKOUTE 3
+#define NAKINE 4
+#define TXINE 5
+#define RXOUTE 6
+#define FLERRE 7
+#define UIMOD 0
+#define UIDE 1
+#define ID 2
+#define IDTE 3
+#define IDTI 4
+#define OTGEN 5
+#define RMWKUP 6
+#define UPUSBE 7
+#define SPIF 0
+#define SPE 1
+#define MSTR 2
+#define SPR0 3
+#define SPR1 4
+#define SPI2X 5
+#define CPOL 6
+#define CPHA 7
+#define DORD 0
+#define SPIE 1
+#define WCOL 2
+#define RXEN1 3
+#define TXEN1 4
+#define RXCIE1 5
+#define UDRIE1 6
+#define TXCIE1 7
+#define U2X1 0
+#define UPE1 1
+#define TXC1 2
+#define RXC1 3
+#define UDRE1 4
+#define UCSZ10 1
+#define UCSZ11 2
+#define UCSZ12 7
+#define FE1 0
+#define DOR1 1
+#define USBS1 2
+#define UPM10 3
+#define UPM11 4
+#define TWINT 5
+#define TWEA 6
+#define TWSTA 7
+#define TWSTO 0
+#define TWEN 1
+#define TWIE 2
+#define TWWC 3
+#define TWPS0 4
+#define TWPS1 5
+#define TOIE0 6
+#define CS00 7
+#define CS01 0
+#define CS02 1
+#define WGM00 2
+#define WGM01 3
+#define WGM02 4
+#define TOV0 5
+#define OCIE0A 6
+#define OCF0A 7
+#define COM0A1 0
+#define COM0B1 1
+#define COM0A0 2
+#define COM0B0 3
+#define CS10 4
+#define CS11 5
+#define CS12 6
+#define WGM10 7
+#define WGM11 0
+#define WGM12 1
+#define WGM13 2
+#define TOIE1 3
+#define OCIE1A 4
+#define OCF1A 5
+#define TOV1 6
+#define COM1A1 7
+#define COM1B1 0
+#define COM1C1 1
+#define CS30 2
+#define CS31 3
+#define CS32 4
+#define WGM30 5
+#define WGM31 6
+#define WGM32 7
+#define WGM33 0
+#define TOIE3 1
+#define OCIE3A 2
+#define OCIE3B 3
+#define OCF3A 4
+#define OCF3B 5
+#define TOV3 6
+#define COM3A1 7
+#define CS40 0
+#define CS41 1
+#define CS42 2
+#define CS43 3
+#define PWM4A 4
+#define PWM4B 5
+#define PWM4D 6
+#define COM4A1 7
+#define COM4B1 0
+#define COM4D1 1
+#define TOIE4 2
+#define ADEN 3
+#define ADSC 4
+#define ADPS0 5
+#define ADPS1 6
+#define ADPS2 7
+#define ADIF 0
+#define ADATE 1
+#define ADLAR 2
+#define REFS0 3
+#define REFS1 4
+#define MUX5 5
+#define ADIE 6
+#define EERE 7
+#define EEPE 0
+#define EEMPE 1
+#define EERIE 2
+#define EEWE 3
+#define EEMWE 4
+#define WDRF 5
+#define BORF 6
+#define EXTRF 7
+#define PORF 0
+#define WDCE 1
+#define WDE 2
+#define WDIE 3
+#define WDP0 4
+#define WDP1 5
+#define WDP2 6
+#define WDP3 7
+#define WDIF 0
+#define CLKPCE 1
+#define SE 2
+#define SM0 3
+#define SM1 4
+#define SM2 5
+#define JTD 6
+#define PUD 7
+#define IVCE 0
+#define IVSEL 1
+#define PB0 2
+#define PB1 3
+#define PB2 4
+#define PB3 5
+#define PB4 6
+#define PB5 7
+#define PB6 0
+#define PB7 1
+#define PC6 2
+#define PC7 3
+#define PD0 4
+#define PD1 5
+#define PD2 6
+#define PD3 7
+#define PD4 0
+#define PD5 1
+#define PD6 2
+#define PD7 3
+#define PE2 4
+#define PE6 5
+#define PF0 6
+#define PF1 7
+#define PF4 0
+#define PF5 1
+#define PF6 2
+#define PF7 3
+#define PORTB0 4
+#define PORTB1 5
+#define PORTB2 6
+#define PORTB3 7
+#define PORTB4 0
+#define PORTB5 1
+#define PORTB6 2
+#define PORTB7 3
+#define PORTD0 4
+#define PORTD1 5
+#define PORTD2 6
+#define PORTD3 7
+#define PORTD4 0
+#define PORTD5 1
+#define PORTD6 2
+#define PORTD7 3
+#define PORTC6 4
+#define PORTC7 5
+#define PORTE6 6
+#define PORTE2 7
+#define PORTF0 0
+#define PORTF1 1
+#define PORTF4 2
+#define PORTF5 3
+#define PORTF6 4
+#define PORTF7 5
+#define INT0 6
+#define INT1 7
+#define INT2 0
+#define INT3 1
+#define INT6 2
+#define PDIV2 3
+#define SREG_I 4
+#define WGM40 5
+#define EEPM0 6
+#define EEPM1 7
+
+#endif /* HOSTSTUB_AVR_IO_H_ */
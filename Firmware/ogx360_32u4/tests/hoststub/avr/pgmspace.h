@@ -0,0 +1,28 @@
+/* avr/pgmspace.h for the host test build. Flash is ordinary memory on the host. */
+
+#ifndef HOSTSTUB_AVR_PGMSPACE_H_
+#define HOSTSTUB_AVR_PGMSPACE_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PGM_P const char*
+#define PSTR(s) (s)
+#define pgm_read_byte(a) (*(const uint8_t*)(a))
+#define pgm_read_word(a) (*(const uint16_t*)(a))
+#define pgm_read_dword(a) (*(const uint32_t*)(a))
+#define pgm_read_ptr(a) (*(void* const*)(a))
+#define pgm_read_byte_near pgm_read_byte
+#define pgm_read_word_near pgm_read_word
+#define pgm_read_byte_far pgm_read_byte
+#define memcpy_P memcpy
+#define memcmp_P memcmp
+#define strlen_P strlen
+#define strcpy_P strcpy
+#define strncpy_P strncpy
+#define strcmp_P strcmp
+typedef char prog_char;
+typedef uint8_t prog_uint8_t;
+
+#endif /* HOSTSTUB_AVR_PGMSPACE_H_ */
@@ -0,0 +1,9 @@
+/* avr/power.h for the host test build. */
+
+#ifndef HOSTSTUB_AVR_POWER_H_
+#define HOSTSTUB_AVR_POWER_H_
+
+#define clock_div_1 0
+#define clock_prescale_set(d) do{}while(0)
+
+#endif /* HOSTSTUB_AVR_POWER_H_ */
@@ -0,0 +1,22 @@
+/*
+* hoststub.h
+*
+* Forced into every file of the host test build (-include). The avr-libc stdlib extensions the Arduino core uses.
+*/
+
+#ifndef HOSTSTUB_H_
+#define HOSTSTUB_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+char *itoa(int value, char *s, int radix);
+char *utoa(unsigned value, char *s, int radix);
+char *ltoa(long value, char *s, int radix);
+char *ultoa(unsigned long value, char *s, int radix);
+char *dtostrf(double value, signed char width, unsigned char prec, char *s);
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HOSTSTUB_H_ */
@@ -0,0 +1,13 @@
+/* util/atomic.h for the host test build. */
+
+#ifndef HOSTSTUB_UTIL_ATOMIC_H_
+#define HOSTSTUB_UTIL_ATOMIC_H_
+
+#define ATOMIC_BLOCK(type) for(int hostStubAtomic=1; hostStubAtomic; hostStubAtomic=0)
+#define NONATOMIC_BLOCK(type) ATOMIC_BLOCK(type)
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_FORCEON
+#define NONATOMIC_RESTORESTATE
+#define NONATOMIC_FORCEOFF
+
+#endif /* HOSTSTUB_UTIL_ATOMIC_H_ */
@@ -0,0 +1,9 @@
+/* util/delay.h for the host test build. */
+
+#ifndef HOSTSTUB_UTIL_DELAY_H_
+#define HOSTSTUB_UTIL_DELAY_H_
+
+static inline void _delay_ms(double ms){ (void)ms; }
+static inline void _delay_us(double us){ (void)us; }
+
+#endif /* HOSTSTUB_UTIL_DELAY_H_ */
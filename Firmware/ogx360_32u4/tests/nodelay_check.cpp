@@ -0,0 +1,146 @@
+/*
+* nodelay_check.cpp
+*
+* Fails if delay() can be reached from the steady-state loop. Reads the call graphs gcc writes with
+* -fcallgraph-info for every firmware file (see make nodelay) and walks them from:
+*  - the calls main() makes from loopLine of loopFile on, which is where the main loop starts,
+*  - every interrupt handler (__vector_n),
+*  - and once anything reachable calls through a pointer (timer callbacks, USB driver Poll()), every function
+*    nothing calls directly, since those can only be reached that way.
+* Setup code that runs before the loop can still use delay().
+*
+* Usage: nodelay_check loopFile loopLine file.ci...
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <deque>
+
+struct Edge {
+	std::string to;
+	std::string site; //file:line:col of the call
+};
+
+static std::map<std::string, std::vector<Edge> > calls;
+static std::set<std::string> defined; //Functions with a body somewhere, as opposed to just declared
+static std::set<std::string> calledDirectly;
+static std::map<std::string, std::string> labels; //Readable names for the report
+
+//Value of key: "..." in a .ci line, empty if it's not there
+static std::string field(const char* line, const char* key){
+	const char* p=strstr(line, key);
+	if(!p) return "";
+	p+=strlen(key);
+	const char* end=strchr(p, '"');
+	return end ? std::string(p, end-p) : "";
+}
+
+static bool readGraph(const char* path){
+	FILE* f=fopen(path, "r");
+	if(!f){
+		printf("nodelay_check: can't read %s\n", path);
+		return false;
+	}
+	char line[4096];
+	while(fgets(line, sizeof(line), f)){
+		if(!strncmp(line, "node:", 5)){
+			std::string title=field(line, "title: \"");
+			if(!strstr(line, "shape : ellipse"))
+				defined.insert(title);
+			std::string label=field(line, "label: \"");
+			size_t nl=label.find("\\n");
+			labels[title]=label.substr(0, nl);
+		} else if(!strncmp(line, "edge:", 5)){
+			Edge e;
+			e.to=field(line, "targetname: \"");
+			e.site=field(line, "label: \"");
+			calls[field(line, "sourcename: \"")].push_back(e);
+			calledDirectly.insert(e.to);
+		}
+	}
+	fclose(f);
+	return true;
+}
+
+//Line of a file:line:col call site, 0 if it's in another file
+static long siteLine(const std::string& site, const std::string& file){
+	if(site.compare(0, file.size()+1, file+":"))
+		return 0;
+	return atol(site.c_str()+file.size()+1);
+}
+
+static std::string name(const std::string& title){
+	std::map<std::string, std::string>::const_iterator l=labels.find(title);
+	return (l==labels.end() || l->second.empty()) ? title : l->second;
+}
+
+//Callers are kept by what they reached, so a failure can print the whole chain back to a root
+static std::map<std::string, Edge> reachedFrom;
+static std::deque<std::string> queue;
+
+static void reach(const std::string& function, const std::string& caller, const std::string& site){
+	if(reachedFrom.count(function))
+		return;
+	Edge by;
+	by.to=caller;
+	by.site=site;
+	reachedFrom[function]=by;
+	queue.push_back(function);
+}
+
+int main(int argc, char** argv){
+	if(argc<4){
+		printf("usage: nodelay_check loopFile loopLine file.ci...\n");
+		return 2;
+	}
+	std::string loopFile=argv[1];
+	long loopLine=atol(argv[2]);
+	for(int i=3; i<argc; i++)
+		if(!readGraph(argv[i]))
+			return 2;
+
+	std::vector<Edge>& loop=calls["main"];
+	for(size_t i=0; i<loop.size(); i++)
+		if(siteLine(loop[i].site, loopFile)>=loopLine)
+			reach(loop[i].to, "main", loop[i].site);
+	if(queue.empty()){
+		printf("nodelay_check: no calls from main() after %s:%ld, wrong loop line?\n", loopFile.c_str(), loopLine);
+		return 2;
+	}
+	for(std::set<std::string>::const_iterator n=defined.begin(); n!=defined.end(); ++n)
+		if(!n->compare(0, 9, "__vector_"))
+			reach(*n, "(interrupt)", "");
+
+	bool indirectRoots=false;
+	while(!queue.empty()){
+		std::string f=queue.front();
+		queue.pop_front();
+		if(f=="__indirect_call" && !indirectRoots){
+			indirectRoots=true;
+			for(std::set<std::string>::const_iterator n=defined.begin(); n!=defined.end(); ++n)
+				if(!calledDirectly.count(*n) && *n!="main")
+					reach(*n, "(call through a pointer)", "");
+		}
+		std::vector<Edge>& out=calls[f];
+		for(size_t i=0; i<out.size(); i++)
+			reach(out[i].to, f, out[i].site);
+	}
+
+	if(!reachedFrom.count("delay")){
+		printf("nodelay_check: delay() isn't reachable from the main loop (%u functions checked)\n", (unsigned)reachedFrom.size());
+		return 0;
+	}
+	printf("FAIL: delay() is reachable from the main loop:\n");
+	std::string f="delay";
+	for(unsigned depth=0; reachedFrom.count(f) && depth<64; depth++){
+		const Edge& by=reachedFrom[f];
+		printf("  %s -> %s %s\n", name(by.to).c_str(), name(f).c_str(), by.site.c_str());
+		f=by.to;
+	}
+	return 1;
+}
@@ -0,0 +1,103 @@
+/*
+* sbaim_test.cpp
+*
+* Host test for sbaim.h. Runs the same right stick movements through aimStep() at different loop periods
+* and checks the aim ends up in the same place whenever the loops line up, so aim speed doesn't depend on
+* how often main.cpp gets to the Steel Battalion mapping. Build and run with make in this directory.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "settings.h"
+#include "sbaim.h"
+
+#define SEGMENT_MS 210 //Every loop period below divides this, so they all sample the stick at the segment edges
+#define FLOW_MS ((uint32_t)SEGMENT_MS*SEGMENTS)
+
+typedef struct {
+	int16_t x, y;
+} StickSegment_t;
+
+//Each held for SEGMENT_MS. Runs into both clamps and back, and sits inside the deadzone for a while.
+static const StickSegment_t Stick[]={
+	{0, 0},
+	{32767, 0},
+	{-16384, 12000},
+	{SB_AIM_DEADZONE, -SB_AIM_DEADZONE},
+	{-32768, -32768},
+	{9000, -31000},
+	{32767, 32767}, {32767, 32767}, {32767, 32767}, {32767, 32767}, {32767, 32767}, {32767, 32767},
+	{-20000, -8000},
+	{-32768, 0}, {-32768, 0}, {-32768, 0}, {-32768, 0}, {-32768, 0}, {-32768, 0},
+	{-32768, 0}, {-32768, 0}, {-32768, 0}, {-32768, 0}, {-32768, 0}, {-32768, 0},
+	{7501, -7501},
+};
+#define SEGMENTS (sizeof(Stick)/sizeof(Stick[0]))
+
+static const uint16_t Periods[]={1, 2, 3, 5, 6, 7, 10, 14, 15, 21, 30, 35, 42};
+static const uint16_t Sensitivities[]={128, 200, 250, 300, 350, 400, 650, 800, 1000, 1200};
+
+static int failures;
+
+static void check(bool ok, const char* what, uint16_t sensitivity, uint16_t period, uint32_t t){
+	if(!ok){
+		printf("FAIL: %s (sensitivity %u, %ums loop, t=%lums)\n", what, sensitivity, period, (unsigned long)t);
+		failures++;
+	}
+}
+
+//Runs the whole stick pattern at one loop period, saving the aim at the end of every segment.
+static void run(uint16_t sensitivity, uint16_t period, SBAim_t* edges){
+	SBAim_t aim={SB_AIM_CENTRE, SB_AIM_CENTRE, SB_AIM_ACCEL_NONE};
+	uint16_t gain=aimGain(sensitivity);
+	for(uint32_t t=period; t<=FLOW_MS; t+=period){
+		const StickSegment_t* stick=&Stick[(t-period)/SEGMENT_MS];
+		aimStep(&aim, stick->x, stick->y, gain, period);
+		if(t%SEGMENT_MS==0)
+			edges[t/SEGMENT_MS-1]=aim;
+	}
+}
+
+int main(void){
+	SBAim_t reference[SEGMENTS], edges[SEGMENTS];
+
+	for(uint8_t s=0; s<sizeof(Sensitivities)/sizeof(Sensitivities[0]); s++){
+		uint16_t sensitivity=Sensitivities[s];
+		run(sensitivity, 1, reference);
+
+		//The 1ms run has to actually go somewhere for the comparison to mean anything
+		int32_t fullSpeed=aimSpeed(32767, aimGain(sensitivity), SB_AIM_ACCEL_NONE>>8);
+		check(fullSpeed>0, "full deflection moves the aim", sensitivity, 1, 0);
+		check(reference[0].x==SB_AIM_CENTRE && reference[0].y==SB_AIM_CENTRE, "centred stick holds still", sensitivity, 1, SEGMENT_MS);
+		int32_t right=SB_AIM_CENTRE+fullSpeed*SEGMENT_MS;
+		check(reference[1].x==(right>SB_AIM_LIMIT ? SB_AIM_LIMIT : right), "full right moves at full speed", sensitivity, 1, 2*SEGMENT_MS);
+		check(reference[3].x==reference[2].x && reference[3].y==reference[2].y, "deadzone holds still", sensitivity, 1, 4*SEGMENT_MS);
+		check(reference[24].x==0, "left clamp", sensitivity, 1, 25*SEGMENT_MS);
+
+		for(uint8_t p=1; p<sizeof(Periods)/sizeof(Periods[0]); p++){
+			run(sensitivity, Periods[p], edges);
+			for(uint8_t e=0; e<SEGMENTS; e++){
+				check(edges[e].x==reference[e].x && edges[e].y==reference[e].y, "same aim as the 1ms loop",
+				      sensitivity, Periods[p], (uint32_t)(e+1)*SEGMENT_MS);
+			}
+		}
+	}
+
+	//A stall is only integrated up to SB_AIM_MAX_STEP
+	SBAim_t stalled={SB_AIM_CENTRE, SB_AIM_CENTRE, SB_AIM_ACCEL_NONE}, capped=stalled;
+	aimStep(&stalled, 32767, 0, aimGain(400), 500);
+	aimStep(&capped, 32767, 0, aimGain(400), SB_AIM_MAX_STEP);
+	check(stalled.x==capped.x, "stall capped at SB_AIM_MAX_STEP", 400, 500, 0);
+
+	//Y up on the stick is up on the screen, the aim's Y runs down
+	SBAim_t up={SB_AIM_CENTRE, SB_AIM_CENTRE, SB_AIM_ACCEL_NONE};
+	check(aimStep(&up, 0, 32767, aimGain(400), 1) && up.y<SB_AIM_CENTRE, "stick up moves the aim up", 400, 1, 1);
+
+	if(failures){
+		printf("%d failed\n", failures);
+		return 1;
+	}
+	printf("sbaim: all loop periods agree\n");
+	return 0;
+}